@@ -38,7 +38,6 @@ sub PLUGIN
 	($options{name} = $name) =~ s!.*/!!;
 	$PLUGIN{$_} = $options{$_} for keys %options;
 }
-PLUGIN($0);
 
 my %OPTIONS      = ();
 my @OPT_FLAGS    = ();
@@ -67,11 +66,6 @@ sub OPTION
 		required => $options{required},
 	};
 }
-OPTION 'help|h|?',  help => 'Show this help screen';
-OPTION 'debug|D+',  help => 'Enable debugging output';
-OPTION 'noop',      help => 'Dry-run mode; no state files will be updated';
-OPTION 'prefix=s',  help => 'Prefix for result submission';
-OPTION 'timeout=i', help => 'Execution timeout, in seconds', default => 15;
 
 sub START
 {
@@ -152,10 +146,12 @@ sub TDUMP
 	print STDERR Dumper(@_);
 }
 
+my $FQDN;
 sub FQDN
 {
-	chomp(my $fqdn = qx(/bin/hostname -f));
-	$fqdn;
+	return $FQDN if defined $FQDN;
+	chomp($FQDN = qx(/bin/hostname -f));
+	$FQDN;
 }
 
 my $PREFIX;
@@ -183,7 +179,9 @@ my $UA;
 sub _ua
 {
 	if (!$UA) {
-		$UA = LWP::UserAgent->new;
+		# keep connections open, for collectors that make more than
+		# one request (or get run more than once, by perlhost)
+		$UA = LWP::UserAgent->new(keep_alive => 4);
 	}
 
 	$UA;
@@ -412,4 +410,30 @@ sub HTTP
 	}
 }
 
+# put everything back the way it was when we were loaded, so that
+# another collector can be run in the same process (see perlhost).
+# The FQDN and the user agent (and its open connections) are kept.
+sub _reset
+{
+	my ($name) = @_;
+
+	%PLUGIN = ();
+	PLUGIN($name);
+
+	%OPTIONS   = ();
+	@OPT_FLAGS = ();
+	%OPT_DEF   = ();
+	OPTION 'help|h|?',  help => 'Show this help screen';
+	OPTION 'debug|D+',  help => 'Enable debugging output';
+	OPTION 'noop',      help => 'Dry-run mode; no state files will be updated';
+	OPTION 'prefix=s',  help => 'Prefix for result submission';
+	OPTION 'timeout=i', help => 'Execution timeout, in seconds', default => 15;
+
+	$PREFIX    = undef;
+	$MARK      = time;
+	$STAGE     = 'running check';
+	@HTTP_AUTH = ();
+}
+_reset($0);
+
 1;
@@ -51,10 +51,15 @@ rm -rf $RPM_BUILD_ROOT
 %{_libdir}/bolo/collectors/hostinfo
 %{_libdir}/bolo/collectors/httpd
 %{_libdir}/bolo/collectors/linux
+%{_libdir}/bolo/collectors/logs
 %{_libdir}/bolo/collectors/mysql
+%{_libdir}/bolo/collectors/nagios
 %{_libdir}/bolo/collectors/nagwrap
 %{_libdir}/bolo/collectors/netstat
+%{_libdir}/bolo/collectors/perlhost
 %{_libdir}/bolo/collectors/process
+%{_libdir}/bolo/collectors/prometheus
+%{_libdir}/bolo/collectors/snmp_bulk
 %{_libdir}/bolo/collectors/snmp_cisco
 %{_libdir}/bolo/collectors/snmp_cisco_detect
 %{_libdir}/bolo/collectors/snmp_cisco_sys
@@ -1,9 +1,14 @@
 #include "common.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fnmatch.h>
 #include <libiptc/libiptc.h>
+#include <libiptc/libip6tc.h>
 
 typedef struct {
 	list_t l;
 
+	int         ip6;
 	const char *table;
 	const char *chain;
 	const char *comment;
@@ -11,6 +16,11 @@ typedef struct {
 	char *_data;
 } rule_t;
 
+static int s_wild(const char *s)
+{
+	return strpbrk(s, "*?[") != NULL;
+}
+
 static rule_t* s_parse_rule(const char *s)
 {
 	rule_t *rule = vmalloc(sizeof(rule_t));
@@ -19,9 +29,18 @@ static rule_t* s_parse_rule(const char *s)
 
 	rule->chain = rule->comment = NULL;
 	char *p = rule->_data;
-	rule->table = rule->_data;
 
-	while (*p) {
+	/* ip4: (the default) or ip6: */
+	if (strncmp(p, "ip6:", 4) == 0) {
+		rule->ip6 = 1;
+		p += 4;
+	} else if (strncmp(p, "ip4:", 4) == 0) {
+		p += 4;
+	}
+	rule->table = p;
+
+	/* the comment is everything after the second ':' */
+	while (*p && !rule->comment) {
 		if (*p == ':') {
 			*p++ = '\0';
 			     if (!rule->chain)   rule->chain   = p;
@@ -32,7 +51,7 @@ static rule_t* s_parse_rule(const char *s)
 		}
 	}
 
-	if (!rule->chain || !rule->comment) {
+	if (!rule->chain || !rule->comment || s_wild(rule->table)) {
 		free(rule->_data);
 		free(rule);
 		return NULL;
@@ -41,14 +60,121 @@ static rule_t* s_parse_rule(const char *s)
 	return rule;
 }
 
-static int s_matcher(const struct ipt_entry_match *m, const struct ipt_entry *e, rule_t *r)
+/* the rules we want, for one table, indexed so that each entry in
+   the table only costs a couple of hash lookups */
+typedef struct {
+	int         ip6;
+	const char *name;
+	hash_t      chains;     /* chain -> (hash_t *) comment -> rule_t */
+	list_t      wildcards;  /* rule_t's with a pattern for chain / comment */
+	int         nwild;
+} table_t;
+
+/* what we're looking for in the chain being walked */
+typedef struct {
+	table_t    *table;
+	const char *chain;
+	hash_t     *comments;   /* exact comments, or NULL */
+	rule_t    **wild;       /* wildcards whose chain pattern matches */
+	int         nwild;
+} walk_t;
+
+static void s_emit(walk_t *w, const char *comment, const struct xt_counters *c)
+{
+	const char *fam = w->table->ip6 ? "ip6:" : "";
+	printf("RATE %i %s:fw:%s%s:%s:%s.bytes   %llu\n", ts, PREFIX, fam, w->table->name, w->chain, comment, c->bcnt);
+	printf("RATE %i %s:fw:%s%s:%s:%s.packets %llu\n", ts, PREFIX, fam, w->table->name, w->chain, comment, c->pcnt);
+}
+
+static int s_matcher(const struct xt_entry_match *m, const struct xt_counters *c, walk_t *w)
+{
+	int i;
+	const char *comment = (const char *) m->data;
+	if (!streq(m->u.user.name, "comment"))
+		return 0;
+
+	if (w->comments && hash_get(w->comments, comment)) {
+		s_emit(w, comment, c);
+		return 0;
+	}
+	/* a comment like 'allow [ssh]' is still its own rule's comment,
+	   and reported as-is, before it is tried as a pattern */
+	for (i = 0; i < w->nwild; i++) {
+		if (streq(w->wild[i]->comment, comment)) {
+			s_emit(w, comment, c);
+			return 0;
+		}
+	}
+	for (i = 0; i < w->nwild; i++) {
+		if (fnmatch(w->wild[i]->comment, comment, 0) == 0) {
+			/* a wildcard can match any comment at all; keep
+			   spaces (and the like) out of the metric name */
+			char name[256], *a;
+			snprintf(name, sizeof(name), "%s", comment);
+			for (a = name; *a; a++)
+				if (!isalnum(*a) && *a != '-' && *a != '.' && *a != '_') *a = '_';
+			s_emit(w, name, c);
+			return 0;
+		}
+	}
+	return 0;
+}
+
+/* set w up for the next chain; 0 if there's nothing in it for us */
+static int s_chain(walk_t *w, table_t *table, const char *chain)
+{
+	rule_t *rule;
+
+	w->table    = table;
+	w->chain    = chain;
+	w->comments = hash_get(&table->chains, chain);
+	w->nwild    = 0;
+	for_each_object(rule, &table->wildcards, l)
+		if (fnmatch(rule->chain, chain, 0) == 0)
+			w->wild[w->nwild++] = rule;
+
+	return w->comments || w->nwild;
+}
+
+static int s_walk4(table_t *table, walk_t *w)
 {
-	if (streq(m->u.user.name, "comment")
-	 && streq((char *) m->data, r->comment)) {
+	struct xtc_handle *handle = iptc_init(table->name);
+	if (!handle) {
+		fprintf(stderr, "unable to read the %s table: %s\n", table->name, iptc_strerror(errno));
+		return 1;
+	}
+
+	const char *chain;
+	const struct ipt_entry *entry;
+	for (chain = iptc_first_chain(handle); chain; chain = iptc_next_chain(handle)) {
+		if (!s_chain(w, table, chain))
+			continue;
 
-		printf("RATE %i %s:fw:%s:%s:%s.bytes   %llu\n", ts, PREFIX, r->table, r->chain, r->comment, e->counters.bcnt);
-		printf("RATE %i %s:fw:%s:%s:%s.packets %llu\n", ts, PREFIX, r->table, r->chain, r->comment, e->counters.pcnt);
+		for (entry = iptc_first_rule(chain, handle); entry; entry = iptc_next_rule(entry, handle))
+			IPT_MATCH_ITERATE(entry, s_matcher, &entry->counters, w);
 	}
+	iptc_free(handle);
+	return 0;
+}
+
+static int s_walk6(table_t *table, walk_t *w)
+{
+	struct xtc_handle *handle = ip6tc_init(table->name);
+	if (!handle) {
+		fprintf(stderr, "unable to read the ip6 %s table: %s\n", table->name, ip6tc_strerror(errno));
+		return 1;
+	}
+
+	const char *chain;
+	const struct ip6t_entry *entry;
+	for (chain = ip6tc_first_chain(handle); chain; chain = ip6tc_next_chain(handle)) {
+		if (!s_chain(w, table, chain))
+			continue;
+
+		for (entry = ip6tc_first_rule(chain, handle); entry; entry = ip6tc_next_rule(entry, handle))
+			IP6T_MATCH_ITERATE(entry, s_matcher, &entry->counters, w);
+	}
+	ip6tc_free(handle);
 	return 0;
 }
 
@@ -64,9 +190,10 @@ int main(int argc, char **argv)
 	assert(RULES[0]);
 
 	hash_t tables = { 0 };
-	LIST(rules);
 
 	rule_t *rule;
+	table_t *table;
+	hash_t *comments;
 	int i, error = 0;
 	for (i = 0; RULES[i]; i++) {
 		rule = s_parse_rule(RULES[i]);
@@ -76,37 +203,39 @@ int main(int argc, char **argv)
 			continue;
 		}
 
-		if (!hash_get(&tables, rule->table)) {
-			struct xtc_handle *handle = iptc_init(rule->table);
-			assert(handle);
-			hash_set(&tables, rule->table, handle);
+		char *key = string("%s%s", rule->ip6 ? "ip6:" : "", rule->table);
+		if (!(table = hash_get(&tables, key))) {
+			table = hash_set(&tables, key, vmalloc(sizeof(table_t)));
+			table->ip6  = rule->ip6;
+			table->name = rule->table;
+			list_init(&table->wildcards);
 		}
 
-		list_push(&rules, &rule->l);
+		if (s_wild(rule->chain) || s_wild(rule->comment)) {
+			list_push(&table->wildcards, &rule->l);
+			table->nwild++;
+			continue;
+		}
+
+		if (!(comments = hash_get(&table->chains, rule->chain)))
+			comments = hash_set(&table->chains, rule->chain, vmalloc(sizeof(hash_t)));
+		hash_set(comments, rule->comment, rule);
 	}
 	if (error)
 		return 1;
 
+	/* one pass over each table: chains we have no rules for are
+	   skipped outright, and every entry in the rest is looked up
+	   by its comment (and then tried against any wildcards).  The
+	   snapshot is let go as soon as we're done with it. */
 	ts = time_s();
 	char *name;
-	struct xtc_handle *table;
 	for_each_key_value(&tables, name, table) {
-		rule_t *rule;
-		const char *chain;
-		const struct ipt_entry *entry;
-
-		for (chain = iptc_first_chain(table); chain; chain = iptc_next_chain(table)) {
-			for_each_object(rule, &rules, l) {
-				if (!streq(rule->table, name)
-				 || !streq(rule->chain, chain))
-					continue;
-
-				for (entry = iptc_first_rule(chain, table); entry; entry = iptc_next_rule(entry, table))
-					IPT_MATCH_ITERATE(entry, s_matcher, entry, rule);
-			}
-		}
+		walk_t w = { .wild = vmalloc((table->nwild + 1) * sizeof(rule_t *)) };
+		error += table->ip6 ? s_walk6(table, &w) : s_walk4(table, &w);
+		free(w.wild);
 	}
-	return 0;
+	return error ? 2 : 0;
 }
 
 int parse_options(int argc, char **argv)
@@ -133,12 +262,22 @@ int parse_options(int argc, char **argv)
 			                "\n"
 			                "Rules must be specified in the form\n"
 			                "\n"
-			                "    filter:CHAIN:comment\n"
+			                "    [ip6:]table:CHAIN:comment\n"
 			                "\n"
 			                "At least one rule must be specified; all will be evaluated\n"
-			                "together, in parallel\n"
+			                "together, in parallel, reading each table only once.\n"
 			                "You may need to quote these, if <comment> contains spaces.\n"
 			                "\n"
+			                "Rules starting with ip6: are looked up in the ip6tables\n"
+			                "table, and reported as fw:ip6:table:CHAIN:comment.\n"
+			                "\n"
+			                "CHAIN and comment may be shell-style wildcards (*, ? and\n"
+			                "[...]), to report on every commented rule that matches;\n"
+			                "the table must be named outright.  Comments matched this way\n"
+			                "are reported with anything but letters, digits, '-', '.' and\n"
+			                "'_' replaced by '_'; a comment that is exactly what was asked\n"
+			                "for (i.e. 'allow [ssh]') is always reported as-is.\n"
+			                "\n"
 			                "To add a comment to an iptable rule you will need add the\n"
 			                "following command line switches to your iptables call\n"
 			                "    -m comment --comment \"limit ssh access\"\n"
@@ -147,6 +286,7 @@ int parse_options(int argc, char **argv)
 			                "\n"
 			                "EXAMPLE:\n"
 			                "    fw filter:INPUT:\"limit ssh access\"\n"
+			                "    fw 'filter:*:*' 'ip6:filter:INPUT:svc-*'\n"
 			                "\n");
 			exit(0);
 		}
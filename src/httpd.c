@@ -6,126 +6,486 @@
 
 #define UA PACKAGE_NAME " (httpd)/" PACKAGE_VERSION
 
-static size_t ng_writer(void *buf, size_t each, size_t n, void *user)
-{
-	uint64_t v[7];
-	if (sscanf(buf, "Active connections: %lu\n"
-	                "server accepts handled requests\n"
-	                " %lu %lu %lu\n"
-	                "Reading: %lu Writing: %lu Waiting: %lu\n",
-	                &v[0],
-	                &v[1], &v[2], &v[3],
-	                &v[4], &v[5], &v[6]) == 7) {
-
-		int32_t ts = time_s();
-		printf("RATE %i %s:nginx:requests.accepted %lu\n", ts, PREFIX, v[1]);
-		printf("RATE %i %s:nginx:requests.handled %lu\n",  ts, PREFIX, v[2]);
-		printf("RATE %i %s:nginx:requests.total %lu\n",    ts, PREFIX, v[3]);
-
-		printf("SAMPLE %i %s:nginx:connections.active %lu\n",  ts, PREFIX, v[0]);
-		printf("SAMPLE %i %s:nginx:connections.reading %lu\n", ts, PREFIX, v[4]);
-		printf("SAMPLE %i %s:nginx:connections.writing %lu\n", ts, PREFIX, v[5]);
-		printf("SAMPLE %i %s:nginx:connections.waiting %lu\n", ts, PREFIX, v[6]);
+/* longest line we'll carry over from one chunk to the next;
+   the Scoreboard: line is counted as it streams by, instead */
+#define CARRY_MAX 256
+
+#define NGINX_FIELDS  7
+#define APACHE_FIELDS 5
+
+typedef struct {
+	char   *url;
+	char   *tag;     /* optional; goes between the type and the metric */
+	char   *socket;  /* optional; path to a unix domain socket */
+
+	CURL   *curl;
+	char    error[CURL_ERROR_SIZE];
+	int     ok;
+
+	/* parser state, carried across write callbacks */
+	char     line[CARRY_MAX];
+	size_t   len;
+	int      counts;      /* nginx: next line is accepts/handled/requests */
+	int      scoreboard;  /* apache: in the middle of the Scoreboard: line */
+	int      boarded;     /* apache: saw a Scoreboard: line at all */
+	uint32_t board[256];  /* apache: scoreboard byte histogram */
+	uint64_t v[8];
+	double   bytes;
+	unsigned seen;        /* bitmask of v[] (and bytes) that we found */
+} target_t;
+
+static struct {
+	target_t *targets;
+	int       ntargets;
+
+	char     *socket;       /* default unix socket, for -U */
+	int       concurrency;
+	int       timeout;
+	int       interval;
+	void    (*parse)(target_t *, const char *, const char *);
+	void    (*report)(target_t *);
+	const char *default_url;
+} OPTIONS = {
+	.concurrency = 16,
+	.timeout     = 5,
+	.interval    = 0,
+};
+
+/* metric name prefix for a target, i.e. "nginx" or "nginx:TAG" */
+static const char* s_name(target_t *t, const char *type)
+{
+	static char name[256];
+	if (t->tag)
+		snprintf(name, sizeof(name), "%s:%s", type, t->tag);
+	else
+		snprintf(name, sizeof(name), "%s", type);
+	return name;
+}
+
+static void s_reset(target_t *t)
+{
+	t->ok = 0;
+	t->error[0] = '\0';
+	t->len = 0;
+	t->counts = t->scoreboard = t->boarded = 0;
+	t->seen = 0;
+	memset(t->board, 0, sizeof(t->board));
+}
+
+/* does the line [a,b) start with the given literal? */
+#define starts(a,b,lit) ((size_t)((b) - (a)) >= sizeof(lit) - 1 && memcmp((a), (lit), sizeof(lit) - 1) == 0)
+
+/* pull the next run of digits out of [*p,end) */
+static int s_number(const char **p, const char *end, uint64_t *v)
+{
+	const char *s = *p;
+	while (s < end && !isdigit(*s)) s++;
+	if (s == end)
+		return 0;
+
+	*v = 0;
+	while (s < end && isdigit(*s))
+		*v = *v * 10 + (*s++ - '0');
+	*p = s;
+	return 1;
+}
+
+/* Count scoreboard bytes.  A scoreboard is mostly long runs of '_'
+   and '.', and with a single table every byte of a run would
+   increment the same counter, each waiting on the store before it.
+   Four tables, one per byte position, give four independent chains
+   of increments that can be in flight at once; they're summed at
+   the end. */
+static void s_histogram(target_t *t, const unsigned char *p, const unsigned char *end)
+{
+	static uint32_t h[4][256];
+	int i;
+
+	while (end - p >= 4) {
+		h[0][p[0]]++;
+		h[1][p[1]]++;
+		h[2][p[2]]++;
+		h[3][p[3]]++;
+		p += 4;
 	}
-	return n * each;
+	while (p < end)
+		h[0][*p++]++;
+
+	for (i = 0; i < 256; i++)
+		t->board[i] += h[0][i] + h[1][i] + h[2][i] + h[3][i];
+	memset(h, 0, sizeof(h));
 }
 
-static int collect_nginx(const char *url)
+static void parse_nginx(target_t *t, const char *a, const char *b)
 {
-	int rc = 0;
+	const char *p = a;
 
-	if (!url)
-		url = "http://localhost/nginx_status";
+	if (t->counts) {
+		t->counts = 0;
+		if (s_number(&p, b, &t->v[1])
+		 && s_number(&p, b, &t->v[2])
+		 && s_number(&p, b, &t->v[3]))
+			t->seen |= (1 << 1) | (1 << 2) | (1 << 3);
+		return;
+	}
 
-	curl_global_init(CURL_GLOBAL_ALL);
-	CURL *c = curl_easy_init();
-	if (!c)
-		return 1;
+	if (starts(a, b, "Active connections:")) {
+		if (s_number(&p, b, &t->v[0]))
+			t->seen |= 1 << 0;
 
-	char error[CURL_ERROR_SIZE];
-	curl_easy_setopt(c, CURLOPT_NOSIGNAL,      1);
-	curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, ng_writer);
-	curl_easy_setopt(c, CURLOPT_USERAGENT,     UA);
-	curl_easy_setopt(c, CURLOPT_ERRORBUFFER,   error);
-	curl_easy_setopt(c, CURLOPT_URL,           url);
+	} else if (starts(a, b, "server accepts handled requests")) {
+		t->counts = 1;
 
-	if (curl_easy_perform(c) != CURLE_OK) {
-		fprintf(stderr, "e:%s\n", error);
-		return 2;
+	} else if (starts(a, b, "Reading:")) {
+		if (s_number(&p, b, &t->v[4])
+		 && s_number(&p, b, &t->v[5])
+		 && s_number(&p, b, &t->v[6]))
+			t->seen |= (1 << 4) | (1 << 5) | (1 << 6);
 	}
+}
 
-	return 0;
+static void report_nginx(target_t *t)
+{
+	if (t->seen != (1 << NGINX_FIELDS) - 1)
+		return;
+
+	uint64_t *v = t->v;
+	const char *name = s_name(t, "nginx");
+	printf("RATE %i %s:%s:requests.accepted %lu\n", ts, PREFIX, name, v[1]);
+	printf("RATE %i %s:%s:requests.handled %lu\n",  ts, PREFIX, name, v[2]);
+	printf("RATE %i %s:%s:requests.total %lu\n",    ts, PREFIX, name, v[3]);
+
+	printf("SAMPLE %i %s:%s:connections.active %lu\n",  ts, PREFIX, name, v[0]);
+	printf("SAMPLE %i %s:%s:connections.reading %lu\n", ts, PREFIX, name, v[4]);
+	printf("SAMPLE %i %s:%s:connections.writing %lu\n", ts, PREFIX, name, v[5]);
+	printf("SAMPLE %i %s:%s:connections.waiting %lu\n", ts, PREFIX, name, v[6]);
 }
 
-static size_t apache_writer(void *buf, size_t each, size_t n, void *user)
+static void parse_apache(target_t *t, const char *a, const char *b)
 {
-	uint64_t v[4];
-	double b;
+	const char *p = a;
+
+	if (starts(a, b, "Scoreboard:")) {
+		t->boarded = 1;
+		s_histogram(t, (const unsigned char *)a + 11, (const unsigned char *)b);
+
+	} else if (starts(a, b, "Total Accesses:")) {
+		if (s_number(&p, b, &t->v[0]))
+			t->seen |= 1 << 0;
 
-	if (sscanf(buf, "Total Accesses: %lu\n"
-	                "Total kBytes: %lu\n"
-	                "Uptime: %*u\n"
-	                "ReqPerSec: %*f\n"
-	                "BytesPerSec: %*f\n"
-	                "BytesPerReq: %lf\n"
-	                "BusyWorkers: %lu\n"
-	                "IdleWorkers: %lu\n",
-	                &v[0], &v[1], &b, &v[2], &v[3]) == 5) {
+	} else if (starts(a, b, "Total kBytes:")) {
+		if (s_number(&p, b, &t->v[1]))
+			t->seen |= 1 << 1;
 
-		int32_t ts = time_s();
-		printf("RATE %i %s:apache:requests.total %lu\n", ts, PREFIX, v[0]);
-		printf("RATE %i %s:apache:requests.bytes %lu\n", ts, PREFIX, v[1] * 1024);
-		printf("SAMPLE %i %s:apache:request.size %lf\n", ts, PREFIX, b);
-		printf("SAMPLE %i %s:apache:workers.busy %lu\n", ts, PREFIX, v[2]);
-		printf("SAMPLE %i %s:apache:workers.idle %lu\n", ts, PREFIX, v[3]);
+	} else if (starts(a, b, "BusyWorkers:")) {
+		if (s_number(&p, b, &t->v[2]))
+			t->seen |= 1 << 2;
+
+	} else if (starts(a, b, "IdleWorkers:")) {
+		if (s_number(&p, b, &t->v[3]))
+			t->seen |= 1 << 3;
+
+	} else if (starts(a, b, "BytesPerReq:")) {
+		char num[64], *end;
+		size_t n = MIN((size_t)(b - a) - 12, sizeof(num) - 1);
+		memcpy(num, a + 12, n);
+		num[n] = '\0';
+		t->bytes = strtod(num, &end);
+		if (end != num)
+			t->seen |= 1 << 4;
 	}
-	return n * each;
 }
 
-static int collect_apache(const char *url)
+static struct {
+	char        c;
+	const char *name;
+} SCOREBOARD[] = {
+	{ '_', "waiting"   },
+	{ 'S', "starting"  },
+	{ 'R', "reading"   },
+	{ 'W', "sending"   },
+	{ 'K', "keepalive" },
+	{ 'D', "dns"       },
+	{ 'C', "closing"   },
+	{ 'L', "logging"   },
+	{ 'G', "finishing" },
+	{ 'I', "cleanup"   },
+	{ '.', "open"      },
+	{ 0, 0 },
+};
+
+static void report_apache(target_t *t)
 {
-	int rc = 0;
+	if (t->seen != (1 << APACHE_FIELDS) - 1)
+		return;
 
-	if (!url)
-		url = "http://localhost/server-status?auto";
+	uint64_t *v = t->v;
+	const char *name = s_name(t, "apache");
+	printf("RATE %i %s:%s:requests.total %lu\n", ts, PREFIX, name, v[0]);
+	printf("RATE %i %s:%s:requests.bytes %lu\n", ts, PREFIX, name, v[1] * 1024);
+	printf("SAMPLE %i %s:%s:request.size %lf\n", ts, PREFIX, name, t->bytes);
+	printf("SAMPLE %i %s:%s:workers.busy %lu\n", ts, PREFIX, name, v[2]);
+	printf("SAMPLE %i %s:%s:workers.idle %lu\n", ts, PREFIX, name, v[3]);
 
-	curl_global_init(CURL_GLOBAL_ALL);
-	CURL *c = curl_easy_init();
-	if (!c)
-		return 1;
+	if (t->boarded) {
+		int i;
+		for (i = 0; SCOREBOARD[i].name; i++)
+			printf("SAMPLE %i %s:%s:scoreboard.%s %u\n", ts, PREFIX, name,
+				SCOREBOARD[i].name, t->board[(unsigned char)SCOREBOARD[i].c]);
+	}
+}
+
+/* Feed one chunk of the response body through the line parser.
+   Complete lines are parsed where they sit in libcurl's buffer; only
+   a line that straddles two chunks gets copied, into t->line.  The
+   Scoreboard: line can run to thousands of bytes, so once we know
+   we're in it we count the bytes as they arrive and never buffer. */
+static size_t s_writer(void *buf, size_t each, size_t n, void *user)
+{
+	target_t *t = (target_t *)user;
+	const char *p   = buf;
+	const char *end = p + each * n;
+
+	while (p < end) {
+		const char *nl = memchr(p, '\n', end - p);
+		const char *eol = nl ? nl : end;
+
+		if (t->scoreboard) {
+			s_histogram(t, (const unsigned char *)p, (const unsigned char *)eol);
+			if (nl)
+				t->scoreboard = 0;
+
+		} else if (t->len == 0 && nl) {
+			OPTIONS.parse(t, p, eol);
+
+		} else {
+			size_t len = MIN((size_t)(eol - p), sizeof(t->line) - t->len);
+			memcpy(t->line + t->len, p, len);
+			t->len += len;
 
-	char error[CURL_ERROR_SIZE];
-	curl_easy_setopt(c, CURLOPT_NOSIGNAL,      1);
-	curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, apache_writer);
-	curl_easy_setopt(c, CURLOPT_USERAGENT,     UA);
-	curl_easy_setopt(c, CURLOPT_ERRORBUFFER,   error);
-	curl_easy_setopt(c, CURLOPT_URL,           url);
+			if (OPTIONS.parse == parse_apache && starts(t->line, t->line + t->len, "Scoreboard:")) {
+				OPTIONS.parse(t, t->line, t->line + t->len);
+				s_histogram(t, (const unsigned char *)p + len, (const unsigned char *)eol);
+				t->scoreboard = !nl;
+				t->len = 0;
 
-	if (curl_easy_perform(c) != CURLE_OK) {
-		fprintf(stderr, "e:%s\n", error);
-		return 2;
+			} else if (nl) {
+				OPTIONS.parse(t, t->line, t->line + t->len);
+				t->len = 0;
+			}
+		}
+
+		p = nl ? nl + 1 : end;
 	}
+	return each * n;
+}
+
+/* a body that doesn't end in a newline leaves its last line behind */
+static void s_finish(target_t *t)
+{
+	if (t->len)
+		OPTIONS.parse(t, t->line, t->line + t->len);
+	t->len = 0;
+}
+
+static int s_setup(target_t *t)
+{
+	t->curl = curl_easy_init();
+	if (!t->curl)
+		return 1;
 
+	curl_easy_setopt(t->curl, CURLOPT_NOSIGNAL,      1L);
+	curl_easy_setopt(t->curl, CURLOPT_WRITEFUNCTION, s_writer);
+	curl_easy_setopt(t->curl, CURLOPT_WRITEDATA,     t);
+	curl_easy_setopt(t->curl, CURLOPT_PRIVATE,       t);
+	curl_easy_setopt(t->curl, CURLOPT_USERAGENT,     UA);
+	curl_easy_setopt(t->curl, CURLOPT_ERRORBUFFER,   t->error);
+	curl_easy_setopt(t->curl, CURLOPT_URL,           t->url);
+	curl_easy_setopt(t->curl, CURLOPT_TIMEOUT,       (long)OPTIONS.timeout);
+	curl_easy_setopt(t->curl, CURLOPT_FAILONERROR,   1L);
+	if (t->socket || OPTIONS.socket)
+		curl_easy_setopt(t->curl, CURLOPT_UNIX_SOCKET_PATH, t->socket ? t->socket : OPTIONS.socket);
 	return 0;
 }
 
-static char *URL = NULL;
-static int (*COLLECTOR)(const char *);
+/* Fetch every target through one multi handle, keeping at most
+   --concurrency transfers in flight.  The multi handle (and the easy
+   handles) live as long as the process does, so under --interval the
+   connections from the last round get picked back up. */
+static int s_scrape(CURLM *m)
+{
+	int next = 0, running = 0, failed = 0;
+
+	for (;;) {
+		while (running < OPTIONS.concurrency && next < OPTIONS.ntargets) {
+			target_t *t = &OPTIONS.targets[next++];
+			s_reset(t);
+			curl_multi_add_handle(m, t->curl);
+			running++;
+		}
+		if (running == 0)
+			break;
+
+		int still;
+		curl_multi_perform(m, &still);
+
+		CURLMsg *msg;
+		int left;
+		while ((msg = curl_multi_info_read(m, &left)) != NULL) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+
+			target_t *t;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&t);
+			if (msg->data.result == CURLE_OK) {
+				s_finish(t);
+				t->ok = 1;
+			} else {
+				fprintf(stderr, "%s: %s\n", t->url,
+					t->error[0] ? t->error : curl_easy_strerror(msg->data.result));
+				failed++;
+			}
+			curl_multi_remove_handle(m, msg->easy_handle);
+			running--;
+		}
+
+		if (still > 0)
+			curl_multi_wait(m, NULL, 0, 1000, NULL);
+	}
+
+	ts = time_s();
+	int i;
+	for (i = 0; i < OPTIONS.ntargets; i++)
+		if (OPTIONS.targets[i].ok)
+			OPTIONS.report(&OPTIONS.targets[i]);
+	fflush(stdout);
+
+	return failed;
+}
+
 int parse_options(int argc, char **argv);
 
 int main(int argc, char **argv)
 {
 	if (parse_options(argc, argv) != 0) {
-		fprintf(stderr, "USAGE: %s [options] URL\n", argv[0]);
+		fprintf(stderr, "USAGE: %s [options] [[TAG=]URL ...]\n", argv[0]);
 		exit(1);
 	}
 
-	return COLLECTOR(URL);
+	curl_global_init(CURL_GLOBAL_ALL);
+	CURLM *m = curl_multi_init();
+	if (!m)
+		return 1;
+	curl_multi_setopt(m, CURLMOPT_MAXCONNECTS, (long)OPTIONS.ntargets);
+
+	int i;
+	for (i = 0; i < OPTIONS.ntargets; i++)
+		if (s_setup(&OPTIONS.targets[i]) != 0)
+			return 1;
+
+	int rc;
+	for (;;) {
+		int64_t started = time_ms();
+		rc = s_scrape(m) ? 2 : 0;
+
+		if (!OPTIONS.interval)
+			break;
+
+		int64_t left = started + OPTIONS.interval * 1000 - time_ms();
+		if (left > 0)
+			usleep(left * 1000);
+	}
+
+	for (i = 0; i < OPTIONS.ntargets; i++)
+		curl_easy_cleanup(OPTIONS.targets[i].curl);
+	curl_multi_cleanup(m);
+	curl_global_cleanup();
+	return rc;
+}
+
+/* [TAG=]URL; anything before an '=' that looks like part of
+   the URL (i.e. has a ':' or '/' in it) is not a tag. */
+static void s_add_target(const char *spec, const char *socket)
+{
+	OPTIONS.targets = realloc(OPTIONS.targets, (OPTIONS.ntargets + 1) * sizeof(target_t));
+	target_t *t = &OPTIONS.targets[OPTIONS.ntargets++];
+	memset(t, 0, sizeof(target_t));
+
+	const char *eq = strchr(spec, '=');
+	if (eq && eq != spec && strcspn(spec, ":/") > (size_t)(eq - spec)) {
+		t->tag = strndup(spec, eq - spec);
+		spec = eq + 1;
+	}
+	t->url    = strdup(spec);
+	t->socket = socket ? strdup(socket) : NULL;
+}
+
+/* a default tag for a URL, from its host[:port], i.e.
+   "http://web1:8080/nginx_status" -> "web1_8080" */
+static char* s_url_tag(const char *url)
+{
+	const char *a = strstr(url, "://");
+	a = a ? a + 3 : url;
+
+	size_t n = strcspn(a, "/?#");
+	const char *at = memchr(a, '@', n);
+	if (at) {
+		n -= at + 1 - a;
+		a  = at + 1;
+	}
+
+	char *tag = strndup(a, n), *c;
+	for (c = tag; *c; c++)
+		if (!isalnum(*c) && *c != '.' && *c != '-')
+			*c = '_';
+	return tag;
+}
+
+/* one target per line: [TAG=]URL [unix:/path/to/socket] */
+static int s_read_targets(const char *file)
+{
+	FILE *io = streq(file, "-") ? stdin : fopen(file, "r");
+	if (!io) {
+		fprintf(stderr, "%s: %s\n", file, strerror(errno));
+		return 1;
+	}
+
+	char line[8192];
+	int n = 0, errors = 0;
+	while (fgets(line, sizeof(line), io) != NULL) {
+		n++;
+		char *a = line;
+		while (isspace(*a)) a++;
+		if (!*a || *a == '#')
+			continue;
+
+		char *b = a;
+		while (*b && !isspace(*b)) b++;
+		if (*b) *b++ = '\0';
+		while (isspace(*b)) b++;
+
+		char *c = b;
+		while (*c && !isspace(*c)) c++;
+		*c = '\0';
+
+		if (*b && strncmp(b, "unix:", 5) != 0) {
+			fprintf(stderr, "%s:%i: expected unix:/path/to/socket, not '%s'\n", file, n, b);
+			errors++;
+			continue;
+		}
+		s_add_target(a, *b ? b + 5 : NULL);
+	}
+
+	if (io != stdin)
+		fclose(io);
+	return errors;
 }
 
 int parse_options(int argc, char **argv)
 {
-	COLLECTOR = collect_nginx; /* default */
+	OPTIONS.parse       = parse_nginx; /* default */
+	OPTIONS.report      = report_nginx;
+	OPTIONS.default_url = "http://localhost/nginx_status";
 	int errors = 0;
 
 	int i;
@@ -145,20 +505,72 @@ int parse_options(int argc, char **argv)
 				return 1;
 			}
 			if (streq(argv[i], "nginx")) {
-				COLLECTOR = collect_nginx;
+				OPTIONS.parse       = parse_nginx;
+				OPTIONS.report      = report_nginx;
+				OPTIONS.default_url = "http://localhost/nginx_status";
 				continue;
 			}
 			if (streq(argv[i], "apache")) {
-				COLLECTOR = collect_apache;
+				OPTIONS.parse       = parse_apache;
+				OPTIONS.report      = report_apache;
+				OPTIONS.default_url = "http://localhost/server-status?auto";
 				continue;
 			}
 			fprintf(stderr, "Unrecognized HTTP server type '%s'\n", argv[i]);
 			return 1;
 		}
 
+		if (streq(argv[i], "-f") || streq(argv[i], "--file")) {
+			if (++i >= argc) {
+				fprintf(stderr, "Missing required value for -f\n");
+				return 1;
+			}
+			errors += s_read_targets(argv[i]);
+			continue;
+		}
+
+		if (streq(argv[i], "-U") || streq(argv[i], "--unix-socket")) {
+			if (++i >= argc) {
+				fprintf(stderr, "Missing required value for -U\n");
+				return 1;
+			}
+			OPTIONS.socket = strdup(argv[i]);
+			continue;
+		}
+
+		if (streq(argv[i], "-c") || streq(argv[i], "--concurrency")) {
+			if (++i >= argc) {
+				fprintf(stderr, "Missing required value for -c\n");
+				return 1;
+			}
+			OPTIONS.concurrency = atoi(argv[i]);
+			if (OPTIONS.concurrency < 1) OPTIONS.concurrency = 1;
+			continue;
+		}
+
+		if (streq(argv[i], "-T") || streq(argv[i], "--timeout")) {
+			if (++i >= argc) {
+				fprintf(stderr, "Missing required value for -T\n");
+				return 1;
+			}
+			OPTIONS.timeout = atoi(argv[i]);
+			if (OPTIONS.timeout < 1) OPTIONS.timeout = 1;
+			continue;
+		}
+
+		if (streq(argv[i], "-i") || streq(argv[i], "--interval")) {
+			if (++i >= argc) {
+				fprintf(stderr, "Missing required value for -i\n");
+				return 1;
+			}
+			OPTIONS.interval = atoi(argv[i]);
+			if (OPTIONS.interval < 0) OPTIONS.interval = 0;
+			continue;
+		}
+
 		if (streq(argv[i], "-h") || streq(argv[i], "-?") || streq(argv[i], "--help")) {
 			fprintf(stdout, "httpd (a Bolo collector)\n"
-			                "USAGE: httpd [options] URL\n"
+			                "USAGE: httpd [options] [[TAG=]URL ...]\n"
 			                "\n"
 			                "options:\n"
 			                "   -h, --help               Show this help screen\n"
@@ -166,12 +578,24 @@ int parse_options(int argc, char **argv)
 			                "                            (FQDN is used by default)\n"
 			                "   -t, --type TYPE          What type of HTTP server.  Default to 'nginx'\n"
 			                "                            Valid values: apache, nginx\n"
+			                "   -f, --file FILE          Read more targets from FILE, one per line,\n"
+			                "                            as '[TAG=]URL [unix:/path/to/socket]'\n"
+			                "   -U, --unix-socket PATH   Connect to PATH instead of the URL's host,\n"
+			                "                            for targets that don't name their own\n"
+			                "   -c, --concurrency N      Fetch at most N URLs at once (default 16)\n"
+			                "   -T, --timeout SECONDS    Give up on a URL after SECONDS (default 5)\n"
+			                "   -i, --interval SECONDS   Keep running, collecting every SECONDS,\n"
+			                "                            and reuse connections between runs\n"
+			                "\n"
+			                "Metrics for a TAG=URL target are named TYPE:TAG:metric.  When\n"
+			                "there is more than one target, those without a TAG are tagged\n"
+			                "with their URL's host and port, i.e. nginx:web1_8080:metric.\n"
 			                "\n");
 			exit(0);
 		}
 
-		if (!URL && argv[i][0] != '-') {
-			URL = strdup(argv[i]);
+		if (argv[i][0] != '-') {
+			s_add_target(argv[i], NULL);
 
 		} else {
 			fprintf(stderr, "Unrecognized argument '%s'\n", argv[i]);
@@ -179,6 +603,24 @@ int parse_options(int argc, char **argv)
 		}
 	}
 
+	if (!OPTIONS.ntargets)
+		s_add_target(OPTIONS.default_url, NULL);
+
+	/* with more than one target, an untagged one would report the
+	   same metric names as the others; tag it with its host:port */
+	int j;
+	if (OPTIONS.ntargets > 1)
+		for (i = 0; i < OPTIONS.ntargets; i++)
+			if (!OPTIONS.targets[i].tag)
+				OPTIONS.targets[i].tag = s_url_tag(OPTIONS.targets[i].url);
+	for (i = 0; i < OPTIONS.ntargets; i++)
+		for (j = i + 1; j < OPTIONS.ntargets; j++)
+			if (OPTIONS.targets[i].tag && streq(OPTIONS.targets[i].tag, OPTIONS.targets[j].tag)) {
+				fprintf(stderr, "%s and %s would both be tagged '%s'; give one of them a TAG=\n",
+					OPTIONS.targets[i].url, OPTIONS.targets[j].url, OPTIONS.targets[i].tag);
+				errors++;
+			}
+
 	INIT_PREFIX();
 
 	return errors;
@@ -1,5 +1,8 @@
 #include "common.h"
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/statvfs.h>
 #include <pcre.h>
 
@@ -23,6 +26,43 @@ typedef struct __matcher {
 static matcher_t *EXCLUDE = NULL;
 static matcher_t *INCLUDE = NULL;
 
+/* top: the K heaviest processes by cpu, rss and io, found during the
+   same /proc walk that counts process states.  each dimension is a
+   fixed-size min-heap, so memory doesn't grow with the process count. */
+#define TOP_MAX 64
+typedef struct {
+	double value;
+	int    pid;
+	char   comm[17];
+} top_t;
+
+typedef struct {
+	top_t e[TOP_MAX];
+	int   n;
+} heap_t;
+
+/* cpu and io are counters, so the previous run's are kept on disk,
+   one record per PID, in PID order (which is how /proc lists them) */
+typedef struct {
+	char    magic[8];
+	int64_t ms;
+} snaphdr_t;
+#define SNAP_MAGIC "BOLOTOP1"
+
+typedef struct {
+	int32_t  pid;
+	uint32_t flags;
+	uint64_t start;  /* starttime, to tell a recycled PID apart */
+	uint64_t cpu;    /* utime + stime, in ticks */
+	uint64_t io;     /* read_bytes + write_bytes */
+} snap_t;
+#define SNAP_IO 0x1
+
+static struct {
+	int   k;
+	char *state;
+} TOP = { 0, NULL };
+
 int collect_meminfo(void);
 int collect_loadavg(void);
 int collect_stat(void);
@@ -57,7 +97,7 @@ int main(int argc, char **argv)
 	TRY_STAT(rc, meminfo);
 	TRY_STAT(rc, loadavg);
 	TRY_STAT(rc, stat);
-	TRY_STAT(rc, procs);
+	if (should("procs") || TOP.k) rc += collect_procs();
 	TRY_STAT(rc, openfiles);
 	TRY_STAT(rc, mounts);
 	TRY_STAT(rc, vmstat);
@@ -105,6 +145,29 @@ int parse_options(int argc, char **argv)
 			continue;
 		}
 
+		if (streq(argv[i], "-t") || streq(argv[i], "--top")) {
+			if (++i >= argc) {
+				fprintf(stderr, "Missing required value for --top flag\n");
+				return 1;
+			}
+			TOP.k = atoi(argv[i]);
+			if (TOP.k < 1 || TOP.k > TOP_MAX) {
+				fprintf(stderr, "--top must be between 1 and %i\n", TOP_MAX);
+				return 1;
+			}
+			continue;
+		}
+
+		if (streq(argv[i], "--top-state")) {
+			if (++i >= argc) {
+				fprintf(stderr, "Missing required value for --top-state flag\n");
+				return 1;
+			}
+			free(TOP.state);
+			TOP.state = strdup(argv[i]);
+			continue;
+		}
+
 		if (streq(argv[i], "-h") || streq(argv[i], "-?") || streq(argv[i], "--help")) {
 			fprintf(stdout, "linux (a Bolo collector)\n"
 			                "USAGE: linux [flags] [metrics]\n"
@@ -127,6 +190,13 @@ int parse_options(int argc, char **argv)
 			                "                              to match liberally first, and exclude\n"
 			                "                              conservatively.\n"
 			                "\n"
+			                "   -t, --top K                Also report the K (at most %i) busiest\n"
+			                "                              processes by cpu, rss and disk io, as\n"
+			                "                              top:{cpu,rss,io}:COMM.  cpu (%%) and io\n"
+			                "                              (bytes/s) are since the last run.\n"
+			                "       --top-state FILE       Where to keep the last run's counters\n"
+			                "                              (default /var/lib/bolo/linux-top)\n"
+			                "\n"
 			                "metrics:\n"
 			                "\n"
 			                "   (no)mem           Memory utilization metrics\n"
@@ -142,7 +212,7 @@ int parse_options(int argc, char **argv)
 			                "   By default, all metrics are collected.  You can suppress specific\n"
 			                "   metric sets by prefixing its name with \"no\", without having to\n"
 			                "   list out everything you want explicitly.\n"
-			                "\n");
+			                "\n", TOP_MAX);
 			exit(0);
 		}
 
@@ -170,6 +240,11 @@ int parse_options(int argc, char **argv)
 	}
 
 	INIT_PREFIX();
+	if (TOP.k && !TOP.state) {
+		/* somewhere only root can write to; see collect_procs() */
+		mkdir("/var/lib/bolo", 0755);
+		TOP.state = strdup("/var/lib/bolo/linux-top");
+	}
 
 	if (nflagged == 0) {
 		if (!masked("meminfo"))   RUN("meminfo");
@@ -430,6 +505,131 @@ int collect_stat(void)
 	return 0;
 }
 
+static void s_top(heap_t *h, double value, int pid, const char *comm)
+{
+	int i, c;
+	if (value <= 0)
+		return;
+
+	if (h->n < TOP.k) {
+		/* sift up from the bottom */
+		for (i = h->n++; i > 0 && h->e[(i - 1) / 2].value > value; i = (i - 1) / 2)
+			h->e[i] = h->e[(i - 1) / 2];
+
+	} else {
+		if (value <= h->e[0].value)
+			return;
+		/* replace the smallest, and sift down */
+		for (i = 0; (c = 2 * i + 1) < h->n; i = c) {
+			if (c + 1 < h->n && h->e[c + 1].value < h->e[c].value) c++;
+			if (h->e[c].value >= value) break;
+			h->e[i] = h->e[c];
+		}
+	}
+
+	h->e[i].value = value;
+	h->e[i].pid   = pid;
+	strncpy(h->e[i].comm, comm, sizeof(h->e[i].comm) - 1);
+	h->e[i].comm[sizeof(h->e[i].comm) - 1] = '\0';
+}
+
+static int s_top_cmp(const void *a, const void *b)
+{
+	double x = ((const top_t *)a)->value, y = ((const top_t *)b)->value;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void s_top_print(heap_t *h, const char *what, const char *fmt)
+{
+	int i, j;
+	qsort(h->e, h->n, sizeof(top_t), s_top_cmp);
+
+	/* processes that share a name (workers) are reported together */
+	for (i = 0; i < h->n; i++) {
+		if (!h->e[i].comm[0])
+			continue;
+		for (j = i + 1; j < h->n; j++) {
+			if (streq(h->e[i].comm, h->e[j].comm)) {
+				h->e[i].value += h->e[j].value;
+				h->e[j].comm[0] = '\0';
+			}
+		}
+		printf("SAMPLE %i %s:top:%s:%s ", ts, PREFIX, what, h->e[i].comm);
+		printf(fmt, h->e[i].value);
+		printf("\n");
+	}
+}
+
+/* read_bytes + write_bytes from /proc/PID/io (root only) */
+static int s_pidio(int pid, uint64_t *io)
+{
+	char path[64], b[512];
+	snprintf(path, sizeof(path), PROC "/%i/io", pid);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 1;
+	ssize_t n = pread(fd, b, sizeof(b) - 1, 0);
+	close(fd);
+	if (n <= 0)
+		return 1;
+	b[n] = '\0';
+
+	char *a;
+	*io = 0;
+	if ((a = strstr(b, "\nread_bytes:"))  != NULL) *io += strtoull(a + 12, NULL, 10);
+	if ((a = strstr(b, "\nwrite_bytes:")) != NULL) *io += strtoull(a + 13, NULL, 10);
+	return 0;
+}
+
+/* the previous run's snapshot, mmap'd; 0 records if there isn't one */
+static snap_t* s_snap_open(const char *file, size_t *n, int64_t *ms, size_t *len)
+{
+	struct stat st;
+	snaphdr_t *hdr;
+	*n = 0;
+
+	int fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(snaphdr_t)
+	 || (st.st_size - sizeof(snaphdr_t)) % sizeof(snap_t) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+		return NULL;
+	if (memcmp(hdr->magic, SNAP_MAGIC, 8) != 0) {
+		munmap(hdr, st.st_size);
+		return NULL;
+	}
+
+	*len = st.st_size;
+	*ms  = hdr->ms;
+	*n   = (st.st_size - sizeof(snaphdr_t)) / sizeof(snap_t);
+	return (snap_t *)(hdr + 1);
+}
+
+/* find pid in the (sorted) snapshot, starting from where the last
+   lookup left off, since we're usually asked in order */
+static snap_t* s_snap_find(snap_t *snap, size_t n, size_t *cur, int pid)
+{
+	if (*cur < n && snap[*cur].pid > pid) {
+		size_t lo = 0, hi = *cur;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (snap[mid].pid < pid) lo = mid + 1;
+			else                     hi = mid;
+		}
+		*cur = lo;
+	}
+	while (*cur < n && snap[*cur].pid < pid)
+		(*cur)++;
+	return *cur < n && snap[*cur].pid == pid ? &snap[*cur] : NULL;
+}
+
 int collect_procs(void)
 {
 	struct {
@@ -448,6 +648,36 @@ int collect_procs(void)
 	if (!d)
 		return 1;
 
+	static heap_t top_cpu, top_rss, top_io;
+	snap_t *prev = NULL, now;
+	size_t nprev = 0, cur = 0, len = 0;
+	int64_t ms = time_ms(), then = 0;
+	double elapsed = 0, hz = sysconf(_SC_CLK_TCK);
+	long pagesize = sysconf(_SC_PAGESIZE);
+	char *tmpfile = NULL;
+	FILE *out = NULL;
+
+	if (TOP.k) {
+		prev = s_snap_open(TOP.state, &nprev, &then, &len);
+		if (then > 0 && ms > then)
+			elapsed = (ms - then) / 1000.0;
+
+		/* a new, unpredictable file (never one someone else made,
+		   or a symlink), renamed into place once it's complete */
+		int fd;
+		tmpfile = string("%s.XXXXXX", TOP.state);
+		if ((fd = mkstemp(tmpfile)) >= 0 && (out = fdopen(fd, "w")) != NULL) {
+			snaphdr_t hdr = { SNAP_MAGIC, ms };
+			fwrite(&hdr, sizeof(hdr), 1, out);
+		} else {
+			fprintf(stderr, "%s: %s\n", tmpfile, strerror(errno));
+			if (fd >= 0) {
+				close(fd);
+				unlink(tmpfile);
+			}
+		}
+	}
+
 	ts = time_s();
 	while ((dir = readdir(d)) != NULL) {
 		if (!isdigit(dir->d_name[0])
@@ -460,22 +690,20 @@ int collect_procs(void)
 		if (!io)
 			continue;
 
-		char *a;
+		char *a, *b;
 		if (!fgets(buf, 8192, io)) {
 			fclose(io);
 			continue;
 		}
 		fclose(io);
 
-		a = buf;
-		/* skip PID */
-		while (*a && !isspace(*a)) a++;
-		while (*a &&  isspace(*a)) a++;
-		/* skip progname */
-		while (*a && !isspace(*a)) a++;
-		while (*a &&  isspace(*a)) a++;
+		/* skip PID and (progname), which may have spaces in it */
+		if (!(a = strchr(buf, '(')) || !(b = strrchr(a, ')')))
+			continue;
+		*b++ = '\0';
+		while (*b &&  isspace(*b)) b++;
 
-		switch (*a) {
+		switch (*b) {
 		case 'R': P.running++;  break;
 		case 'S': P.sleeping++; break;
 		case 'D': P.blocked++;  break;
@@ -484,15 +712,69 @@ int collect_procs(void)
 		case 'W': P.paging++;   break;
 		default:  P.unknown++;  break;
 		}
+
+		if (!TOP.k)
+			continue;
+
+		/* fields 14 (utime), 15 (stime), 22 (starttime) and 24 (rss) */
+		uint64_t f[25] = { 0 };
+		int n;
+		for (n = 3; n <= 24 && *b; n++) {
+			f[n] = strtoull(b, &b, 10);
+			while (*b && !isspace(*b)) b++;
+			while (*b &&  isspace(*b)) b++;
+		}
+
+		char *comm = a + 1;
+		for (a = comm; *a; a++)
+			if (!isalnum(*a) && *a != '-' && *a != '.' && *a != '_') *a = '_';
+
+		memset(&now, 0, sizeof(now));
+		now.pid   = pid;
+		now.start = f[22];
+		now.cpu   = f[14] + f[15];
+		if (s_pidio(pid, &now.io) == 0)
+			now.flags |= SNAP_IO;
+		if (out)
+			fwrite(&now, sizeof(now), 1, out);
+
+		s_top(&top_rss, (double)f[24] * pagesize, pid, comm);
+
+		snap_t *was = elapsed > 0 ? s_snap_find(prev, nprev, &cur, pid) : NULL;
+		if (!was || was->start != now.start)
+			continue;
+		if (now.cpu > was->cpu)
+			s_top(&top_cpu, (now.cpu - was->cpu) / hz / elapsed * 100, pid, comm);
+		if ((now.flags & was->flags & SNAP_IO) && now.io > was->io)
+			s_top(&top_io, (now.io - was->io) / elapsed, pid, comm);
+	}
+	closedir(d);
+
+	if (should("procs")) {
+		printf("SAMPLE %i %s:procs:running %i\n",  ts, PREFIX, P.running);
+		printf("SAMPLE %i %s:procs:sleeping %i\n", ts, PREFIX, P.sleeping);
+		printf("SAMPLE %i %s:procs:blocked %i\n",  ts, PREFIX, P.blocked);
+		printf("SAMPLE %i %s:procs:zombies %i\n",  ts, PREFIX, P.zombies);
+		printf("SAMPLE %i %s:procs:stopped %i\n",  ts, PREFIX, P.stopped);
+		printf("SAMPLE %i %s:procs:paging %i\n",   ts, PREFIX, P.paging);
+		printf("SAMPLE %i %s:procs:unknown %i\n",  ts, PREFIX, P.unknown);
 	}
 
-	printf("SAMPLE %i %s:procs:running %i\n",  ts, PREFIX, P.running);
-	printf("SAMPLE %i %s:procs:sleeping %i\n", ts, PREFIX, P.sleeping);
-	printf("SAMPLE %i %s:procs:blocked %i\n",  ts, PREFIX, P.blocked);
-	printf("SAMPLE %i %s:procs:zombies %i\n",  ts, PREFIX, P.zombies);
-	printf("SAMPLE %i %s:procs:stopped %i\n",  ts, PREFIX, P.stopped);
-	printf("SAMPLE %i %s:procs:paging %i\n",   ts, PREFIX, P.paging);
-	printf("SAMPLE %i %s:procs:unknown %i\n",  ts, PREFIX, P.unknown);
+	if (TOP.k) {
+		s_top_print(&top_cpu, "cpu", "%.2f");
+		s_top_print(&top_rss, "rss", "%.0f");
+		s_top_print(&top_io,  "io",  "%.0f");
+
+		if (prev)
+			munmap((snaphdr_t *)prev - 1, len);
+		if (out) {
+			if (fclose(out) != 0 || rename(tmpfile, TOP.state) != 0) {
+				fprintf(stderr, "%s: %s\n", TOP.state, strerror(errno));
+				unlink(tmpfile);
+			}
+		}
+		free(tmpfile);
+	}
 	return 0;
 }
 
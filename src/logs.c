@@ -0,0 +1,835 @@
+#include "common.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <libgen.h>
+#include <pcre.h>
+
+/* how much of a log we read at a time.  small enough that every
+   rule's memmem() pass over it stays in L2; lines longer than this
+   are skipped (and counted as such) */
+#define CHUNK (256 * 1024)
+
+#define MAX_BUCKETS  32
+#define MAX_CAPTURES 32
+#define NAME_MAX_LEN 256
+
+#define AGG_COUNT 0
+#define AGG_SUM   1
+#define AGG_HIST  2
+
+#ifndef PCRE_STUDY_JIT_COMPILE
+#define PCRE_STUDY_JIT_COMPILE 0
+#endif
+
+typedef struct {
+	char       *name;     /* may have $capture references in it */
+	int         dynamic;  /* ... in which case, it does */
+	const char *type;     /* COUNTER or SAMPLE */
+	int         agg;      /* AGG_* */
+	int         value;    /* capture with the value in it (sum / hist) */
+	int         nbuckets;
+	double      le[MAX_BUCKETS];
+
+	char       *pattern;
+	pcre       *regex;
+	pcre_extra *extra;
+	char       *lit;      /* a literal that every match has in it, or NULL */
+	size_t      litlen;
+	size_t      rare;     /* which byte of lit to memchr() for */
+	int         prefix;   /* every match starts with lit */
+
+	struct __metric *metric; /* if it's not dynamic; else the last one */
+} rule_t;
+
+typedef struct __metric {
+	char     *name;
+	rule_t   *rule;
+	double    n, sum;
+	uint64_t  bucket[MAX_BUCKETS + 1]; /* the last one is +Inf */
+} metric_t;
+
+/* the rules that follow a `file' line, for the logs it names */
+typedef struct {
+	rule_t **rules;
+	int      nrules;
+	rule_t **slow;        /* the ones without a literal to look for */
+	int      nslow;
+} group_t;
+
+typedef struct {
+	char    *path;
+	group_t *group;
+} logfile_t;
+
+/* where we got to in a log, last time */
+typedef struct {
+	char     id[64];      /* dev:inode */
+	uint64_t offset;
+} mark_t;
+
+static struct {
+	char      *state;
+	logfile_t *files;
+	int        nfiles;
+	unsigned long overlong;
+} OPTIONS = { 0 };
+
+static hash_t METRICS = { 0 };
+static char *BUF;
+
+/* p is at the '[' that opens a character class; returns the ']' that
+   closes it, stepping over escapes and POSIX [:name:], [.x.] and
+   [=x=] terms (whose ']' doesn't close anything), or NULL. */
+static const char* s_class_end(const char *p)
+{
+	p++;
+	if (*p == '^') p++;
+	if (*p == ']') p++;
+	for (; *p && *p != ']'; p++) {
+		if (*p == '\\' && p[1]) {
+			p++;
+		} else if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+			const char *q = p + 2;
+			while (*q && !(q[0] == p[1] && q[1] == ']'))
+				q++;
+			if (!*q) return NULL;
+			p = q + 1;
+		}
+	}
+	return *p ? p : NULL;
+}
+
+/* the longest run of plain characters that every match of re has to
+   contain, so that we can memmem() for it and only run the regex on
+   lines that have it.  Errs on the side of NULL (no prefilter):
+   groups and classes (including [[:space:]] and friends) are skipped
+   over entirely; alternation, inline options, escapes we don't know
+   the length of, and classes we can't find the end of give up. */
+static char* s_literal(const char *re, size_t *len, int *prefix)
+{
+	char run[256], best[256];
+	size_t n = 0, bn = 0;
+	int last = 0; /* was the previous atom a literal (in run)? */
+	const char *p, *from = re, *bfrom = NULL;
+
+	for (p = re; *p; p++)
+		if (*p == '|' || (p[0] == '(' && p[1] == '?' && (isalpha((unsigned char)p[2]) || p[2] == '^' || p[2] == '-') && p[2] != 'P'))
+			return NULL;
+
+	#define END_RUN do { \
+		if (n > bn) { memcpy(best, run, n); bn = n; bfrom = from; } \
+		n = 0; last = 0; \
+	} while (0)
+
+	for (p = re; *p; p++) {
+		const char *atom = p;
+		switch (*p) {
+		case '\\':
+			if (p[1] && (ispunct((unsigned char)p[1]) || p[1] == ' ')) {
+				p++;
+				goto literal;
+			}
+			/* \d, \s, \b, ... just end the run; anything else
+			   (\x41, \101, \cX, \g1, \k<name>, \Q...\E, ...) may
+			   take arguments, so we don't try to make sense of it */
+			if (!p[1] || !strchr("dDsSwWbBAzZGhHvVRXK", p[1]))
+				return NULL;
+			END_RUN;
+			p++;
+			break;
+
+		case '[':
+			END_RUN;
+			if (!(p = s_class_end(p))) return NULL;
+			break;
+
+		case '(': {
+			int depth = 1;
+			END_RUN;
+			for (p++; *p && depth; p++) {
+				if (*p == '\\' && p[1]) p++;
+				else if (*p == '[') {
+					if (!(p = s_class_end(p))) return NULL;
+				}
+				else if (*p == '(') depth++;
+				else if (*p == ')') depth--;
+			}
+			if (depth) return NULL;
+			p--;
+			break;
+		}
+
+		case '*':
+		case '?':
+		case '{':
+			/* the last character was optional after all */
+			if (last) n--;
+			END_RUN;
+			if (*p == '{')
+				while (*p && *p != '}') p++;
+			if (!*p) p--;
+			break;
+
+		case '+':
+		case '.':
+		case '^':
+		case '$':
+		case ')':
+			END_RUN;
+			break;
+
+		default:
+		literal:
+			if (n == sizeof(run)) END_RUN;
+			if (n == 0) from = atom;
+			run[n++] = *p;
+			last = 1;
+			break;
+		}
+	}
+	END_RUN;
+	#undef END_RUN
+
+	if (bn < 3)
+		return NULL;
+
+	char *lit = vmalloc(bn + 1);
+	memcpy(lit, best, bn);
+	*len = bn;
+	*prefix = bfrom == re;
+	return lit;
+}
+
+/* the byte of lit least likely to turn up in any old log line */
+static size_t s_rare(const char *lit, size_t len)
+{
+	static const char *common = " etaoinsrhldcumfpgwybvk/.-:0123456789\"";
+	size_t i, best = 0;
+	int score, top = -1;
+	for (i = 0; i < len; i++) {
+		const char *c = strchr(common, lit[i]);
+		score = c && lit[i] ? c - common : 100;
+		if (score > top) {
+			top  = score;
+			best = i;
+		}
+	}
+	return best;
+}
+
+/* memmem(), but done with memchr() for the rarest byte, which costs
+   a lot less per hit when there's a hit on (nearly) every line */
+static const char* s_find(const char *p, const char *end, rule_t *r)
+{
+	const char *q, *at;
+	for (q = p + r->rare; q < end && (q = memchr(q, r->lit[r->rare], end - q)) != NULL; q++) {
+		at = q - r->rare;
+		if (at + r->litlen <= end && memcmp(at, r->lit, r->litlen) == 0)
+			return at;
+	}
+	return NULL;
+}
+
+/* [-]digits[.digits] by hand; anything fancier goes to strtod() */
+static int s_number(const char *a, const char *b, double *v)
+{
+	const char *p = a;
+	double x = 0, scale = 1;
+	int neg = 0;
+
+	if (p < b && *p == '-') { neg = 1; p++; }
+	if (p == b || !isdigit(*p))
+		goto slow;
+	while (p < b && isdigit(*p))
+		x = x * 10 + (*p++ - '0');
+	if (p < b && *p == '.')
+		for (p++; p < b && isdigit(*p); p++)
+			x += (*p - '0') * (scale /= 10);
+	if (p < b && (*p == 'e' || *p == 'E'))
+		goto slow;
+
+	*v = neg ? -x : x;
+	return 0;
+
+slow: {
+	char num[64], *end;
+	size_t n = MIN((size_t)(b - a), sizeof(num) - 1);
+	memcpy(num, a, n);
+	num[n] = '\0';
+	*v = strtod(num, &end);
+	return end == num ? 1 : 0;
+	}
+}
+
+static metric_t* s_metric(const char *name, rule_t *rule)
+{
+	metric_t *m = hash_get(&METRICS, name);
+	if (!m) {
+		m = hash_set(&METRICS, name, vmalloc(sizeof(metric_t)));
+		m->name = strdup(name);
+		m->rule = rule;
+	}
+	return m;
+}
+
+/* expand the $capture references in the rule's name, for this match */
+static metric_t* s_dynamic(rule_t *r, const char *line, int *ov)
+{
+	char name[NAME_MAX_LEN], ref[64];
+	size_t n = 0;
+	const char *p;
+
+	for (p = r->name; *p && n < sizeof(name) - 1; p++) {
+		if (*p != '$') {
+			name[n++] = *p;
+			continue;
+		}
+
+		size_t i = 0;
+		int brace = *++p == '{';
+		if (brace) p++;
+		while ((isalnum(*p) || *p == '_') && i < sizeof(ref) - 1)
+			ref[i++] = *p++;
+		ref[i] = '\0';
+		if (!brace) p--;
+
+		int c = pcre_get_stringnumber(r->regex, ref);
+		if (c < 0 || ov[2 * c] < 0) {
+			name[n++] = '_';
+			continue;
+		}
+
+		const char *a = line + ov[2 * c], *b = line + ov[2 * c + 1];
+		for (; a < b && n < sizeof(name) - 1; a++)
+			name[n++] = (isalnum(*a) || *a == '-' || *a == '.' || *a == '_') ? *a : '_';
+	}
+	name[n] = '\0';
+
+	/* consecutive matches mostly land on the same metric */
+	if (!r->metric || !streq(r->metric->name, name))
+		r->metric = s_metric(name, r);
+	return r->metric;
+}
+
+static void s_match(rule_t *r, const char *line, size_t len, size_t from)
+{
+	int ov[3 * (MAX_CAPTURES + 1)];
+	if (pcre_exec(r->regex, r->extra, line, len, from, 0, ov, sizeof(ov) / sizeof(ov[0])) < 0)
+		return;
+
+	double v = 0;
+	if (r->agg != AGG_COUNT) {
+		if (ov[2 * r->value] < 0
+		 || s_number(line + ov[2 * r->value], line + ov[2 * r->value + 1], &v) != 0)
+			return;
+	}
+
+	metric_t *m = r->dynamic ? s_dynamic(r, line, ov) : r->metric;
+	m->n++;
+	m->sum += v;
+	if (r->agg == AGG_HIST) {
+		int i;
+		for (i = 0; i < r->nbuckets && v > r->le[i]; i++)
+			;
+		m->bucket[i]++;
+	}
+}
+
+/* run every rule in g over buf, which holds nothing but whole lines */
+static void s_scan(group_t *g, const char *buf, size_t len)
+{
+	const char *end = buf + len, *p, *a, *b;
+	int i;
+
+	/* rules with a literal only ever look at lines that have it, and
+	   if the regex starts with it, only from there on */
+	for (i = 0; i < g->nrules; i++) {
+		rule_t *r = g->rules[i];
+		if (!r->lit)
+			continue;
+
+		for (p = buf; (p = s_find(p, end, r)) != NULL; p = b + 1) {
+			a = memrchr(buf, '\n', p - buf);
+			a = a ? a + 1 : buf;
+			b = memchr(p, '\n', end - p);
+			s_match(r, a, b - a, r->prefix ? p - a : 0);
+		}
+	}
+
+	if (!g->nslow)
+		return;
+	for (a = buf; a < end; a = b + 1) {
+		b = memchr(a, '\n', end - a);
+		for (i = 0; i < g->nslow; i++)
+			s_match(g->slow[i], a, b - a, 0);
+	}
+}
+
+/* read fd from off to the last complete line; returns the offset
+   just past it (which is where we pick up next time) */
+static off_t s_read(int fd, off_t off, group_t *g)
+{
+	size_t have = 0;
+	ssize_t n;
+	int skip = 0;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, off, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	while ((n = pread(fd, BUF + have, CHUNK - have, off + have)) > 0) {
+		have += n;
+
+		if (skip) {
+			/* still in a line too long to bother with */
+			char *nl = memchr(BUF, '\n', have);
+			size_t drop = nl ? nl - BUF + 1 : have;
+			memmove(BUF, BUF + drop, have - drop);
+			off  += drop;
+			have -= drop;
+			skip  = !nl;
+		}
+
+		char *nl = memrchr(BUF, '\n', have);
+		if (!nl) {
+			if (have == CHUNK) {
+				OPTIONS.overlong++;
+				off += have;
+				have = 0;
+				skip = 1;
+			}
+			continue;
+		}
+
+		size_t len = nl - BUF + 1;
+		s_scan(g, BUF, len);
+		memmove(BUF, BUF + len, have - len);
+		off  += len;
+		have -= len;
+	}
+	return off;
+}
+
+/* where the last complete line in fd ends */
+static off_t s_eol(int fd, off_t size)
+{
+	off_t at = size;
+	while (at > 0) {
+		off_t from = at > CHUNK ? at - CHUNK : 0;
+		ssize_t n = pread(fd, BUF, at - from, from);
+		if (n <= 0)
+			break;
+		char *nl = memrchr(BUF, '\n', n);
+		if (nl)
+			return from + (nl - BUF) + 1;
+		at = from;
+	}
+	return 0;
+}
+
+static int s_id(int fd, char *id, size_t len, off_t *size)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return 1;
+	snprintf(id, len, "%lu:%lu", (unsigned long)st.st_dev, (unsigned long)st.st_ino);
+	*size = st.st_size;
+	return 0;
+}
+
+/* pick up f where we left off, and remember where we got to */
+static void s_tail(logfile_t *f, mark_t *was, FILE *state)
+{
+	char id[64];
+	off_t size, off;
+	int fd = open(f->path, O_RDONLY);
+	if (fd < 0 || s_id(fd, id, sizeof(id), &size) != 0) {
+		/* gone for now (i.e. between logrotate's rename and the
+		   daemon reopening its log); keep our place in the old one,
+		   so that next time we can finish it off from <log>.1 */
+		if (errno != ENOENT)
+			fprintf(stderr, "%s: %s\n", f->path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		if (was)
+			fprintf(state, "%s %lu %s\n", was->id, (unsigned long)was->offset, f->path);
+		return;
+	}
+
+	if (!was) {
+		/* never seen it before; start from (the last line of) now */
+		off = s_eol(fd, size);
+
+	} else if (!streq(was->id, id)) {
+		/* rotated; finish off the old one, if it's where we expect */
+		char *old = string("%s.1", f->path), oid[64];
+		off_t osize;
+		int ofd = open(old, O_RDONLY);
+		if (ofd >= 0) {
+			if (s_id(ofd, oid, sizeof(oid), &osize) == 0 && streq(oid, was->id) && (off_t)was->offset <= osize)
+				s_read(ofd, was->offset, f->group);
+			close(ofd);
+		}
+		free(old);
+		off = s_read(fd, 0, f->group);
+
+	} else {
+		/* truncated? */
+		off = s_read(fd, (off_t)was->offset > size ? 0 : (off_t)was->offset, f->group);
+	}
+	close(fd);
+
+	fprintf(state, "%s %lu %s\n", id, (unsigned long)off, f->path);
+}
+
+static void s_print(const char *name, metric_t *m)
+{
+	rule_t *r = m->rule;
+	int i;
+
+	/* the range check keeps the cast defined (sums can be negative) */
+	#define VALUE(s,v) do { \
+		if (streq(r->type, "COUNTER") \
+		 || ((v) > -1e15 && (v) < 1e15 && (v) == (double)(int64_t)(v))) \
+			printf("%s %i %s:%s %.0f\n", r->type, ts, PREFIX, (s), (v)); \
+		else \
+			printf("%s %i %s:%s %.3f\n", r->type, ts, PREFIX, (s), (v)); \
+	} while (0)
+
+	switch (r->agg) {
+	case AGG_COUNT: VALUE(name, m->n);   break;
+	case AGG_SUM:   VALUE(name, m->sum); break;
+	case AGG_HIST: {
+		uint64_t le = 0;
+		char sub[NAME_MAX_LEN + 64];
+		for (i = 0; i < r->nbuckets; i++) {
+			le += m->bucket[i];
+			snprintf(sub, sizeof(sub), "%s:le:%g", name, r->le[i]);
+			VALUE(sub, (double)le);
+		}
+		snprintf(sub, sizeof(sub), "%s:le:inf", name); VALUE(sub, m->n);
+		snprintf(sub, sizeof(sub), "%s:count",  name); VALUE(sub, m->n);
+		snprintf(sub, sizeof(sub), "%s:sum",    name); VALUE(sub, m->sum);
+		break;
+	}
+	}
+	#undef VALUE
+}
+
+/* NAME TYPE AGGREGATION REGEX, where
+     TYPE is COUNTER or SAMPLE, and
+     AGGREGATION is count, sum:CAPTURE or hist:CAPTURE:B1,B2,... */
+static rule_t* s_rule(char *line, const char *file, int lineno)
+{
+	char *f[3], *a = line;
+	int i;
+	for (i = 0; i < 3; i++) {
+		f[i] = a;
+		while (*a && !isspace(*a)) a++;
+		if (!*a) {
+			fprintf(stderr, "%s:%i: expected NAME TYPE AGGREGATION REGEX\n", file, lineno);
+			return NULL;
+		}
+		*a++ = '\0';
+		while (isspace(*a)) a++;
+	}
+
+	rule_t *r = vmalloc(sizeof(rule_t));
+	r->name    = strdup(f[0]);
+	r->dynamic = strchr(r->name, '$') != NULL;
+	r->pattern = strdup(a);
+
+	/* "quoted", so that leading / trailing spaces are kept */
+	size_t len = strlen(r->pattern);
+	if (len >= 2 && r->pattern[0] == '"' && r->pattern[len - 1] == '"') {
+		memmove(r->pattern, r->pattern + 1, len - 2);
+		r->pattern[len - 2] = '\0';
+	}
+
+	     if (strcasecmp(f[1], "COUNTER") == 0) r->type = "COUNTER";
+	else if (strcasecmp(f[1], "SAMPLE")  == 0) r->type = "SAMPLE";
+	else {
+		fprintf(stderr, "%s:%i: unrecognized type '%s' (must be COUNTER or SAMPLE)\n", file, lineno, f[1]);
+		return NULL;
+	}
+
+	const char *re_err;
+	int re_off, ncap = 0;
+	r->regex = pcre_compile(r->pattern, 0, &re_err, &re_off, NULL);
+	if (!r->regex) {
+		fprintf(stderr, "%s:%i: bad regex '%s' (error %s)\n", file, lineno, r->pattern, re_err);
+		return NULL;
+	}
+	r->extra = pcre_study(r->regex, PCRE_STUDY_JIT_COMPILE, &re_err);
+	pcre_fullinfo(r->regex, r->extra, PCRE_INFO_CAPTURECOUNT, &ncap);
+	if (ncap > MAX_CAPTURES) {
+		fprintf(stderr, "%s:%i: too many capture groups (max %i)\n", file, lineno, MAX_CAPTURES);
+		return NULL;
+	}
+
+	char *cap = strchr(f[2], ':');
+	if (cap) *cap++ = '\0';
+	     if (streq(f[2], "count")) r->agg = AGG_COUNT;
+	else if (streq(f[2], "sum"))   r->agg = AGG_SUM;
+	else if (streq(f[2], "hist"))  r->agg = AGG_HIST;
+	else {
+		fprintf(stderr, "%s:%i: unrecognized aggregation '%s' (must be count, sum or hist)\n", file, lineno, f[2]);
+		return NULL;
+	}
+
+	if (r->agg != AGG_COUNT) {
+		char *b = cap ? strchr(cap, ':') : NULL;
+		if (b) *b++ = '\0';
+		if (!cap || (r->value = pcre_get_stringnumber(r->regex, cap)) < 0) {
+			fprintf(stderr, "%s:%i: %s needs the name of a capture group, (?<name>...), in the regex\n", file, lineno, f[2]);
+			return NULL;
+		}
+		if (r->agg == AGG_HIST) {
+			int bad = 0;
+			while (b && *b && r->nbuckets < MAX_BUCKETS) {
+				char *e;
+				r->le[r->nbuckets] = strtod(b, &e);
+				if (e == b || (r->nbuckets && r->le[r->nbuckets] <= r->le[r->nbuckets - 1])) {
+					bad = 1;
+					break;
+				}
+				r->nbuckets++;
+				b = e;
+				if (*b == ',') b++;
+				else break;
+			}
+			if (bad || !r->nbuckets || (b && *b)) {
+				fprintf(stderr, "%s:%i: hist needs at most %i ascending bucket bounds, like hist:ms:10,50,100\n", file, lineno, MAX_BUCKETS);
+				return NULL;
+			}
+		}
+	}
+
+	r->lit = s_literal(r->pattern, &r->litlen, &r->prefix);
+	if (r->lit)
+		r->rare = s_rare(r->lit, r->litlen);
+	if (!r->dynamic) {
+		r->metric = s_metric(r->name, r);
+		if (r->metric->rule->agg != r->agg || r->metric->rule->nbuckets != r->nbuckets) {
+			fprintf(stderr, "%s:%i: %s is already aggregated differently\n", file, lineno, r->name);
+			return NULL;
+		}
+	}
+	return r;
+}
+
+static int s_rules(const char *file)
+{
+	FILE *io = fopen(file, "r");
+	if (!io) {
+		perror(file);
+		return 1;
+	}
+
+	char line[8192];
+	int lineno = 0, errors = 0, i;
+	group_t *g = NULL;
+	while (fgets(line, sizeof(line), io) != NULL) {
+		lineno++;
+		char *a = line, *e = line + strlen(line);
+		while (isspace(*a)) a++;
+		while (e > a && isspace(e[-1])) *--e = '\0';
+		if (!*a || *a == '#')
+			continue; /* blank line or comment */
+
+		/* file PATH [PATH ...], where PATH can be a glob */
+		if (strncmp(a, "file", 4) == 0 && isspace(a[4])) {
+			g = vmalloc(sizeof(group_t));
+			for (a = strtok(a + 4, " \t"); a; a = strtok(NULL, " \t")) {
+				glob_t gl;
+				if (glob(a, GLOB_NOCHECK, NULL, &gl) != 0)
+					continue;
+				size_t j;
+				for (j = 0; j < gl.gl_pathc; j++) {
+					for (i = 0; i < OPTIONS.nfiles; i++)
+						if (streq(OPTIONS.files[i].path, gl.gl_pathv[j]))
+							break;
+					if (i < OPTIONS.nfiles) {
+						fprintf(stderr, "%s:%i: %s is already being watched\n", file, lineno, gl.gl_pathv[j]);
+						errors++;
+						continue;
+					}
+					OPTIONS.files = realloc(OPTIONS.files, (OPTIONS.nfiles + 1) * sizeof(logfile_t));
+					OPTIONS.files[OPTIONS.nfiles].path  = strdup(gl.gl_pathv[j]);
+					OPTIONS.files[OPTIONS.nfiles].group = g;
+					OPTIONS.nfiles++;
+				}
+				globfree(&gl);
+			}
+			continue;
+		}
+
+		if (!g) {
+			fprintf(stderr, "%s:%i: rule given before any `file' line\n", file, lineno);
+			errors++;
+			continue;
+		}
+
+		rule_t *r = s_rule(a, file, lineno);
+		if (!r) {
+			errors++;
+			continue;
+		}
+		g->rules = realloc(g->rules, (g->nrules + 1) * sizeof(rule_t *));
+		g->rules[g->nrules++] = r;
+		if (!r->lit) {
+			g->slow = realloc(g->slow, (g->nslow + 1) * sizeof(rule_t *));
+			g->slow[g->nslow++] = r;
+		}
+	}
+	fclose(io);
+	return errors;
+}
+
+int parse_options(int argc, char **argv);
+
+int main(int argc, char **argv)
+{
+	if (parse_options(argc, argv) != 0) {
+		fprintf(stderr, "USAGE: %s [options] /path/to/rules\n", argv[0]);
+		exit(1);
+	}
+	if (s_rules(argv[optind]) != 0)
+		exit(1);
+
+	/* where we left off */
+	hash_t marks = { 0 };
+	FILE *io = fopen(OPTIONS.state, "r");
+	if (io) {
+		char line[8192], *path;
+		unsigned long off;
+		int n;
+		while (fgets(line, sizeof(line), io) != NULL) {
+			mark_t *m = vmalloc(sizeof(mark_t));
+			line[strcspn(line, "\n")] = '\0';
+			if (sscanf(line, "%63s %lu %n", m->id, &off, &n) < 2) {
+				free(m);
+				continue;
+			}
+			m->offset = off;
+			path = line + n;
+			hash_set(&marks, path, m);
+		}
+		fclose(io);
+	}
+
+	int fd;
+	char *tmp = string("%s.XXXXXX", OPTIONS.state);
+	FILE *state = NULL;
+	if ((fd = mkstemp(tmp)) < 0 || (state = fdopen(fd, "w")) == NULL) {
+		fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		exit(1);
+	}
+
+	int i;
+	BUF = vmalloc(CHUNK);
+	for (i = 0; i < OPTIONS.nfiles; i++)
+		s_tail(&OPTIONS.files[i], hash_get(&marks, OPTIONS.files[i].path), state);
+
+	if (fclose(state) != 0 || rename(tmp, OPTIONS.state) != 0) {
+		fprintf(stderr, "%s: %s\n", OPTIONS.state, strerror(errno));
+		unlink(tmp);
+	}
+
+	if (OPTIONS.overlong)
+		fprintf(stderr, "skipped %lu lines longer than %i bytes\n", OPTIONS.overlong, CHUNK);
+
+	char *name;
+	metric_t *m;
+	ts = time_s();
+	for_each_key_value(&METRICS, name, m)
+		s_print(name, m);
+	return 0;
+}
+
+int parse_options(int argc, char **argv)
+{
+	const char *short_opts = "h?p:s:";
+	struct option long_opts[] = {
+		{ "help",        no_argument, 0, 'h' },
+		{ "prefix", required_argument, 0, 'p' },
+		{ "state",  required_argument, 0, 's' },
+		{ 0, 0, 0, 0 },
+	};
+	int opt, idx;
+	while ((opt = getopt_long(argc, argv, short_opts, long_opts, &idx)) >= 0) {
+		switch (opt) {
+		case 'h':
+		case '?':
+			fprintf(stdout, "logs (a Bolo collector)\n"
+			                "USAGE: logs [options] /path/to/rules\n"
+			                "\n"
+			                "options:\n"
+			                "   -h, --help               Show this help screen\n"
+			                "   -p, --prefix PREFIX      Use the given metric prefix\n"
+			                "                            (FQDN is used by default)\n"
+			                "   -s, --state FILE         Where to remember how far into each log\n"
+			                "                            we got (defaults to\n"
+			                "                            /var/lib/bolo/logs.<rules-file-name>)\n"
+			                "\n"
+			                "Each run reads only what has been appended to the logs since the\n"
+			                "last one (following rotation to <log>.1, and truncation); logs we\n"
+			                "have never seen before are picked up from the end.\n"
+			                "\n"
+			                "The rules file looks like this:\n"
+			                "\n"
+			                "    # comments, and blank lines, are ignored\n"
+			                "    file /var/log/nginx/access.log /var/log/nginx/*.access.log\n"
+			                "\n"
+			                "    # NAME                  TYPE     AGGREGATION              REGEX\n"
+			                "    nginx:requests:$status  COUNTER  count                    \" (?<status>\\d{3}) \"\n"
+			                "    nginx:bytes             COUNTER  sum:bytes                \" \\d{3} (?<bytes>\\d+) \"\n"
+			                "    nginx:latency           SAMPLE   hist:t:0.01,0.1,0.5,1,5  \"rt=(?<t>[\\d.]+)\"\n"
+			                "\n"
+			                "Rules apply to the logs named on the `file' line above them.\n"
+			                "REGEX is the rest of the line (quote it to keep leading or\n"
+			                "trailing spaces), and is a PCRE.  NAME can use\n"
+			                "$capture (or ${capture}) to pull in named capture groups.\n"
+			                "\n"
+			                "TYPE is COUNTER (the aggregate is the increment since the last\n"
+			                "run, rounded), or SAMPLE (the aggregate is reported as is).\n"
+			                "AGGREGATION is one of:\n"
+			                "\n"
+			                "    count                     how many lines matched\n"
+			                "    sum:CAPTURE               the sum of a capture group's values\n"
+			                "    hist:CAPTURE:B1,B2,...    a histogram of them, reported as\n"
+			                "                              NAME:le:B (cumulative), NAME:le:inf,\n"
+			                "                              NAME:count and NAME:sum\n"
+			                "\n");
+			exit(0);
+
+		case 'p':
+			free(PREFIX);
+			PREFIX = strdup(optarg);
+			break;
+
+		case 's':
+			free(OPTIONS.state);
+			OPTIONS.state = strdup(optarg);
+			break;
+		}
+	}
+
+	if (!argv[optind])
+		return 1;
+
+	if (!OPTIONS.state) {
+		char *rules = strdup(argv[optind]);
+		mkdir("/var/lib/bolo", 0755);
+		OPTIONS.state = string("/var/lib/bolo/logs.%s", basename(rules));
+		free(rules);
+	}
+
+	INIT_PREFIX();
+	return 0;
+}
@@ -2,7 +2,9 @@
 #define list_delete mysql_list_delete
 #include <mysql/mysql.h>
 #undef list_delete
+#include <mysql/errmsg.h>
 #include <dlfcn.h>
+#include <pthread.h>
 
 void *libmysqlclient;
 MYSQL *((*_mysql_init)(MYSQL*));
@@ -10,10 +12,90 @@ void   ((*_mysql_close)(MYSQL*));
 MYSQL *((*_mysql_real_connect)(MYSQL*, const char*, const char*, const char*, const char*,
                                unsigned int, const char*, unsigned long));
 const char *((*_mysql_error)(MYSQL*));
+unsigned int ((*_mysql_errno)(MYSQL*));
 int ((*_mysql_query)(MYSQL*, const char*));
-MYSQL_RES* ((*_mysql_store_result)(MYSQL*));
-MYSQL_ROW* ((*_mysql_fetch_row)(MYSQL_RES*));
+MYSQL_RES* ((*_mysql_use_result)(MYSQL*));
+int ((*_mysql_next_result)(MYSQL*));
+MYSQL_ROW ((*_mysql_fetch_row)(MYSQL_RES*));
 MYSQL_FIELD* ((*_mysql_fetch_field)(MYSQL_RES*));
+void ((*_mysql_free_result)(MYSQL_RES*));
+int ((*_mysql_options)(MYSQL*, enum mysql_option, const void*));
+int ((*_mysql_server_init)(int, char**, char**));
+int ((*_mysql_thread_init)(void));
+void ((*_mysql_thread_end)(void));
+
+MYSQL_STMT* ((*_mysql_stmt_init)(MYSQL*));
+int ((*_mysql_stmt_prepare)(MYSQL_STMT*, const char*, unsigned long));
+MYSQL_RES* ((*_mysql_stmt_result_metadata)(MYSQL_STMT*));
+int ((*_mysql_stmt_bind_result)(MYSQL_STMT*, MYSQL_BIND*));
+int ((*_mysql_stmt_execute)(MYSQL_STMT*));
+int ((*_mysql_stmt_fetch)(MYSQL_STMT*));
+int ((*_mysql_stmt_free_result)(MYSQL_STMT*));
+int ((*_mysql_stmt_close)(MYSQL_STMT*));
+const char *((*_mysql_stmt_error)(MYSQL_STMT*));
+
+typedef struct {
+	char       *sql;
+	const char *type;  /* wide mode: type for columns without a suffix */
+} query_t;
+
+#define MAX_COLUMNS 256
+#define VALUE_MAX   256
+
+/* which columns are which, in a result set */
+typedef struct {
+	MYSQL_FIELD *fields[MAX_COLUMNS];
+	int          cols;
+	int          total;             /* cols, plus any past MAX_COLUMNS */
+	int          tcol, vcol, ncol;  /* type / value / name, or -1 */
+} layout_t;
+
+/* a query prepared (in daemon mode) on one connection, with its
+   result columns bound to VALUE_MAX-byte string buffers */
+typedef struct {
+	MYSQL_STMT    *stmt;   /* NULL if it wouldn't prepare */
+	MYSQL_RES     *meta;
+	layout_t       layout;
+	MYSQL_BIND    *bind;
+	char          *buf;
+	unsigned long *len;
+	char          *null;   /* my_bool in 5.x, bool in 8.x; a byte either way */
+	char         **row;
+} prepared_t;
+
+typedef struct {
+	char *tag;       /* goes between mysql: and the metric name */
+	char *host;
+	int   port;
+	char *database;
+	char *user;
+	char *pass;
+
+	MYSQL      *db;        /* kept between intervals, with --interval */
+	prepared_t *prepared;  /* one per query, or NULL */
+} target_t;
+
+static struct {
+	query_t  *queries;
+	int       nqueries;
+	int       status;    /* also run SHOW GLOBAL STATUS / VARIABLES */
+	int       interval;
+	int       timeout;   /* per statement, in ms; -1 until we know the mode */
+
+	target_t *targets;
+	int       ntargets;
+	int       concurrency;
+	int       deadline;
+
+	pthread_mutex_t lock;
+	int       next;      /* next target for a worker to pick up */
+	int       failed;
+} OPTIONS = {
+	.timeout     = -1,
+	.concurrency = 8,
+	.deadline    = 30,
+	.lock        = PTHREAD_MUTEX_INITIALIZER,
+};
 
 static int skip_empty(const char *s, const char *name)
 {
@@ -22,57 +104,727 @@ static int skip_empty(const char *s, const char *name)
 	return 1;
 }
 
-static void run_query(MYSQL *db, const char *sql)
+/* is this column value something we can send as a metric? */
+static int s_numeric(const char *v)
+{
+	char *end;
+	if (!v || !*v)
+		return 0;
+	strtod(v, &end);
+	return *end == '\0';
+}
+
+/* split a wide-mode column name like "Questions__rate" into the metric
+   name ("Questions") and its type ("RATE"); columns without a __rate or
+   __sample suffix get the query's -- @type (SAMPLE by default) */
+static const char* s_column(const char *col, const char *type, char *buf, size_t len)
+{
+	size_t n = strlen(col);
+	if (n > 6 && strcasecmp(col + n - 6, "__rate") == 0) {
+		n -= 6;
+		type = "RATE";
+	} else if (n > 8 && strcasecmp(col + n - 8, "__sample") == 0) {
+		n -= 8;
+		type = "SAMPLE";
+	}
+	snprintf(buf, len, "%.*s", (int)n, col);
+	return type ? type : "SAMPLE";
+}
+
+/* name:column, unless the name already ends in a separator */
+static const char* s_join(const char *name, const char *col, char *buf, size_t len)
+{
+	size_t n = strlen(name);
+	if (n == 0)
+		snprintf(buf, len, "%s", col);
+	else if (name[n - 1] == ':' || name[n - 1] == '.')
+		snprintf(buf, len, "%s%s", name, col);
+	else
+		snprintf(buf, len, "%s:%s", name, col);
+	return buf;
+}
+
+/* work out which columns are which; 0 if we can make sense of them */
+static int s_layout(layout_t *l, MYSQL_RES *res)
+{
+	MYSQL_FIELD *field;
+	l->cols = l->total = 0;
+	l->tcol = l->vcol = l->ncol = -1;
+	while ((field = _mysql_fetch_field(res)) != NULL) {
+		if (l->total++ >= MAX_COLUMNS)
+			continue;
+		if (strcmp(field->name, "type")  == 0) l->tcol = l->cols;
+		if (strcmp(field->name, "value") == 0) l->vcol = l->cols;
+		if (strcmp(field->name, "name")  == 0) l->ncol = l->cols;
+		l->fields[l->cols++] = field;
+	}
+
+	if (l->tcol < 0 || l->vcol < 0) {
+		if (l->cols <= (l->ncol >= 0 ? 1 : 0)) {
+			fprintf(stderr, "no metric columns (or type / value fields) in SQL query\n");
+			return 1;
+		}
+	} else if (l->ncol < 0) {
+		fprintf(stderr, "missing 'name' field in SQL query\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* Wide mode, for results without type / value columns: every numeric
+   column in a row is its own metric, named after the row's name (if
+   there is a name column) and the column. */
+static void wide(query_t *q, layout_t *l, char **row, FILE *out, const char *tag, int32_t now)
+{
+	char metric[256], full[512];
+	int j;
+
+	const char *name = "";
+	if (l->ncol >= 0)
+		name = (row[l->ncol] && *row[l->ncol]) ? row[l->ncol] : "unnamed";
+
+	for (j = 0; j < l->cols; j++) {
+		if (j == l->ncol || !s_numeric(row[j]))
+			continue;
+
+		const char *type = s_column(l->fields[j]->name, q->type, metric, sizeof(metric));
+		fprintf(out, "%s %i %s:mysql:%s%s%s %s\n", type, now, PREFIX,
+			tag ? tag : "", tag ? ":" : "",
+			s_join(name, metric, full, sizeof(full)), row[j]);
+	}
+}
+
+static void s_row(query_t *q, layout_t *l, char **row, FILE *out, const char *tag, int32_t now)
+{
+	if (l->tcol < 0 || l->vcol < 0) {
+		wide(q, l, row, out, tag, now);
+		return;
+	}
+
+	if (skip_empty(row[l->tcol], "type")) return;
+	if (skip_empty(row[l->vcol], "value")) return;
+	fprintf(out, "%s %i %s:mysql:%s%s%s %s\n", row[l->tcol], now, PREFIX,
+		tag ? tag : "", tag ? ":" : "",
+		(row[l->ncol] && *row[l->ncol]) ? row[l->ncol] : "unnamed", row[l->vcol]);
+}
+
+static void run_query(MYSQL *db, query_t *q, FILE *out, const char *tag)
 {
-	ts = time_s();
+	const char *sql = q->sql;
+	int32_t now = time_s(); /* not ts; workers run these concurrently */
 	if (_mysql_query(db, sql) != 0) {
-		fprintf(stderr, "`%s' failed\nerror: %s", sql, _mysql_error(db));
+		fprintf(stderr, "%s%s`%s' failed\nerror: %s\n", tag ? tag : "", tag ? ": " : "",
+			sql, _mysql_error(db));
 		return;
 	}
 
-	MYSQL_RES *res = _mysql_store_result(db);
+	/* rows are streamed off the wire as we fetch them, rather
+	   than buffering the whole result set client-side first */
+	MYSQL_RES *res = _mysql_use_result(db);
 	if (!res) {
-		fprintf(stderr, "`%s' failed\nerror: %s", sql, _mysql_error(db));
+		fprintf(stderr, "%s%s`%s' failed\nerror: %s\n", tag ? tag : "", tag ? ": " : "",
+			sql, _mysql_error(db));
 		return;
 	}
 
-	int i = 0;
-	int tcol = -1, vcol = -1, ncol = -1;
-	MYSQL_FIELD *field;
-	while ((field = _mysql_fetch_field(res)) != NULL) {
-		if (strcmp(field->name, "type")  == 0) tcol = i;
-		if (strcmp(field->name, "value") == 0) vcol = i;
-		if (strcmp(field->name, "name")  == 0) ncol = i;
-		i++;
-	}
-	if (tcol < 0) fprintf(stderr, "missing 'type' field in SQL query\n");
-	if (vcol < 0) fprintf(stderr, "missing 'value' field in SQL query\n");
-	if (ncol < 0) fprintf(stderr, "missing 'name' field in SQL query\n");
-	if (tcol < 0 || vcol < 0 || ncol < 0)
+	layout_t l;
+	if (s_layout(&l, res) == 0) {
+		MYSQL_ROW row;
+		while ((row = _mysql_fetch_row(res)) != NULL)
+			s_row(q, &l, row, out, tag, now);
+	}
+
+	/* a NULL from fetch_row is either the end of the rows,
+	   or the connection dying halfway through them */
+	if (_mysql_errno(db))
+		fprintf(stderr, "%s%s`%s' failed\nerror: %s\n", tag ? tag : "", tag ? ": " : "",
+			sql, _mysql_error(db));
+
+	/* reads (and throws away) any rows we didn't get to */
+	_mysql_free_result(res);
+
+	/* with --status, the connection allows multiple statements per
+	   query, so there may be more results behind this one */
+	while (_mysql_next_result(db) == 0)
+		_mysql_free_result(_mysql_use_result(db));
+}
+
+/* Daemon mode: prepare every query once per connection, binding each
+   result column to a string buffer, so that every interval afterwards
+   is just an execute and a (binary protocol) fetch.  A query that
+   won't prepare is reported once, and then skipped. */
+static void s_prepare(target_t *t)
+{
+	int i, j;
+	t->prepared = calloc(OPTIONS.nqueries, sizeof(prepared_t));
+	for (i = 0; i < OPTIONS.nqueries; i++) {
+		query_t *q = &OPTIONS.queries[i];
+		prepared_t *p = &t->prepared[i];
+
+		p->stmt = _mysql_stmt_init(t->db);
+		if (!p->stmt)
+			continue;
+		if (_mysql_stmt_prepare(p->stmt, q->sql, strlen(q->sql)) != 0
+		 || (p->meta = _mysql_stmt_result_metadata(p->stmt)) == NULL
+		 || s_layout(&p->layout, p->meta) != 0
+		 /* mysql_stmt_bind_result() wants a bind for every column */
+		 || p->layout.total > MAX_COLUMNS) {
+			fprintf(stderr, "%s%s`%s' failed to prepare\nerror: %s\n",
+				t->tag ? t->tag : "", t->tag ? ": " : "", q->sql,
+				p->meta ? "unusable result columns" : _mysql_stmt_error(p->stmt));
+			if (p->meta)
+				_mysql_free_result(p->meta);
+			_mysql_stmt_close(p->stmt);
+			memset(p, 0, sizeof(prepared_t));
+			continue;
+		}
+
+		int n = p->layout.cols;
+		p->bind = calloc(n, sizeof(MYSQL_BIND));
+		p->buf  = calloc(n, VALUE_MAX);
+		p->len  = calloc(n, sizeof(unsigned long));
+		p->null = calloc(n, 1);
+		p->row  = calloc(n, sizeof(char *));
+		for (j = 0; j < n; j++) {
+			p->bind[j].buffer_type   = MYSQL_TYPE_STRING;
+			p->bind[j].buffer        = p->buf + j * VALUE_MAX;
+			p->bind[j].buffer_length = VALUE_MAX - 1;
+			p->bind[j].length        = &p->len[j];
+			p->bind[j].is_null       = (void *)&p->null[j];
+		}
+		_mysql_stmt_bind_result(p->stmt, p->bind);
+	}
+}
+
+static void run_prepared(target_t *t, int i, FILE *out)
+{
+	query_t *q = &OPTIONS.queries[i];
+	prepared_t *p = &t->prepared[i];
+	int j, rc;
+
+	if (!p->stmt)
+		return;
+
+	int32_t now = time_s();
+	if (_mysql_stmt_execute(p->stmt) != 0) {
+		fprintf(stderr, "%s%s`%s' failed\nerror: %s\n", t->tag ? t->tag : "", t->tag ? ": " : "",
+			q->sql, _mysql_stmt_error(p->stmt));
 		return;
+	}
+
+	/* no mysql_stmt_store_result(), so rows stream in as we fetch */
+	while ((rc = _mysql_stmt_fetch(p->stmt)) == 0 || rc == MYSQL_DATA_TRUNCATED) {
+		for (j = 0; j < p->layout.cols; j++) {
+			char *v = p->buf + j * VALUE_MAX;
+			v[MIN(p->len[j], VALUE_MAX - 1)] = '\0';
+			p->row[j] = p->null[j] ? NULL : v;
+		}
+		s_row(q, &p->layout, p->row, out, t->tag, now);
+	}
+	if (rc != MYSQL_NO_DATA)
+		fprintf(stderr, "%s%s`%s' failed\nerror: %s\n", t->tag ? t->tag : "", t->tag ? ": " : "",
+			q->sql, _mysql_stmt_error(p->stmt));
+	_mysql_stmt_free_result(p->stmt);
+}
+
+/* Status mode (--status): one round trip for SHOW GLOBAL STATUS and
+   SHOW GLOBAL VARIABLES, with each name looked up in a compiled-in
+   table to decide whether it's a counter (RATE), a gauge (SAMPLE), or
+   a setting worth keeping an eye on.  Anything that isn't in the
+   table is skipped, apart from the Com_* and Handler_* families,
+   which are all counters. */
+#define K_RATE   1  /* SHOW GLOBAL STATUS counter */
+#define K_SAMPLE 2  /* SHOW GLOBAL STATUS gauge */
+#define K_VAR    3  /* SHOW GLOBAL VARIABLES setting */
 
-	MYSQL_ROW *row;
-	while ((row = _mysql_fetch_row(res)) != NULL) {
-		if (skip_empty((const char*)row[tcol], "type")) continue;
-		if (skip_empty((const char*)row[vcol], "value")) continue;
-		printf("%s %i %s:mysql:%s %s\n", row[tcol], ts, PREFIX,
-			(row[ncol] && *row[ncol]) ? (const char*)row[ncol] : "unnamed", row[vcol]);
+static const struct {
+	const char *name;
+	int         kind;
+} KNOWN[] = {
+	{ "aborted_clients",                      K_RATE },
+	{ "aborted_connects",                     K_RATE },
+	{ "binlog_cache_disk_use",                K_RATE },
+	{ "binlog_cache_use",                     K_RATE },
+	{ "binlog_stmt_cache_disk_use",           K_RATE },
+	{ "binlog_stmt_cache_use",                K_RATE },
+	{ "bytes_received",                       K_RATE },
+	{ "bytes_sent",                           K_RATE },
+	{ "connection_errors_accept",             K_RATE },
+	{ "connection_errors_internal",           K_RATE },
+	{ "connection_errors_max_connections",    K_RATE },
+	{ "connection_errors_peer_address",       K_RATE },
+	{ "connection_errors_select",             K_RATE },
+	{ "connection_errors_tcpwrap",            K_RATE },
+	{ "connections",                          K_RATE },
+	{ "created_tmp_disk_tables",              K_RATE },
+	{ "created_tmp_files",                    K_RATE },
+	{ "created_tmp_tables",                   K_RATE },
+	{ "innodb_buffer_pool_pages_flushed",     K_RATE },
+	{ "innodb_buffer_pool_read_ahead",        K_RATE },
+	{ "innodb_buffer_pool_read_ahead_evicted",K_RATE },
+	{ "innodb_buffer_pool_read_requests",     K_RATE },
+	{ "innodb_buffer_pool_reads",             K_RATE },
+	{ "innodb_buffer_pool_wait_free",         K_RATE },
+	{ "innodb_buffer_pool_write_requests",    K_RATE },
+	{ "innodb_data_fsyncs",                   K_RATE },
+	{ "innodb_data_read",                     K_RATE },
+	{ "innodb_data_reads",                    K_RATE },
+	{ "innodb_data_writes",                   K_RATE },
+	{ "innodb_data_written",                  K_RATE },
+	{ "innodb_dblwr_pages_written",           K_RATE },
+	{ "innodb_dblwr_writes",                  K_RATE },
+	{ "innodb_log_waits",                     K_RATE },
+	{ "innodb_log_write_requests",            K_RATE },
+	{ "innodb_log_writes",                    K_RATE },
+	{ "innodb_os_log_fsyncs",                 K_RATE },
+	{ "innodb_os_log_written",                K_RATE },
+	{ "innodb_pages_created",                 K_RATE },
+	{ "innodb_pages_read",                    K_RATE },
+	{ "innodb_pages_written",                 K_RATE },
+	{ "innodb_row_lock_time",                 K_RATE },
+	{ "innodb_row_lock_waits",                K_RATE },
+	{ "innodb_rows_deleted",                  K_RATE },
+	{ "innodb_rows_inserted",                 K_RATE },
+	{ "innodb_rows_read",                     K_RATE },
+	{ "innodb_rows_updated",                  K_RATE },
+	{ "key_read_requests",                    K_RATE },
+	{ "key_reads",                            K_RATE },
+	{ "key_write_requests",                   K_RATE },
+	{ "key_writes",                           K_RATE },
+	{ "opened_files",                         K_RATE },
+	{ "opened_table_definitions",             K_RATE },
+	{ "opened_tables",                        K_RATE },
+	{ "qcache_hits",                          K_RATE },
+	{ "qcache_inserts",                       K_RATE },
+	{ "qcache_lowmem_prunes",                 K_RATE },
+	{ "qcache_not_cached",                    K_RATE },
+	{ "queries",                              K_RATE },
+	{ "questions",                            K_RATE },
+	{ "select_full_join",                     K_RATE },
+	{ "select_full_range_join",               K_RATE },
+	{ "select_range",                         K_RATE },
+	{ "select_range_check",                   K_RATE },
+	{ "select_scan",                          K_RATE },
+	{ "slow_launch_threads",                  K_RATE },
+	{ "slow_queries",                         K_RATE },
+	{ "sort_merge_passes",                    K_RATE },
+	{ "sort_range",                           K_RATE },
+	{ "sort_rows",                            K_RATE },
+	{ "sort_scan",                            K_RATE },
+	{ "table_locks_immediate",                K_RATE },
+	{ "table_locks_waited",                   K_RATE },
+	{ "table_open_cache_hits",                K_RATE },
+	{ "table_open_cache_misses",              K_RATE },
+	{ "table_open_cache_overflows",           K_RATE },
+	{ "threads_created",                      K_RATE },
+
+	{ "innodb_buffer_pool_bytes_data",        K_SAMPLE },
+	{ "innodb_buffer_pool_bytes_dirty",       K_SAMPLE },
+	{ "innodb_buffer_pool_pages_data",        K_SAMPLE },
+	{ "innodb_buffer_pool_pages_dirty",       K_SAMPLE },
+	{ "innodb_buffer_pool_pages_free",        K_SAMPLE },
+	{ "innodb_buffer_pool_pages_misc",        K_SAMPLE },
+	{ "innodb_buffer_pool_pages_total",       K_SAMPLE },
+	{ "innodb_data_pending_fsyncs",           K_SAMPLE },
+	{ "innodb_data_pending_reads",            K_SAMPLE },
+	{ "innodb_data_pending_writes",           K_SAMPLE },
+	{ "innodb_num_open_files",                K_SAMPLE },
+	{ "innodb_os_log_pending_fsyncs",         K_SAMPLE },
+	{ "innodb_os_log_pending_writes",         K_SAMPLE },
+	{ "innodb_row_lock_current_waits",        K_SAMPLE },
+	{ "innodb_row_lock_time_avg",             K_SAMPLE },
+	{ "innodb_row_lock_time_max",             K_SAMPLE },
+	{ "key_blocks_not_flushed",               K_SAMPLE },
+	{ "key_blocks_unused",                    K_SAMPLE },
+	{ "key_blocks_used",                      K_SAMPLE },
+	{ "max_used_connections",                 K_SAMPLE },
+	{ "open_files",                           K_SAMPLE },
+	{ "open_streams",                         K_SAMPLE },
+	{ "open_table_definitions",               K_SAMPLE },
+	{ "open_tables",                          K_SAMPLE },
+	{ "prepared_stmt_count",                  K_SAMPLE },
+	{ "qcache_free_blocks",                   K_SAMPLE },
+	{ "qcache_free_memory",                   K_SAMPLE },
+	{ "qcache_queries_in_cache",              K_SAMPLE },
+	{ "qcache_total_blocks",                  K_SAMPLE },
+	{ "slave_open_temp_tables",               K_SAMPLE },
+	{ "threads_cached",                       K_SAMPLE },
+	{ "threads_connected",                    K_SAMPLE },
+	{ "threads_running",                      K_SAMPLE },
+	{ "uptime",                               K_SAMPLE },
+
+	{ "innodb_buffer_pool_instances",         K_VAR },
+	{ "innodb_buffer_pool_size",              K_VAR },
+	{ "innodb_io_capacity",                   K_VAR },
+	{ "innodb_log_buffer_size",               K_VAR },
+	{ "innodb_log_file_size",                 K_VAR },
+	{ "innodb_open_files",                    K_VAR },
+	{ "innodb_thread_concurrency",            K_VAR },
+	{ "join_buffer_size",                     K_VAR },
+	{ "key_buffer_size",                      K_VAR },
+	{ "long_query_time",                      K_VAR },
+	{ "max_allowed_packet",                   K_VAR },
+	{ "max_connections",                      K_VAR },
+	{ "max_heap_table_size",                  K_VAR },
+	{ "max_prepared_stmt_count",              K_VAR },
+	{ "max_user_connections",                 K_VAR },
+	{ "open_files_limit",                     K_VAR },
+	{ "query_cache_size",                     K_VAR },
+	{ "read_buffer_size",                     K_VAR },
+	{ "sort_buffer_size",                     K_VAR },
+	{ "table_definition_cache",               K_VAR },
+	{ "table_open_cache",                     K_VAR },
+	{ "thread_cache_size",                    K_VAR },
+	{ "tmp_table_size",                       K_VAR },
+	{ "wait_timeout",                         K_VAR },
+};
+#define NKNOWN (sizeof(KNOWN) / sizeof(KNOWN[0]))
+
+/* A two-level perfect hash over KNOWN: the name hashes (with seed 0) to
+   a bucket, and that bucket's seed hashes it to a slot that no other
+   known name lands in, so every lookup is two hashes and at most one
+   strcasecmp().  The seeds are worked out from KNOWN at startup, so
+   adding a name is just another line up there. */
+#define KNOWN_SLOTS   512   /* power of two, at least 2x NKNOWN */
+#define KNOWN_BUCKETS 128
+
+static struct {
+	uint16_t seed[KNOWN_BUCKETS];  /* 0 = no known names */
+	int16_t  slot[KNOWN_SLOTS];    /* index into KNOWN, or -1 */
+} PHASH;
+
+static uint32_t s_hash(const char *s, uint32_t seed)
+{
+	uint32_t h = 2166136261u ^ (seed * 16777619u);
+	for (; *s; s++)
+		h = (h ^ (unsigned char)tolower(*s)) * 16777619u;
+	return h ^ (h >> 15);
+}
+
+static void s_phash_init(void)
+{
+	size_t i, j, b, n;
+	int order[KNOWN_BUCKETS], count[KNOWN_BUCKETS] = { 0 };
+	uint32_t taken[KNOWN_SLOTS / 32] = { 0 };
+
+	for (i = 0; i < NKNOWN; i++)
+		count[s_hash(KNOWN[i].name, 0) % KNOWN_BUCKETS]++;
+
+	/* place the most crowded buckets first, while there's room */
+	for (b = 0; b < KNOWN_BUCKETS; b++) {
+		order[b] = b;
+		for (j = b; j > 0 && count[order[j - 1]] < count[order[j]]; j--) {
+			int t = order[j]; order[j] = order[j - 1]; order[j - 1] = t;
+		}
 	}
+
+	memset(PHASH.slot, 0xff, sizeof(PHASH.slot));
+	for (b = 0; b < KNOWN_BUCKETS && count[order[b]]; b++) {
+		size_t members[NKNOWN], slots[NKNOWN];
+		for (n = 0, i = 0; i < NKNOWN; i++)
+			if (s_hash(KNOWN[i].name, 0) % KNOWN_BUCKETS == (size_t)order[b])
+				members[n++] = i;
+
+		uint16_t seed;
+		for (seed = 1; ; seed++) {
+			for (i = 0; i < n; i++) {
+				slots[i] = s_hash(KNOWN[members[i]].name, seed) % KNOWN_SLOTS;
+				if (taken[slots[i] / 32] & (1u << (slots[i] % 32)))
+					break;
+				for (j = 0; j < i && slots[j] != slots[i]; j++)
+					;
+				if (j < i)
+					break;
+			}
+			if (i == n)
+				break;
+		}
+
+		PHASH.seed[order[b]] = seed;
+		for (i = 0; i < n; i++) {
+			taken[slots[i] / 32] |= 1u << (slots[i] % 32);
+			PHASH.slot[slots[i]] = members[i];
+		}
+	}
+}
+
+/* K_* for a status variable / setting name, or 0 if we don't want it */
+static int s_known(const char *name, const char **canon)
+{
+	uint32_t seed = PHASH.seed[s_hash(name, 0) % KNOWN_BUCKETS];
+	int i = seed ? PHASH.slot[s_hash(name, seed) % KNOWN_SLOTS] : -1;
+	if (i >= 0 && strcasecmp(KNOWN[i].name, name) == 0) {
+		*canon = KNOWN[i].name;
+		return KNOWN[i].kind;
+	}
+
+	*canon = NULL;
+	if (strncasecmp(name, "com_", 4) == 0 || strncasecmp(name, "handler_", 8) == 0)
+		return K_RATE;
+	return 0;
+}
+
+static void run_status(MYSQL *db, FILE *out, const char *tag)
+{
+	static const char *sql = "SHOW GLOBAL STATUS; SHOW GLOBAL VARIABLES";
+	char lower[128];
+	int pass;
+
+	int32_t now = time_s();
+	if (_mysql_query(db, sql) != 0) {
+		fprintf(stderr, "%s%s`%s' failed\nerror: %s\n", tag ? tag : "", tag ? ": " : "",
+			sql, _mysql_error(db));
+		return;
+	}
+
+	/* first the status counters, then the variables */
+	for (pass = 0; pass < 2; pass++) {
+		if (pass > 0 && _mysql_next_result(db) != 0)
+			break;
+
+		MYSQL_RES *res = _mysql_use_result(db);
+		if (!res)
+			break;
+
+		MYSQL_ROW row;
+		while ((row = _mysql_fetch_row(res)) != NULL) {
+			const char *name;
+			int kind = row[0] ? s_known(row[0], &name) : 0;
+			if (!kind || (kind == K_VAR) != (pass == 1) || !s_numeric(row[1]))
+				continue;
+
+			if (!name) {
+				size_t i;
+				for (i = 0; row[0][i] && i < sizeof(lower) - 1; i++)
+					lower[i] = tolower(row[0][i]);
+				lower[i] = '\0';
+				name = lower;
+			}
+			fprintf(out, "%s %i %s:mysql:%s%s%s:%s %s\n", kind == K_RATE ? "RATE" : "SAMPLE",
+				now, PREFIX, tag ? tag : "", tag ? ":" : "",
+				pass ? "variables" : "status", name, row[1]);
+		}
+		_mysql_free_result(res);
+	}
+
+	if (_mysql_errno(db))
+		fprintf(stderr, "%s%s`%s' failed\nerror: %s\n", tag ? tag : "", tag ? ": " : "",
+			sql, _mysql_error(db));
+
+	/* in case we bailed out early */
+	while (_mysql_next_result(db) == 0)
+		_mysql_free_result(_mysql_use_result(db));
 }
 
 #define BUF_SIZE 16384
-static void run_queries(MYSQL *db, FILE *io)
+static void read_queries(FILE *io)
 {
 	char *buf = vmalloc(BUF_SIZE);
+	const char *type = NULL;
 	while (fgets(buf, BUF_SIZE, io) != NULL) {
 		char *sql = buf;
 		while (isspace(*sql)) sql++;
 
+		/* -- @type RATE|SAMPLE, for the wide columns of the next query */
+		if (strncmp(sql, "-- @type", 8) == 0 && isspace(sql[8])) {
+			char *t = sql + 8;
+			while (isspace(*t)) t++;
+			if (strncasecmp(t, "RATE", 4) == 0)
+				type = "RATE";
+			else if (strncasecmp(t, "SAMPLE", 6) == 0)
+				type = "SAMPLE";
+			else
+				fprintf(stderr, "unrecognized type in `%s'", sql);
+			continue;
+		}
+
 		if (!*sql || *sql == '-' || *sql == '#' || *sql == ';')
 			continue; /* blank line or comment */
 
-		run_query(db, sql);
+		char *e = sql + strlen(sql);
+		while (e > sql && isspace(e[-1])) *--e = '\0';
+
+		OPTIONS.queries = realloc(OPTIONS.queries, (OPTIONS.nqueries + 1) * sizeof(query_t));
+		OPTIONS.queries[OPTIONS.nqueries].sql  = strdup(sql);
+		OPTIONS.queries[OPTIONS.nqueries].type = type;
+		OPTIONS.nqueries++;
+		type = NULL;
+	}
+	free(buf);
+}
+
+static MYSQL* s_connect(target_t *t, int timeout)
+{
+	MYSQL *db = _mysql_init(NULL);
+	if (!db) {
+		fprintf(stderr, "initialization failed\n");
+		return NULL;
+	}
+
+	if (timeout > 0) {
+		unsigned int secs = timeout;
+		_mysql_options(db, MYSQL_OPT_CONNECT_TIMEOUT, &secs);
+		_mysql_options(db, MYSQL_OPT_READ_TIMEOUT,    &secs);
+		_mysql_options(db, MYSQL_OPT_WRITE_TIMEOUT,   &secs);
+	}
+
+	if (!_mysql_real_connect(db, t->host, t->user, t->pass, t->database, t->port, NULL,
+	                         OPTIONS.status ? CLIENT_MULTI_STATEMENTS : 0)) {
+		fprintf(stderr, "%s%sconnection failed: %s\n", t->tag ? t->tag : "", t->tag ? ": " : "",
+			_mysql_error(db));
+		_mysql_close(db);
+		return NULL;
+	}
+
+	/* per-statement timeout; MySQL 5.7.8+ calls it max_execution_time
+	   (in ms), MariaDB 10.1+ max_statement_time (in seconds), and
+	   anything older just doesn't get one */
+	if (OPTIONS.timeout > 0) {
+		char sql[128];
+		snprintf(sql, sizeof(sql), "SET SESSION max_execution_time = %i", OPTIONS.timeout);
+		if (_mysql_query(db, sql) != 0) {
+			snprintf(sql, sizeof(sql), "SET SESSION max_statement_time = %i.%03i",
+				OPTIONS.timeout / 1000, OPTIONS.timeout % 1000);
+			_mysql_query(db, sql);
+		}
+	}
+	return db;
+}
+
+static int s_open(target_t *t, int timeout)
+{
+	t->db = s_connect(t, timeout);
+	if (!t->db)
+		return 1;
+	if (OPTIONS.interval)
+		s_prepare(t);
+	return 0;
+}
+
+static void s_close(target_t *t)
+{
+	int i;
+	if (t->prepared) {
+		for (i = 0; i < OPTIONS.nqueries; i++) {
+			prepared_t *p = &t->prepared[i];
+			if (!p->stmt)
+				continue;
+			_mysql_free_result(p->meta);
+			_mysql_stmt_close(p->stmt);
+			free(p->bind);
+			free(p->buf);
+			free(p->len);
+			free(p->null);
+			free(p->row);
+		}
+		free(t->prepared);
+		t->prepared = NULL;
 	}
+	if (t->db)
+		_mysql_close(t->db);
+	t->db = NULL;
+}
+
+/* run one query (or the --status pass, for q < 0) against t; returns
+   non-zero if the server went away in the process */
+static int s_run(target_t *t, int q, FILE *out)
+{
+	if (q < 0)
+		run_status(t->db, out, t->tag);
+	else if (t->prepared)
+		run_prepared(t, q, out);
+	else
+		run_query(t->db, &OPTIONS.queries[q], out, t->tag);
+
+	unsigned int e = _mysql_errno(t->db);
+	return e == CR_SERVER_GONE_ERROR || e == CR_SERVER_LOST;
+}
+
+/* Targets mode.  libmysqlclient only gives us blocking calls (and we
+   only have it via dlopen), so instead of multiplexing sockets we run
+   --concurrency worker threads that each take the next target off the
+   list.  Connect / read / write timeouts are set to the --deadline,
+   and a target that runs past it mid-batch skips its remaining
+   queries.  With --interval, each target keeps its connection (and
+   prepared statements) until it fails.  Output is buffered per
+   query, so lines from different targets never interleave, and no
+   worker ever holds more than one query's worth of it. */
+static void* s_worker(void *_)
+{
+	_mysql_thread_init();
+	for (;;) {
+		pthread_mutex_lock(&OPTIONS.lock);
+		int i = OPTIONS.next++;
+		pthread_mutex_unlock(&OPTIONS.lock);
+		if (i >= OPTIONS.ntargets)
+			break;
+
+		target_t *t = &OPTIONS.targets[i];
+		int64_t deadline = time_ms() + OPTIONS.deadline * 1000;
+		int failed = 0;
+
+		if (!t->db && s_open(t, OPTIONS.deadline) != 0) {
+			failed = 1;
+
+		} else {
+			int q;
+			for (q = OPTIONS.status ? -1 : 0; q < OPTIONS.nqueries; q++) {
+				if (time_ms() > deadline) {
+					fprintf(stderr, "%s: timed out\n", t->tag);
+					failed = 1;
+					break;
+				}
+
+				char *buf = NULL;
+				size_t len = 0;
+				FILE *out = open_memstream(&buf, &len);
+				int lost = s_run(t, q, out);
+				fclose(out);
+
+				pthread_mutex_lock(&OPTIONS.lock);
+				fwrite(buf, 1, len, stdout);
+				fflush(stdout);
+				pthread_mutex_unlock(&OPTIONS.lock);
+				free(buf);
+
+				if (lost) {
+					fprintf(stderr, "%s: connection lost\n", t->tag);
+					failed = 1;
+					break;
+				}
+			}
+		}
+		if (failed || !OPTIONS.interval)
+			s_close(t);
+
+		pthread_mutex_lock(&OPTIONS.lock);
+		OPTIONS.failed += failed;
+		pthread_mutex_unlock(&OPTIONS.lock);
+	}
+
+	_mysql_thread_end();
+	return NULL;
+}
+
+static int run_targets(void)
+{
+	int i, n = MIN(OPTIONS.concurrency, OPTIONS.ntargets);
+	pthread_t *tids = calloc(n, sizeof(pthread_t));
+
+	OPTIONS.next   = 0;
+	OPTIONS.failed = 0;
+
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&tids[i], NULL, s_worker, NULL) != 0) {
+			perror("pthread_create");
+			break;
+		}
+	}
+	while (i-- > 0)
+		pthread_join(tids[i], NULL);
+
+	free(tids);
+	return OPTIONS.failed;
 }
 
 static int read_creds(const char *file, char **user, char **pass)
@@ -105,14 +857,75 @@ static int read_creds(const char *file, char **user, char **pass)
 	return 0;
 }
 
+/* one target per line:  TAG  HOST[:PORT]  DATABASE  [CREDENTIALS-FILE]
+   targets without a credentials file use the --credentials ones */
+static int read_targets(const char *file, const char *user, const char *pass)
+{
+	FILE *io = fopen(file, "r");
+	if (!io) {
+		perror(file);
+		return 1;
+	}
+
+	char buf[1024];
+	int n = 0, errors = 0;
+	while (fgets(buf, sizeof(buf), io) != NULL) {
+		n++;
+		char *f[5], *p = buf;
+		int nf = 0;
+		while (nf < 5) {
+			while (isspace(*p)) p++;
+			if (!*p || *p == '#')
+				break;
+			f[nf++] = p;
+			while (*p && !isspace(*p)) p++;
+			if (*p) *p++ = '\0';
+		}
+		if (nf == 0)
+			continue;
+		if (nf < 3 || nf > 4) {
+			fprintf(stderr, "%s:%i: expected TAG HOST[:PORT] DATABASE [CREDENTIALS-FILE]\n", file, n);
+			errors++;
+			continue;
+		}
+
+		int port = 3306;
+		char *colon = strchr(f[1], ':');
+		if (colon && !strchr(colon + 1, ':')) {
+			*colon = '\0';
+			port = atoi(colon + 1);
+		}
+
+		char *tuser = NULL, *tpass = NULL;
+		if (nf == 4 && read_creds(f[3], &tuser, &tpass) != 0) {
+			errors++;
+			continue;
+		}
+
+		OPTIONS.targets = realloc(OPTIONS.targets, (OPTIONS.ntargets + 1) * sizeof(target_t));
+		target_t *t = &OPTIONS.targets[OPTIONS.ntargets++];
+		memset(t, 0, sizeof(target_t));
+		t->tag      = strdup(f[0]);
+		t->host     = strdup(f[1]);
+		t->port     = port;
+		t->database = strdup(f[2]);
+		t->user     = tuser ? tuser : strdup(user);
+		t->pass     = tpass ? tpass : (pass ? strdup(pass) : NULL);
+	}
+
+	fclose(io);
+	return errors;
+}
+
 int main(int argc, char **argv)
 {
 	char *creds    = NULL;
+	char *targets  = NULL;
 	char *database = strdup("mysql");
 	char *host     = strdup("localhost");
 	char *port     = strdup("3306");
 
-	const char *short_opts = "h?p:c:d:H:P:";
+	const char *short_opts = "h?p:c:d:H:P:si:t:T:C:D:";
 	struct option long_opts[] = {
 		{ "help",              no_argument, 0, 'h' },
 		{ "prefix",      required_argument, 0, 'p' },
@@ -121,6 +934,12 @@ int main(int argc, char **argv)
 		{ "database",    required_argument, 0, 'd' },
 		{ "host",        required_argument, 0, 'H' },
 		{ "port",        required_argument, 0, 'P' },
+		{ "status",            no_argument, 0, 's' },
+		{ "interval",    required_argument, 0, 'i' },
+		{ "timeout",     required_argument, 0, 't' },
+		{ "targets",     required_argument, 0, 'T' },
+		{ "concurrency", required_argument, 0, 'C' },
+		{ "deadline",    required_argument, 0, 'D' },
 		{ 0, 0, 0, 0 },
 	};
 	int opt, idx;
@@ -130,6 +949,7 @@ int main(int argc, char **argv)
 		case '?':
 			fprintf(stdout, "mysql (a Bolo collector)\n"
 			                "USAGE: mysql [options] /path/to/queries.sql\n"
+			                "       mysql [options] --status [/path/to/queries.sql]\n"
 			                "\n"
 			                "options:\n"
 			                "   -h, --help               Show this help screen\n"
@@ -142,6 +962,25 @@ int main(int argc, char **argv)
 			                "                            (Defaults to localhost)\n"
 			                "   -P, --port NUMBER        TCP port to connect to\n"
 			                "                            (Defaults to 5432)\n"
+			                "   -s, --status             Report the server's counters and gauges\n"
+			                "                            from SHOW GLOBAL STATUS, and its key\n"
+			                "                            settings from SHOW GLOBAL VARIABLES, as\n"
+			                "                            mysql:status:* and mysql:variables:*\n"
+			                "   -i, --interval SECONDS   Keep running, collecting every SECONDS\n"
+			                "                            over one connection, with each query\n"
+			                "                            prepared up front\n"
+			                "   -t, --timeout MS         Cancel any query that runs longer than\n"
+			                "                            MS milliseconds (default 5000 with\n"
+			                "                            --interval or --targets; otherwise 0,\n"
+			                "                            which means never)\n"
+			                "\n"
+			                "   -T, --targets FILE       Collect from every database listed in FILE,\n"
+			                "                            one 'TAG HOST[:PORT] DATABASE [CREDS-FILE]'\n"
+			                "                            per line, instead of --host / --database.\n"
+			                "                            Metrics are named mysql:TAG:name.\n"
+			                "   -C, --concurrency N      Talk to at most N targets at once (default 8)\n"
+			                "   -D, --deadline SECONDS   Give up on a target that hasn't finished\n"
+			                "                            within SECONDS (default 30)\n"
 			                "\n");
 			exit(0);
 
@@ -169,10 +1008,45 @@ int main(int argc, char **argv)
 			free(database);
 			database = strdup(optarg);
 			break;
+
+		case 's':
+			OPTIONS.status = 1;
+			break;
+
+		case 'i':
+			OPTIONS.interval = atoi(optarg);
+			if (OPTIONS.interval < 0) OPTIONS.interval = 0;
+			break;
+
+		case 't':
+			OPTIONS.timeout = atoi(optarg);
+			if (OPTIONS.timeout < 0) OPTIONS.timeout = 0;
+			break;
+
+		case 'T':
+			free(targets);
+			targets = strdup(optarg);
+			break;
+
+		case 'C':
+			OPTIONS.concurrency = atoi(optarg);
+			if (OPTIONS.concurrency < 1) OPTIONS.concurrency = 1;
+			break;
+
+		case 'D':
+			OPTIONS.deadline = atoi(optarg);
+			if (OPTIONS.deadline < 1) OPTIONS.deadline = 1;
+			break;
 		}
 	}
 
-	if (!argv[optind]) {
+	/* a single run waits as long as its queries take, like it
+	   always has (and skips the round trips to set a timeout);
+	   only the long-running modes get a default */
+	if (OPTIONS.timeout < 0)
+		OPTIONS.timeout = (OPTIONS.interval || targets) ? 5000 : 0;
+
+	if (!argv[optind] && !OPTIONS.status) {
 		fprintf(stderr, "USAGE: %s [options] /path/to/queries.sql\n", argv[0]);
 		return 1;
 	}
@@ -185,6 +1059,8 @@ int main(int argc, char **argv)
 		exit(1);
 	if (!user)
 		user = strdup("root");
+	if (targets && read_targets(targets, user, pass) != 0)
+		exit(1);
 
 	libmysqlclient = dlopen("libmysqlclient.so", RTLD_LAZY|RTLD_DEEPBIND);
 	if (!libmysqlclient) {
@@ -196,29 +1072,105 @@ int main(int argc, char **argv)
 	_mysql_close        = dlsym(libmysqlclient, "mysql_close");
 	_mysql_query        = dlsym(libmysqlclient, "mysql_query");
 	_mysql_error        = dlsym(libmysqlclient, "mysql_error");
+	_mysql_errno        = dlsym(libmysqlclient, "mysql_errno");
 	_mysql_real_connect = dlsym(libmysqlclient, "mysql_real_connect");
-	_mysql_store_result = dlsym(libmysqlclient, "mysql_store_result");
+	_mysql_use_result   = dlsym(libmysqlclient, "mysql_use_result");
+	_mysql_next_result  = dlsym(libmysqlclient, "mysql_next_result");
 	_mysql_fetch_row    = dlsym(libmysqlclient, "mysql_fetch_row");
 	_mysql_fetch_field  = dlsym(libmysqlclient, "mysql_fetch_field");
+	_mysql_free_result  = dlsym(libmysqlclient, "mysql_free_result");
+	_mysql_options      = dlsym(libmysqlclient, "mysql_options");
+	_mysql_server_init  = dlsym(libmysqlclient, "mysql_server_init");
+	_mysql_thread_init  = dlsym(libmysqlclient, "mysql_thread_init");
+	_mysql_thread_end   = dlsym(libmysqlclient, "mysql_thread_end");
 
-	MYSQL *db = _mysql_init(NULL);
-	if (!db) {
-		fprintf(stderr, "initialization failed: %s\n", _mysql_error(db));
-		return 1;
+	_mysql_stmt_init            = dlsym(libmysqlclient, "mysql_stmt_init");
+	_mysql_stmt_prepare         = dlsym(libmysqlclient, "mysql_stmt_prepare");
+	_mysql_stmt_result_metadata = dlsym(libmysqlclient, "mysql_stmt_result_metadata");
+	_mysql_stmt_bind_result     = dlsym(libmysqlclient, "mysql_stmt_bind_result");
+	_mysql_stmt_execute         = dlsym(libmysqlclient, "mysql_stmt_execute");
+	_mysql_stmt_fetch           = dlsym(libmysqlclient, "mysql_stmt_fetch");
+	_mysql_stmt_free_result     = dlsym(libmysqlclient, "mysql_stmt_free_result");
+	_mysql_stmt_close           = dlsym(libmysqlclient, "mysql_stmt_close");
+	_mysql_stmt_error           = dlsym(libmysqlclient, "mysql_stmt_error");
+
+	/* not thread-safe; has to happen before any mysql_init() */
+	_mysql_server_init(0, NULL, NULL);
+
+	if (argv[optind]) {
+		FILE *io = stdin;
+		if (!streq(argv[optind], "-")) {
+			io = fopen(argv[optind], "r");
+			if (!io) {
+				perror(argv[optind]);
+				return 1;
+			}
+		}
+		read_queries(io);
+		fclose(io);
 	}
-	if (!_mysql_real_connect(db, host, user, pass, database, atoi(port), NULL, 0)) {
-		fprintf(stderr, "connection failed: %s\n", _mysql_error(db));
-		_mysql_close(db);
-		return 1;
+	if (OPTIONS.status)
+		s_phash_init();
+
+	if (targets) {
+		if (!OPTIONS.interval)
+			return run_targets() ? 2 : 0;
+
+		for (;;) {
+			int64_t started = time_ms();
+			run_targets();
+
+			int64_t left = started + OPTIONS.interval * 1000 - time_ms();
+			if (left > 0)
+				usleep(left * 1000);
+		}
 	}
 
-	FILE *io = stdin;
-	if (!streq(argv[optind], "-")) {
-		io = fopen(argv[optind], "r");
-		if (!io) perror(argv[optind]);
+	target_t t = {
+		.host     = host,
+		.port     = atoi(port),
+		.database = database,
+		.user     = user,
+		.pass     = pass,
+	};
+	int q = OPTIONS.status ? -1 : 0;
+
+	if (!OPTIONS.interval) {
+		if (s_open(&t, 0) != 0)
+			return 1;
+		for (; q < OPTIONS.nqueries; q++)
+			if (s_run(&t, q, stdout))
+				break;
+		s_close(&t);
+		return 0;
+	}
+
+	/* daemon mode: hang onto the connection, and when we lose it,
+	   wait twice as long (up to 5m) each time it won't come back */
+	int failures = 0;
+	for (;;) {
+		int64_t started = time_ms();
+		int64_t wait = OPTIONS.interval * 1000;
+
+		if (!t.db && s_open(&t, OPTIONS.deadline) != 0) {
+			failures++;
+			wait = MIN(wait << MIN(failures, 16), 300 * 1000);
+			wait = MAX(wait, OPTIONS.interval * 1000);
+
+		} else {
+			failures = 0;
+			for (q = OPTIONS.status ? -1 : 0; q < OPTIONS.nqueries; q++) {
+				if (s_run(&t, q, stdout)) {
+					fprintf(stderr, "connection lost: %s\n", _mysql_error(t.db));
+					s_close(&t);
+					break;
+				}
+			}
+			fflush(stdout);
+		}
+
+		int64_t left = started + wait - time_ms();
+		if (left > 0)
+			usleep(left * 1000);
 	}
-	run_queries(db, io);
-	fclose(io);
-	_mysql_close(db);
-	return 0;
 }
@@ -0,0 +1,551 @@
+#include "common.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+/* we only care about the first line of output (like nagwrap), but
+   keep reading (and throwing away) the rest until the plugin exits */
+#define OUTPUT_MAX 8192
+
+#define C_PENDING  0
+#define C_RUNNING  1
+#define C_TIMEDOUT 2  /* still running, but already reported on */
+#define C_DONE     3
+
+typedef struct {
+	char    *name;
+	char   **argv;
+	int      timeout;
+
+	int      state;
+	pid_t    pid;
+	int      fd;         /* read end of the plugin's stdout, or -1 */
+	int      status;     /* from waitpid, once reaped (pid == 0) */
+	int64_t  deadline;   /* when to give up on it (ms) */
+	int64_t  kill_at;    /* when to stop asking nicely (ms) */
+
+	char     out[OUTPUT_MAX];
+	size_t   len;
+} check_t;
+
+static struct {
+	int      concurrency;
+	int      timeout;
+	int      grace;
+	int      thresholds;
+
+	check_t *checks;
+	int      nchecks;
+} OPTIONS = {
+	.concurrency = 16,
+	.timeout     = 45,
+	.grace       = 5,
+};
+
+/* split a check line into words; '...' and "..." quote (no escapes),
+   and nothing else is special -- there's no shell involved */
+static char** s_words(char *s, int *n)
+{
+	char **w = NULL;
+	*n = 0;
+	while (*s) {
+		while (isspace(*s)) s++;
+		if (!*s)
+			break;
+
+		char *word = s, *d = s;
+		while (*s && !isspace(*s)) {
+			if (*s == '\'' || *s == '"') {
+				char q = *s++;
+				while (*s && *s != q) *d++ = *s++;
+				if (*s) s++;
+			} else {
+				*d++ = *s++;
+			}
+		}
+		if (*s) s++;
+		*d = '\0';
+
+		w = realloc(w, (*n + 2) * sizeof(char *));
+		w[(*n)++] = word;
+		w[*n] = NULL;
+	}
+	return w;
+}
+
+/* NAME [TIMEOUT] /path/to/plugin [ARGS ...] */
+static int read_checks(const char *file)
+{
+	FILE *io = fopen(file, "r");
+	if (!io) {
+		perror(file);
+		return 1;
+	}
+
+	char buf[8192];
+	int lineno = 0, errors = 0;
+	while (fgets(buf, sizeof(buf), io) != NULL) {
+		lineno++;
+		char *a = buf;
+		while (isspace(*a)) a++;
+		if (!*a || *a == '#')
+			continue; /* blank line or comment */
+
+		int n;
+		char **w = s_words(strdup(a), &n);
+		int timeout = OPTIONS.timeout, cmd = 1;
+		if (n > 1 && isdigit(w[1][0])) {
+			timeout = atoi(w[1]);
+			cmd = 2;
+		}
+		if (cmd >= n) {
+			fprintf(stderr, "%s:%i: expected NAME [TIMEOUT] /path/to/plugin [ARGS ...]\n", file, lineno);
+			errors++;
+			continue;
+		}
+
+		OPTIONS.checks = realloc(OPTIONS.checks, (OPTIONS.nchecks + 1) * sizeof(check_t));
+		check_t *c = &OPTIONS.checks[OPTIONS.nchecks++];
+		memset(c, 0, sizeof(check_t));
+		c->name    = w[0][0] == ':' ? string("%s%s", PREFIX, w[0]) : w[0];
+		c->argv    = w + cmd;
+		c->timeout = timeout > 0 ? timeout : OPTIONS.timeout;
+		c->fd      = -1;
+	}
+	fclose(io);
+	return errors;
+}
+
+static void s_state(check_t *c, const char *status, const char *fmt, ...)
+{
+	va_list ap;
+	printf("STATE %i %s %s ", time_s(), c->name, status);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+}
+
+static char* s_cmdline(check_t *c)
+{
+	size_t len = 1;
+	char **a;
+	for (a = c->argv; *a; a++)
+		len += strlen(*a) + 1;
+
+	char *s = vmalloc(len), *p = s;
+	for (a = c->argv; *a; a++)
+		p += sprintf(p, "%s%s", p == s ? "" : " ", *a);
+	return s;
+}
+
+/* a (plain) number, as found in perfdata; NULL if there isn't one */
+static const char* s_number(const char *a, const char *b, char *num, size_t len)
+{
+	const char *p = a;
+	if (p < b && (*p == '-' || *p == '+')) p++;
+	if (p == b || !(isdigit(*p) || *p == '.'))
+		return NULL;
+	while (p < b && (isdigit(*p) || *p == '.')) p++;
+	if (p < b && (*p == 'e' || *p == 'E')) {
+		p++;
+		if (p < b && (*p == '-' || *p == '+')) p++;
+		while (p < b && isdigit(*p)) p++;
+	}
+
+	size_t n = MIN((size_t)(p - a), len - 1);
+	memcpy(num, a, n);
+	num[n] = '\0';
+	return p;
+}
+
+/* 'label'=value[UOM];[warn];[crit];[min];[max] ...
+
+   labels may be quoted (with '' for a literal '), and then may have
+   spaces in them, which become '_' in the metric name.  Values that
+   aren't numbers (U, for unknown) are skipped, as are warn / crit
+   thresholds that are ranges rather than plain numbers. */
+static void s_perfdata(check_t *c, const char *p, const char *end)
+{
+	static const char *extra[] = { NULL, "warn", "crit", "min", "max" };
+	char label[256], num[64];
+	int32_t now = time_s();
+
+	while (p < end) {
+		size_t n = 0;
+		while (p < end && isspace(*p)) p++;
+		if (p == end)
+			break;
+
+		if (*p == '\'') {
+			for (p++; p < end; p++) {
+				if (*p == '\'') {
+					if (p + 1 < end && p[1] == '\'') p++;
+					else { p++; break; }
+				}
+				if (n < sizeof(label) - 1)
+					label[n++] = isspace(*p) ? '_' : *p;
+			}
+		} else {
+			for (; p < end && *p != '=' && !isspace(*p); p++)
+				if (n < sizeof(label) - 1)
+					label[n++] = *p;
+		}
+		label[n] = '\0';
+
+		if (p == end || *p != '=' || !n) {
+			/* not perfdata; skip to the next word */
+			while (p < end && !isspace(*p)) p++;
+			continue;
+		}
+		p++;
+
+		/* value[UOM], then the ;-separated extras */
+		int i;
+		for (i = 0; p < end && !isspace(*p); i++) {
+			const char *e = p;
+			while (e < end && *e != ';' && !isspace(*e)) e++;
+
+			if (i < 5 && (i == 0 || OPTIONS.thresholds)) {
+				const char *u = s_number(p, e, num, sizeof(num));
+				if (u) {
+					/* the UOM (s, %, B, KB, c, ...) is only allowed on
+					   the value, and doesn't change it; nagwrap never
+					   scaled it either */
+					if (i == 0)
+						printf("SAMPLE %i %s:%s %s\n", now, c->name, label, num);
+					else if (u == e)
+						printf("SAMPLE %i %s:%s:%s %s\n", now, c->name, label, extra[i], num);
+				}
+			}
+
+			p = e;
+			if (p < end && *p == ';') p++;
+		}
+	}
+}
+
+static void s_report(check_t *c)
+{
+	if (c->state == C_TIMEDOUT)
+		return; /* already said so */
+
+	if (WIFSIGNALED(c->status)) {
+		char *cmd = s_cmdline(c);
+		s_state(c, "UNKNOWN", "killed by signal %i, running: %s", WTERMSIG(c->status), cmd);
+		free(cmd);
+		return;
+	}
+
+	/* just the first line */
+	char *nl = memchr(c->out, '\n', c->len);
+	size_t len = nl ? (size_t)(nl - c->out) : c->len;
+	if (!len) {
+		char *cmd = s_cmdline(c);
+		fprintf(stderr, "%s: no output from %s\n", c->name, cmd);
+		free(cmd);
+		return;
+	}
+	c->out[len] = '\0';
+
+	/* SUMMARY | PERFDATA [| ...] */
+	char *summary = c->out, *perf = strchr(c->out, '|'), *end = c->out + len;
+	if (perf) {
+		char *s = perf;
+		while (s > summary && isspace(s[-1])) s--;
+		*s = '\0';
+		perf++;
+		char *e = strchr(perf, '|');
+		if (e) end = e;
+		s_perfdata(c, perf, end);
+	}
+
+	int rc = WEXITSTATUS(c->status);
+	s_state(c, rc == 0 ? "OK"
+	         : rc == 1 ? "WARNING"
+	         : rc == 2 ? "CRITICAL" : "UNKNOWN", "%s", summary);
+}
+
+static void s_finish(check_t *c, int *running)
+{
+	if (c->fd >= 0) {
+		/* whatever's left in the pipe, if it exited with it open */
+		ssize_t n;
+		while (c->len < OUTPUT_MAX - 1
+		    && (n = read(c->fd, c->out + c->len, OUTPUT_MAX - 1 - c->len)) > 0)
+			c->len += n;
+		close(c->fd);
+		c->fd = -1;
+	}
+
+	s_report(c);
+	c->state = C_DONE;
+	(*running)--;
+}
+
+static int s_spawn(check_t *c, int epfd, posix_spawnattr_t *attr)
+{
+	int p[2];
+	struct stat st;
+
+	if (stat(c->argv[0], &st) != 0 || !S_ISREG(st.st_mode)) {
+		s_state(c, "CRITICAL", "cannot find check plugin %s", c->argv[0]);
+		c->state = C_DONE;
+		return 0;
+	}
+
+	if (pipe2(p, O_CLOEXEC) != 0) {
+		fprintf(stderr, "pipe failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	posix_spawn_file_actions_t fa;
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_addopen(&fa, 0, "/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_adddup2(&fa, p[1], 1);
+
+	int rc = posix_spawn(&c->pid, c->argv[0], &fa, attr, c->argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	close(p[1]);
+	if (rc != 0) {
+		close(p[0]);
+		s_state(c, "CRITICAL", "unable to run check plugin %s: %s", c->argv[0], strerror(rc));
+		c->state = C_DONE;
+		return 0;
+	}
+
+	fcntl(p[0], F_SETFL, O_NONBLOCK);
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+	epoll_ctl(epfd, EPOLL_CTL_ADD, p[0], &ev);
+
+	c->fd       = p[0];
+	c->state    = C_RUNNING;
+	c->deadline = time_ms() + c->timeout * 1000;
+	c->kill_at  = 0;
+	return 0;
+}
+
+int parse_options(int argc, char **argv);
+
+int main(int argc, char **argv)
+{
+	if (parse_options(argc, argv) != 0) {
+		fprintf(stderr, "USAGE: %s [options] /path/to/checks\n", argv[0]);
+		exit(1);
+	}
+	if (read_checks(argv[optind]) != 0)
+		exit(1);
+
+	/* children get reported through a signalfd, alongside their output */
+	sigset_t mask, none;
+	sigemptyset(&mask);
+	sigemptyset(&none);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	int sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (sfd < 0 || epfd < 0) {
+		fprintf(stderr, "unable to set up epoll / signalfd: %s\n", strerror(errno));
+		exit(2);
+	}
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev);
+
+	/* each plugin in its own process group (so that a timeout takes
+	   out anything it started, too), with a clean signal mask */
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setpgroup(&attr, 0);
+	posix_spawnattr_setsigmask(&attr, &none);
+	sigset_t dfl;
+	sigemptyset(&dfl);
+	sigaddset(&dfl, SIGCHLD);
+	sigaddset(&dfl, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &dfl);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+	int next = 0, running = 0, i, n;
+	struct epoll_event events[64];
+	for (;;) {
+		while (running < OPTIONS.concurrency && next < OPTIONS.nchecks) {
+			check_t *c = &OPTIONS.checks[next++];
+			if (s_spawn(c, epfd, &attr) != 0)
+				exit(2);
+			if (c->state == C_RUNNING)
+				running++;
+		}
+		if (!running && next == OPTIONS.nchecks)
+			break;
+
+		/* sleep until something happens, or the next deadline */
+		int64_t now = time_ms(), wake = -1;
+		for (i = 0; i < next; i++) {
+			check_t *c = &OPTIONS.checks[i];
+			int64_t t = c->state == C_RUNNING  ? c->deadline
+			          : c->state == C_TIMEDOUT ? c->kill_at : -1;
+			if (t >= 0 && (wake < 0 || t < wake))
+				wake = t;
+		}
+		n = epoll_wait(epfd, events, 64, wake < 0 ? -1 : (int)MAX(wake - now, 0));
+		if (n < 0 && errno != EINTR) {
+			fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+			exit(2);
+		}
+
+		for (i = 0; i < n; i++) {
+			check_t *c = events[i].data.ptr;
+			if (c) {
+				/* output (or EOF) */
+				char sink[4096];
+				ssize_t r;
+				do {
+					if (c->len < OUTPUT_MAX - 1) {
+						r = read(c->fd, c->out + c->len, OUTPUT_MAX - 1 - c->len);
+						if (r > 0) c->len += r;
+					} else {
+						r = read(c->fd, sink, sizeof(sink));
+					}
+				} while (r > 0);
+				if (r == 0) {
+					epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+					close(c->fd);
+					c->fd = -1;
+					if (!c->pid)
+						s_finish(c, &running);
+				}
+				continue;
+			}
+
+			/* SIGCHLD; there may be more than one behind it */
+			struct signalfd_siginfo si;
+			while (read(sfd, &si, sizeof(si)) > 0)
+				;
+			pid_t pid;
+			int status;
+			while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+				int j;
+				for (j = 0; j < next; j++) {
+					check_t *c = &OPTIONS.checks[j];
+					if (c->pid != pid)
+						continue;
+					c->pid    = 0;
+					c->status = status;
+					/* its stdout may still be held open by something
+					   it left behind; we're not waiting for that */
+					if (c->fd >= 0)
+						epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+					s_finish(c, &running);
+					break;
+				}
+			}
+		}
+
+		/* timeouts: TERM the whole process group, then KILL it */
+		now = time_ms();
+		for (i = 0; i < next; i++) {
+			check_t *c = &OPTIONS.checks[i];
+			if (c->state == C_RUNNING && c->pid && now >= c->deadline) {
+				char *cmd = s_cmdline(c);
+				s_state(c, "CRITICAL", "timedout after %i sec, running: %s", c->timeout, cmd);
+				free(cmd);
+				kill(-c->pid, SIGTERM);
+				c->state   = C_TIMEDOUT;
+				c->kill_at = now + OPTIONS.grace * 1000;
+
+			} else if (c->state == C_TIMEDOUT && c->pid && now >= c->kill_at) {
+				kill(-c->pid, SIGKILL);
+				c->kill_at = now + 1000;
+			}
+		}
+	}
+
+	posix_spawnattr_destroy(&attr);
+	return 0;
+}
+
+int parse_options(int argc, char **argv)
+{
+	const char *short_opts = "h?p:C:t:k:T";
+	struct option long_opts[] = {
+		{ "help",              no_argument, 0, 'h' },
+		{ "prefix",      required_argument, 0, 'p' },
+		{ "concurrency", required_argument, 0, 'C' },
+		{ "timeout",     required_argument, 0, 't' },
+		{ "grace",       required_argument, 0, 'k' },
+		{ "thresholds",        no_argument, 0, 'T' },
+		{ 0, 0, 0, 0 },
+	};
+	int opt, idx;
+	while ((opt = getopt_long(argc, argv, short_opts, long_opts, &idx)) >= 0) {
+		switch (opt) {
+		case 'h':
+		case '?':
+			fprintf(stdout, "nagios (a Bolo collector)\n"
+			                "USAGE: nagios [options] /path/to/checks\n"
+			                "\n"
+			                "options:\n"
+			                "   -h, --help               Show this help screen\n"
+			                "   -p, --prefix PREFIX      Use the given metric prefix, for checks\n"
+			                "                            named :like:this (FQDN is used by default)\n"
+			                "   -C, --concurrency N      Run at most N checks at once (default 16)\n"
+			                "   -t, --timeout SECONDS    Give up on a check after SECONDS, unless\n"
+			                "                            the checks file says otherwise (default 45)\n"
+			                "   -k, --grace SECONDS      How long a timed-out check gets to exit after\n"
+			                "                            SIGTERM, before it gets SIGKILL (default 5)\n"
+			                "   -T, --thresholds         Also report the warn, crit, min and max\n"
+			                "                            perfdata fields, as LABEL:warn, etc.\n"
+			                "\n"
+			                "Runs every check in the checks file, which has one per line:\n"
+			                "\n"
+			                "    # NAME            [TIMEOUT]  /path/to/plugin [ARGS ...]\n"
+			                "    :disk:root        10         /usr/lib/nagios/plugins/check_disk -w 10%% -p /\n"
+			                "    :load                        /usr/lib/nagios/plugins/check_load -w 5,4,3 -c 10,8,6\n"
+			                "\n"
+			                "and reports on each one just like nagwrap does, with a STATE\n"
+			                "(from the exit code and the first line of output) and a SAMPLE\n"
+			                "for each of its perfdata values.  NAMEs starting with ':' get\n"
+			                "the prefix put in front of them.  Plugins are run directly, not\n"
+			                "through a shell; ARGS may be quoted with '...' or \"...\".\n"
+			                "\n");
+			exit(0);
+
+		case 'p':
+			free(PREFIX);
+			PREFIX = strdup(optarg);
+			break;
+
+		case 'C':
+			OPTIONS.concurrency = atoi(optarg);
+			if (OPTIONS.concurrency < 1) OPTIONS.concurrency = 1;
+			break;
+
+		case 't':
+			OPTIONS.timeout = atoi(optarg);
+			if (OPTIONS.timeout < 1) OPTIONS.timeout = 1;
+			break;
+
+		case 'k':
+			OPTIONS.grace = atoi(optarg);
+			if (OPTIONS.grace < 0) OPTIONS.grace = 0;
+			break;
+
+		case 'T':
+			OPTIONS.thresholds = 1;
+			break;
+		}
+	}
+
+	if (!argv[optind])
+		return 1;
+
+	INIT_PREFIX();
+	return 0;
+}
@@ -1,4 +1,5 @@
 #include "common.h"
+#include <poll.h>
 #include <libpq-fe.h>
 
 static int column(PGresult *r, const char *name) {
@@ -14,20 +15,165 @@ static int skip_empty(const char *s, const char *name)
 	return 1;
 }
 
-static void run_query(PGconn *db, const char *sql)
+typedef struct {
+	char *sql;
+	char  name[32];  /* prepared statement name */
+	int   broken;    /* PQprepare() failed; don't bother running it */
+	const char *type; /* wide mode: type for columns without a suffix */
+} query_t;
+
+/* is this column value something we can send as a metric? */
+static int s_numeric(const char *v)
 {
+	char *end;
+	if (!v || !*v)
+		return 0;
+	strtod(v, &end);
+	return *end == '\0';
+}
+
+/* split a wide-mode column name like "blks_hit__rate" into the metric
+   name ("blks_hit") and its type ("RATE"); columns without a __rate or
+   __sample suffix get the query's -- @type (SAMPLE by default) */
+static const char* s_column(const char *col, const char *type, char *buf, size_t len)
+{
+	size_t n = strlen(col);
+	if (n > 6 && strcasecmp(col + n - 6, "__rate") == 0) {
+		n -= 6;
+		type = "RATE";
+	} else if (n > 8 && strcasecmp(col + n - 8, "__sample") == 0) {
+		n -= 8;
+		type = "SAMPLE";
+	}
+	snprintf(buf, len, "%.*s", (int)n, col);
+	return type ? type : "SAMPLE";
+}
+
+/* name:column, unless the name already ends in a separator */
+static const char* s_join(const char *name, const char *col, char *buf, size_t len)
+{
+	size_t n = strlen(name);
+	if (n == 0)
+		snprintf(buf, len, "%s", col);
+	else if (name[n - 1] == ':' || name[n - 1] == '.')
+		snprintf(buf, len, "%s%s", name, col);
+	else
+		snprintf(buf, len, "%s:%s", name, col);
+	return buf;
+}
+
+#define BY_TIME  0
+#define BY_CALLS 1
+#define BY_ROWS  2
+
+#define T_IDLE       0
+#define T_CONNECTING 1
+#define T_SENDING    2
+#define T_READING    3
+#define T_DONE       4
+#define T_FAILED     5
+
+typedef struct {
+	char    *tag;      /* goes between postgres: and the metric name */
+	char    *dsn;
+
+	PGconn  *db;
+	int      state;    /* one of the T_* constants */
+	int      events;   /* what PQconnectPoll() wants us to wait for */
+	int      from;     /* first query in the batch we sent */
+	int      current;  /* query whose results we're reading */
+	int      failed;   /* first query in the batch that failed, or -1 */
+	int64_t  deadline;
+} target_t;
+
+static struct {
+	query_t  *queries;
+	int       nqueries;
+
+	target_t *targets;
+	int       ntargets;
+	int       concurrency;
+	int       deadline;
+
+	int       interval;
+	int       timeout;     /* ms, or -1 until we know the mode */
+
+	int       statements;  /* top N from pg_stat_statements, or 0 */
+	int       by;          /* one of the BY_* constants */
+} OPTIONS = {
+	.interval    = 0,
+	.timeout     = -1,
+	.concurrency = 8,
+	.deadline    = 30,
+};
+
+/* Wide mode, for results without type / value columns: every numeric
+   column in a row is its own metric, named after the row's name (if
+   there is a name column) and the column. */
+static void wide(query_t *q, PGresult *r, int ncol, const char *tag)
+{
+	char metric[256], full[512];
+	int i, j;
+	int rows = PQntuples(r), cols = PQnfields(r);
+
+	for (i = 0; i < rows; i++) {
+		const char *name = "";
+		if (ncol >= 0) {
+			name = PQgetvalue(r, i, ncol);
+			if (!name || !*name)
+				name = "unnamed";
+		}
+
+		for (j = 0; j < cols; j++) {
+			if (j == ncol)
+				continue;
+
+			char *value = PQgetvalue(r, i, j);
+			if (PQgetisnull(r, i, j) || !s_numeric(value))
+				continue;
+
+			const char *type = s_column(PQfname(r, j), q->type, metric, sizeof(metric));
+			printf("%s %i %s:postgres:%s%s%s %s\n", type, ts, PREFIX,
+				tag ? tag : "", tag ? ":" : "",
+				s_join(name, metric, full, sizeof(full)), value);
+		}
+	}
+
+	/* only complain once, on the (empty) result that ends the query */
+	if (cols <= (ncol >= 0 ? 1 : 0) && PQresultStatus(r) == PGRES_TUPLES_OK)
+		fprintf(stderr, "no metric columns (or type / value fields) in SQL query\n");
+}
+
+/* print out one result for q, and PQclear() it.  Queries run in
+   single-row mode, so a big result set comes back as one
+   PGRES_SINGLE_TUPLE per row, and then an empty PGRES_TUPLES_OK;
+   each row is printed as it arrives, and freed straight away.
+   Returns 0 if there is more to come for q, 1 once q is done. */
+static int report(query_t *q, PGresult *r, const char *tag)
+{
+	ExecStatusType status = PQresultStatus(r);
 	ts = time_s();
-	PGresult *r = PQexec(db, sql);
-	if (PQresultStatus(r) != PGRES_TUPLES_OK) {
-		fprintf(stderr, "`%s' failed\nerror: %s", sql, PQresultErrorMessage(r));
-		return;
+	if (status != PGRES_TUPLES_OK && status != PGRES_SINGLE_TUPLE) {
+		fprintf(stderr, "%s%s`%s' failed\nerror: %s", tag ? tag : "", tag ? ": " : "",
+			q->sql, PQresultErrorMessage(r));
+		PQclear(r);
+		return 1;
 	}
 
-	int tcol = column(r, "type");
-	int vcol = column(r, "value");
-	int ncol = column(r, "name");
-	if (tcol < 0 || vcol < 0 || ncol < 0)
-		return;
+	int tcol = PQfnumber(r, "type");
+	int vcol = PQfnumber(r, "value");
+	int ncol = PQfnumber(r, "name");
+	if (tcol < 0 || vcol < 0) {
+		wide(q, r, ncol, tag);
+		PQclear(r);
+		return status == PGRES_TUPLES_OK;
+	}
+	if (ncol < 0) {
+		if (status == PGRES_TUPLES_OK)
+			column(r, "name");
+		PQclear(r);
+		return status == PGRES_TUPLES_OK;
+	}
 
 	int i, count = PQntuples(r);
 	for (i = 0; i < count; i++) {
@@ -37,25 +183,586 @@ static void run_query(PGconn *db, const char *sql)
 
 		if (skip_empty(type,  "type"))  continue;
 		if (skip_empty(value, "value")) continue;
-		printf("%s %i %s:postgres:%s %s\n", type, ts, PREFIX,
+		printf("%s %i %s:postgres:%s%s%s %s\n", type, ts, PREFIX,
+			tag ? tag : "", tag ? ":" : "",
 			(name && *name) ? name : "unnamed", value);
 	}
 	PQclear(r);
+	return status == PGRES_TUPLES_OK;
 }
 
 #define BUF_SIZE 16384
-void run_queries(PGconn *db, FILE *io)
+void read_queries(FILE *io)
 {
 	char *buf = vmalloc(BUF_SIZE);
+	const char *type = NULL;
 	while (fgets(buf, BUF_SIZE, io) != NULL) {
 		char *sql = buf;
 		while (isspace(*sql)) sql++;
 
+		/* -- @type RATE|SAMPLE, for the wide columns of the next query */
+		if (strncmp(sql, "-- @type", 8) == 0 && isspace(sql[8])) {
+			char *t = sql + 8;
+			while (isspace(*t)) t++;
+			if (strncasecmp(t, "RATE", 4) == 0)
+				type = "RATE";
+			else if (strncasecmp(t, "SAMPLE", 6) == 0)
+				type = "SAMPLE";
+			else
+				fprintf(stderr, "unrecognized type in `%s'", sql);
+			continue;
+		}
+
 		if (!*sql || *sql == '-' || *sql == '#' || *sql == ';')
 			continue; /* blank line or comment */
 
-		run_query(db, sql);
+		OPTIONS.queries = realloc(OPTIONS.queries, (OPTIONS.nqueries + 1) * sizeof(query_t));
+		query_t *q = &OPTIONS.queries[OPTIONS.nqueries];
+		memset(q, 0, sizeof(query_t));
+		q->sql  = strdup(sql);
+		q->type = type;
+		type = NULL;
+
+		/* trailing whitespace, but not the ';' */
+		char *e = q->sql + strlen(q->sql);
+		while (e > q->sql && isspace(e[-1])) *--e = '\0';
+		snprintf(q->name, sizeof(q->name), "bolo_q%i", OPTIONS.nqueries);
+		OPTIONS.nqueries++;
+	}
+	free(buf);
+}
+
+/* all the queries from the given one on, as a single multi-statement
+   string (or EXECUTEs of their prepared statements); NULL if there is
+   nothing left to run */
+static char* s_batch(int from, int prepared)
+{
+	int i, n = 0;
+	size_t len = 1;
+	for (i = from; i < OPTIONS.nqueries; i++)
+		len += strlen(OPTIONS.queries[i].sql) + 32;
+
+	char *batch = vmalloc(len), *p = batch;
+	for (i = from; i < OPTIONS.nqueries; i++) {
+		query_t *q = &OPTIONS.queries[i];
+		if (q->broken)
+			continue;
+		if (prepared)
+			p += sprintf(p, "EXECUTE %s;\n", q->name);
+		else
+			p += sprintf(p, "%s%s\n", q->sql, q->sql[strlen(q->sql) - 1] == ';' ? "" : ";");
+		n++;
+	}
+
+	if (n == 0) {
+		free(batch);
+		return NULL;
+	}
+	return batch;
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+/* Send every query down one pipeline, and then read the results back
+   in the same order.  Each query gets its own sync point, so when one
+   fails (or hits statement_timeout) the server only aborts that one,
+   and the rest of the pipeline carries on. */
+void run_queries(PGconn *db)
+{
+	int i, sent;
+
+	if (!PQenterPipelineMode(db)) {
+		fprintf(stderr, "unable to enter pipeline mode: %s", PQerrorMessage(db));
+		return;
+	}
+
+	for (i = 0; i < OPTIONS.nqueries; i++) {
+		query_t *q = &OPTIONS.queries[i];
+		if (q->broken)
+			continue;
+
+		sent = OPTIONS.interval
+		     ? PQsendQueryPrepared(db, q->name, 0, NULL, NULL, NULL, 0)
+		     : PQsendQueryParams(db, q->sql, 0, NULL, NULL, NULL, NULL, 0);
+		if (!sent || !PQpipelineSync(db)) {
+			fprintf(stderr, "`%s' failed\nerror: %s", q->sql, PQerrorMessage(db));
+			break;
+		}
+	}
+	int n = i;
+
+	for (i = 0; i < n && PQstatus(db) == CONNECTION_OK; i++) {
+		query_t *q = &OPTIONS.queries[i];
+		if (q->broken)
+			continue;
+
+		PGresult *r;
+		PQsetSingleRowMode(db);
+		while ((r = PQgetResult(db)) != NULL)
+			report(q, r, NULL);
+
+		/* ... and then the PGRES_PIPELINE_SYNC for it */
+		PQclear(PQgetResult(db));
+	}
+
+	PQexitPipelineMode(db);
+	fflush(stdout);
+}
+#else
+/* No pipelining in this libpq, so send the queries as one big
+   multi-statement string and read the results as they come back.
+   The server stops at the first failure, so we report that one and
+   go again with whatever was after it. */
+void run_queries(PGconn *db)
+{
+	int i, from = 0;
+
+	while (from < OPTIONS.nqueries && PQstatus(db) == CONNECTION_OK) {
+		char *batch = s_batch(from, OPTIONS.interval);
+		if (!batch)
+			break;
+		if (!PQsendQuery(db, batch)) {
+			fprintf(stderr, "unable to send queries: %s", PQerrorMessage(db));
+			free(batch);
+			break;
+		}
+		free(batch);
+		PQsetSingleRowMode(db);
+
+		/* rows for each statement, in order, until one fails */
+		PGresult *r;
+		int failed = -1;
+		i = from;
+		while ((r = PQgetResult(db)) != NULL) {
+			while (i < OPTIONS.nqueries && OPTIONS.queries[i].broken)
+				i++;
+			if (i >= OPTIONS.nqueries) {
+				PQclear(r);
+				continue;
+			}
+			ExecStatusType status = PQresultStatus(r);
+			if (status != PGRES_TUPLES_OK && status != PGRES_SINGLE_TUPLE && failed < 0)
+				failed = i;
+			i += report(&OPTIONS.queries[i], r, NULL);
+		}
+
+		if (failed < 0)
+			break;
+		from = failed + 1;
+	}
+	fflush(stdout);
+}
+#endif
+
+/* Prepare every query on a fresh connection, so that each interval
+   only has to bind and execute.  A query that doesn't prepare (bad
+   SQL, missing relation, etc.) is reported once, and then skipped. */
+static int prepare_queries(PGconn *db)
+{
+	int i;
+	for (i = 0; i < OPTIONS.nqueries; i++) {
+		query_t *q = &OPTIONS.queries[i];
+		PGresult *r = PQprepare(db, q->name, q->sql, 0, NULL);
+		q->broken = PQresultStatus(r) != PGRES_COMMAND_OK;
+		if (q->broken)
+			fprintf(stderr, "`%s' failed to prepare\nerror: %s", q->sql, PQresultErrorMessage(r));
+		PQclear(r);
+
+		if (PQstatus(db) != CONNECTION_OK)
+			return 1;
+	}
+	return 0;
+}
+
+/* pg_stat_statements mode (--statements N): each interval we pull the
+   cumulative counters for every queryid, diff them against the last
+   interval's, and only report the N queries that did the most work in
+   between.  Everything else is summed into statements:other, so the
+   totals still add up, without a series per queryid. */
+typedef struct {
+	int64_t  id;     /* queryid; 0 marks an empty slot */
+	uint64_t calls;
+	uint64_t rows;
+	double   time;   /* total execution time, in ms */
+} stmt_t;
+
+/* open-addressed, linear-probing, keyed on queryid */
+typedef struct {
+	stmt_t  *slots;
+	size_t   size;   /* always a power of two */
+	size_t   used;
+} stmts_t;
+
+static struct {
+	stmts_t  prev, cur;
+	int      primed;  /* prev holds a full snapshot */
+	stmt_t  *heap;    /* the OPTIONS.statements biggest deltas */
+	int      n;
+} STATEMENTS;
+
+static stmt_t* s_stmt_slot(stmts_t *h, int64_t id)
+{
+	/* queryids are already hashes; just spread the bits a bit */
+	size_t i = ((uint64_t)id * 0x9e3779b97f4a7c15ULL) >> 32;
+	for (i &= h->size - 1; h->slots[i].id && h->slots[i].id != id; i = (i + 1) & (h->size - 1))
+		;
+	return &h->slots[i];
+}
+
+static void s_stmt_put(stmts_t *h, const stmt_t *st)
+{
+	if ((h->used + 1) * 2 > h->size) {
+		stmts_t old = *h;
+		h->size = old.size ? old.size * 2 : 1024;
+		h->slots = calloc(h->size, sizeof(stmt_t));
+		h->used = 0;
+
+		size_t i;
+		for (i = 0; i < old.size; i++)
+			if (old.slots[i].id)
+				s_stmt_put(h, &old.slots[i]);
+		free(old.slots);
+	}
+
+	stmt_t *slot = s_stmt_slot(h, st->id);
+	if (!slot->id)
+		h->used++;
+	*slot = *st;
+}
+
+static double s_stmt_key(const stmt_t *d)
+{
+	switch (OPTIONS.by) {
+	case BY_CALLS: return d->calls;
+	case BY_ROWS:  return d->rows;
+	default:       return d->time;
+	}
+}
+
+static void s_stmt_add(stmt_t *to, const stmt_t *d)
+{
+	to->calls += d->calls;
+	to->rows  += d->rows;
+	to->time  += d->time;
+}
+
+/* keep the top N deltas in a min-heap; whatever falls out of it (or
+   never makes it in) goes to other */
+static void s_stmt_rank(const stmt_t *d, stmt_t *other)
+{
+	stmt_t *heap = STATEMENTS.heap;
+	int i, n = STATEMENTS.n;
+
+	if (n < OPTIONS.statements) {
+		for (i = STATEMENTS.n++; i > 0 && s_stmt_key(&heap[(i - 1) / 2]) > s_stmt_key(d); i = (i - 1) / 2)
+			heap[i] = heap[(i - 1) / 2];
+		heap[i] = *d;
+		return;
+	}
+
+	if (s_stmt_key(d) <= s_stmt_key(&heap[0])) {
+		s_stmt_add(other, d);
+		return;
+	}
+
+	s_stmt_add(other, &heap[0]);
+	for (i = 0;;) {
+		int c = 2 * i + 1;
+		if (c >= n)
+			break;
+		if (c + 1 < n && s_stmt_key(&heap[c + 1]) < s_stmt_key(&heap[c]))
+			c++;
+		if (s_stmt_key(&heap[c]) >= s_stmt_key(d))
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = *d;
+}
+
+static void s_stmt_print(const char *name, const stmt_t *d)
+{
+	printf("SAMPLE %i %s:postgres:statements:%s:calls %lu\n",   ts, PREFIX, name, d->calls);
+	printf("SAMPLE %i %s:postgres:statements:%s:rows %lu\n",    ts, PREFIX, name, d->rows);
+	printf("SAMPLE %i %s:postgres:statements:%s:time_ms %.3f\n", ts, PREFIX, name, d->time);
+}
+
+static void run_statements(PGconn *db)
+{
+	char sql[256];
+	snprintf(sql, sizeof(sql),
+		"SELECT queryid, SUM(calls), SUM(%s), SUM(rows) FROM pg_stat_statements"
+		" WHERE queryid <> 0 GROUP BY queryid",
+		PQserverVersion(db) >= 130000 ? "total_exec_time" : "total_time");
+
+	if (!STATEMENTS.heap)
+		STATEMENTS.heap = calloc(OPTIONS.statements, sizeof(stmt_t));
+	STATEMENTS.n = 0;
+
+	if (!PQsendQueryParams(db, sql, 0, NULL, NULL, NULL, NULL, 0)) {
+		fprintf(stderr, "`%s' failed\nerror: %s", sql, PQerrorMessage(db));
+		return;
+	}
+	PQsetSingleRowMode(db);
+
+	stmt_t other = { 0 };
+	int ok = 0;
+	PGresult *r;
+	while ((r = PQgetResult(db)) != NULL) {
+		ExecStatusType status = PQresultStatus(r);
+		if (status == PGRES_TUPLES_OK) {
+			ok = 1;
+
+		} else if (status != PGRES_SINGLE_TUPLE) {
+			fprintf(stderr, "`%s' failed\nerror: %s", sql, PQresultErrorMessage(r));
+
+		} else if (PQnfields(r) == 4) {
+			stmt_t now = {
+				.id    = strtoll(PQgetvalue(r, 0, 0), NULL, 10),
+				.calls = strtoull(PQgetvalue(r, 0, 1), NULL, 10),
+				.time  = strtod(PQgetvalue(r, 0, 2), NULL),
+				.rows  = strtoull(PQgetvalue(r, 0, 3), NULL, 10),
+			};
+			s_stmt_put(&STATEMENTS.cur, &now);
+
+			/* anything we haven't seen before (or that was reset
+			   since) ran entirely within this interval */
+			stmt_t d = now, *last = STATEMENTS.prev.size ? s_stmt_slot(&STATEMENTS.prev, now.id) : NULL;
+			if (last && last->id && now.calls >= last->calls) {
+				d.calls -= last->calls;
+				d.rows   = now.rows > last->rows ? now.rows - last->rows : 0;
+				d.time   = now.time > last->time ? now.time - last->time : 0;
+			}
+			if (STATEMENTS.primed && (d.calls || d.rows || d.time > 0))
+				s_stmt_rank(&d, &other);
+		}
+		PQclear(r);
+	}
+
+	if (ok) {
+		ts = time_s();
+		if (STATEMENTS.primed) {
+			char name[32];
+			int i;
+			for (i = 0; i < STATEMENTS.n; i++) {
+				snprintf(name, sizeof(name), "%li", STATEMENTS.heap[i].id);
+				s_stmt_print(name, &STATEMENTS.heap[i]);
+			}
+			s_stmt_print("other", &other);
+		}
+		printf("SAMPLE %i %s:postgres:statements:tracked %lu\n", ts, PREFIX, STATEMENTS.cur.used);
+		fflush(stdout);
+
+		stmts_t swap = STATEMENTS.prev;
+		STATEMENTS.prev = STATEMENTS.cur;
+		STATEMENTS.cur  = swap;
+		STATEMENTS.primed = 1;
 	}
+
+	/* this interval's snapshot is built up from scratch */
+	if (STATEMENTS.cur.size)
+		memset(STATEMENTS.cur.slots, 0, STATEMENTS.cur.size * sizeof(stmt_t));
+	STATEMENTS.cur.used = 0;
+}
+
+static PGconn* s_connect(const char *dsn)
+{
+	PGconn *db = PQconnectdb(dsn);
+	if (!db)
+		return NULL;
+
+	if (PQstatus(db) != CONNECTION_OK) {
+		fprintf(stderr, "connection failed: %s", PQerrorMessage(db));
+		PQfinish(db);
+		return NULL;
+	}
+
+	if (OPTIONS.interval && prepare_queries(db) != 0) {
+		fprintf(stderr, "connection lost: %s", PQerrorMessage(db));
+		PQfinish(db);
+		return NULL;
+	}
+	return db;
+}
+
+/* Targets mode: every target gets the whole batch of queries as one
+   multi-statement string, over its own non-blocking connection, and we
+   drive at most --concurrency of them at once from a single poll()
+   loop.  Each target has its own --deadline; one that blows through
+   it is dropped without holding up the others. */
+static void s_target_fail(target_t *t, const char *why)
+{
+	fprintf(stderr, "%s: %s%s", t->tag, why, strchr(why, '\n') ? "" : "\n");
+	t->state = T_FAILED;
+	if (t->db)
+		PQfinish(t->db);
+	t->db = NULL;
+}
+
+static void s_target_send(target_t *t)
+{
+	char *batch = s_batch(t->from, 0);
+	if (!batch) {
+		t->state = T_DONE;
+		return;
+	}
+
+	int ok = PQsendQuery(t->db, batch);
+	free(batch);
+	if (!ok) {
+		s_target_fail(t, PQerrorMessage(t->db));
+		return;
+	}
+	PQsetSingleRowMode(t->db);
+
+	t->current = t->from;
+	t->failed  = -1;
+	t->state   = T_SENDING;
+}
+
+static void s_target_io(target_t *t)
+{
+	switch (t->state) {
+	case T_CONNECTING:
+		switch (PQconnectPoll(t->db)) {
+		case PGRES_POLLING_READING: t->events = POLLIN;  return;
+		case PGRES_POLLING_WRITING: t->events = POLLOUT; return;
+		case PGRES_POLLING_OK:
+			PQsetnonblocking(t->db, 1);
+			t->from = 0;
+			s_target_send(t);
+			return;
+		default:
+			s_target_fail(t, PQerrorMessage(t->db));
+			return;
+		}
+
+	case T_SENDING:
+		switch (PQflush(t->db)) {
+		case 0:  t->state = T_READING; break;
+		case 1:  return;
+		default: s_target_fail(t, PQerrorMessage(t->db)); return;
+		}
+		/* fall through */
+
+	case T_READING:
+		if (!PQconsumeInput(t->db)) {
+			s_target_fail(t, PQerrorMessage(t->db));
+			return;
+		}
+		while (!PQisBusy(t->db)) {
+			PGresult *r = PQgetResult(t->db);
+			if (!r) {
+				/* the server stops at the first failure;
+				   pick up again after it */
+				if (t->failed >= 0) {
+					t->from = t->failed + 1;
+					s_target_send(t);
+				} else {
+					t->state = T_DONE;
+				}
+				return;
+			}
+
+			if (t->current >= OPTIONS.nqueries) {
+				PQclear(r);
+				continue;
+			}
+			ExecStatusType status = PQresultStatus(r);
+			if (status != PGRES_TUPLES_OK && status != PGRES_SINGLE_TUPLE && t->failed < 0)
+				t->failed = t->current;
+			t->current += report(&OPTIONS.queries[t->current], r, t->tag);
+		}
+		return;
+	}
+}
+
+static void s_target_start(target_t *t)
+{
+	t->deadline = time_ms() + OPTIONS.deadline * 1000;
+
+	if (t->db && PQstatus(t->db) == CONNECTION_OK) {
+		/* still connected from the last interval */
+		t->from = 0;
+		s_target_send(t);
+		return;
+	}
+
+	if (t->db)
+		PQfinish(t->db);
+	t->db = PQconnectStart(t->dsn);
+	if (!t->db || PQstatus(t->db) == CONNECTION_BAD) {
+		s_target_fail(t, t->db ? PQerrorMessage(t->db) : "out of memory");
+		return;
+	}
+	t->state  = T_CONNECTING;
+	t->events = POLLOUT;
+}
+
+static int run_targets(void)
+{
+	struct pollfd *pfd = calloc(OPTIONS.ntargets, sizeof(struct pollfd));
+	int i, next = 0, active = 0, failed = 0;
+
+	for (i = 0; i < OPTIONS.ntargets; i++)
+		OPTIONS.targets[i].state = T_IDLE;
+
+	while (next < OPTIONS.ntargets || active > 0) {
+		while (active < OPTIONS.concurrency && next < OPTIONS.ntargets) {
+			target_t *t = &OPTIONS.targets[next++];
+			s_target_start(t);
+			if (t->state == T_FAILED)
+				failed++;
+			else if (t->state != T_DONE)
+				active++;
+		}
+
+		int64_t now = time_ms(), wait = -1;
+		for (i = 0; i < next; i++) {
+			target_t *t = &OPTIONS.targets[i];
+			pfd[i].fd = -1;
+			pfd[i].revents = 0;
+			if (t->state == T_DONE || t->state == T_FAILED || t->state == T_IDLE)
+				continue;
+
+			pfd[i].fd = PQsocket(t->db);
+			pfd[i].events = t->state == T_CONNECTING ? t->events
+			              : t->state == T_SENDING    ? POLLIN | POLLOUT
+			              :                            POLLIN;
+			if (wait < 0 || t->deadline - now < wait)
+				wait = MAX(t->deadline - now, 0);
+		}
+
+		if (poll(pfd, next, wait) < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+
+		now = time_ms();
+		for (i = 0; i < next; i++) {
+			target_t *t = &OPTIONS.targets[i];
+			if (pfd[i].fd < 0)
+				continue;
+
+			if (pfd[i].revents)
+				s_target_io(t);
+			if (t->state != T_DONE && t->state != T_FAILED && now >= t->deadline)
+				s_target_fail(t, "timed out");
+
+			if (t->state == T_DONE || t->state == T_FAILED) {
+				if (t->state == T_FAILED)
+					failed++;
+				else if (!OPTIONS.interval) {
+					PQfinish(t->db);
+					t->db = NULL;
+				}
+				active--;
+			}
+		}
+		fflush(stdout);
+	}
+
+	free(pfd);
+	return failed;
 }
 
 int read_creds(const char *file, char **user, char **pass)
@@ -88,14 +795,91 @@ int read_creds(const char *file, char **user, char **pass)
 	return 0;
 }
 
+static char* s_dsn(const char *host, const char *port, const char *database,
+                   const char *user, const char *pass)
+{
+	/* statement_timeout applies to each statement on its own,
+	   so one wedged query can't eat the whole interval */
+	char *opts = OPTIONS.timeout ? string(" options='-c statement_timeout=%i'", OPTIONS.timeout)
+	                             : strdup("");
+	char *dsn;
+	if (user && pass)
+		dsn = string("host=%s port=%s dbname=%s user=%s password=%s%s",
+			host, port, database, user, pass, opts);
+	else
+		dsn = string("host=%s port=%s dbname=%s%s",
+			host, port, database, opts);
+	free(opts);
+	return dsn;
+}
+
+/* one target per line:  TAG  HOST[:PORT]  DATABASE  [CREDENTIALS-FILE]
+   targets without a credentials file use the --credentials ones */
+static int read_targets(const char *file, const char *user, const char *pass)
+{
+	FILE *io = fopen(file, "r");
+	if (!io) {
+		perror(file);
+		return 1;
+	}
+
+	char buf[1024];
+	int n = 0, errors = 0;
+	while (fgets(buf, sizeof(buf), io) != NULL) {
+		n++;
+		char *f[5], *p = buf;
+		int nf = 0;
+		while (nf < 5) {
+			while (isspace(*p)) p++;
+			if (!*p || *p == '#')
+				break;
+			f[nf++] = p;
+			while (*p && !isspace(*p)) p++;
+			if (*p) *p++ = '\0';
+		}
+		if (nf == 0)
+			continue;
+		if (nf < 3 || nf > 4) {
+			fprintf(stderr, "%s:%i: expected TAG HOST[:PORT] DATABASE [CREDENTIALS-FILE]\n", file, n);
+			errors++;
+			continue;
+		}
+
+		const char *port = "5432";
+		char *colon = strchr(f[1], ':');
+		if (colon && !strchr(colon + 1, ':')) {
+			*colon = '\0';
+			port = colon + 1;
+		}
+
+		char *tuser = NULL, *tpass = NULL;
+		if (nf == 4 && read_creds(f[3], &tuser, &tpass) != 0) {
+			errors++;
+			continue;
+		}
+
+		OPTIONS.targets = realloc(OPTIONS.targets, (OPTIONS.ntargets + 1) * sizeof(target_t));
+		target_t *t = &OPTIONS.targets[OPTIONS.ntargets++];
+		memset(t, 0, sizeof(target_t));
+		t->tag = strdup(f[0]);
+		t->dsn = s_dsn(f[1], port, f[2], tuser ? tuser : user, tpass ? tpass : pass);
+		free(tuser);
+		free(tpass);
+	}
+
+	fclose(io);
+	return errors;
+}
+
 int main(int argc, char **argv)
 {
 	char *creds    = NULL;
+	char *targets  = NULL;
 	char *database = strdup("postgres");
 	char *host     = strdup("localhost");
 	char *port     = strdup("5432");
 
-	const char *short_opts = "h?p:c:d:H:P:";
+	const char *short_opts = "h?p:c:d:H:P:i:t:T:C:D:S:b:";
 	struct option long_opts[] = {
 		{ "help",              no_argument, 0, 'h' },
 		{ "prefix",      required_argument, 0, 'p' },
@@ -104,6 +888,13 @@ int main(int argc, char **argv)
 		{ "database",    required_argument, 0, 'd' },
 		{ "host",        required_argument, 0, 'H' },
 		{ "port",        required_argument, 0, 'P' },
+		{ "interval",    required_argument, 0, 'i' },
+		{ "timeout",     required_argument, 0, 't' },
+		{ "targets",     required_argument, 0, 'T' },
+		{ "concurrency", required_argument, 0, 'C' },
+		{ "deadline",    required_argument, 0, 'D' },
+		{ "statements",  required_argument, 0, 'S' },
+		{ "by",          required_argument, 0, 'b' },
 		{ 0, 0, 0, 0 },
 	};
 	int opt, idx;
@@ -113,6 +904,7 @@ int main(int argc, char **argv)
 		case '?':
 			fprintf(stdout, "postgres (a Bolo collector)\n"
 			                "USAGE: postgres [options] /path/to/queries.sql\n"
+			                "       postgres [options] -i SECONDS -S N [/path/to/queries.sql]\n"
 			                "\n"
 			                "options:\n"
 			                "   -h, --help               Show this help screen\n"
@@ -125,6 +917,29 @@ int main(int argc, char **argv)
 			                "                            (Defaults to localhost)\n"
 			                "   -P, --port NUMBER        TCP port to connect to\n"
 			                "                            (Defaults to 5432)\n"
+			                "   -i, --interval SECONDS   Keep running, collecting every SECONDS\n"
+			                "                            over one connection, with each query\n"
+			                "                            prepared up front\n"
+			                "   -t, --timeout MS         Cancel any query that runs longer than\n"
+			                "                            MS milliseconds (default 5000 with\n"
+			                "                            --interval or --targets; otherwise 0,\n"
+			                "                            which means never)\n"
+			                "\n"
+			                "   -T, --targets FILE       Collect from every database listed in FILE,\n"
+			                "                            one 'TAG HOST[:PORT] DATABASE [CREDS-FILE]'\n"
+			                "                            per line, instead of --host / --database.\n"
+			                "                            Metrics are named postgres:TAG:name.\n"
+			                "   -C, --concurrency N      Talk to at most N targets at once (default 8)\n"
+			                "   -D, --deadline SECONDS   Give up on a target that hasn't finished\n"
+			                "                            within SECONDS (default 30)\n"
+			                "\n"
+			                "   -S, --statements N       With --interval, also report the N queries\n"
+			                "                            from pg_stat_statements that did the most\n"
+			                "                            work since the last interval, and the sum\n"
+			                "                            of all the rest, as statements:QUERYID:*\n"
+			                "                            and statements:other:*\n"
+			                "   -b, --by WHAT            Rank statements by 'time' (the default),\n"
+			                "                            'calls' or 'rows'\n"
 			                "\n");
 			exit(0);
 
@@ -152,10 +967,64 @@ int main(int argc, char **argv)
 			free(database);
 			database = strdup(optarg);
 			break;
+
+		case 'i':
+			OPTIONS.interval = atoi(optarg);
+			if (OPTIONS.interval < 0) OPTIONS.interval = 0;
+			break;
+
+		case 't':
+			OPTIONS.timeout = atoi(optarg);
+			if (OPTIONS.timeout < 0) OPTIONS.timeout = 0;
+			break;
+
+		case 'T':
+			free(targets);
+			targets = strdup(optarg);
+			break;
+
+		case 'C':
+			OPTIONS.concurrency = atoi(optarg);
+			if (OPTIONS.concurrency < 1) OPTIONS.concurrency = 1;
+			break;
+
+		case 'D':
+			OPTIONS.deadline = atoi(optarg);
+			if (OPTIONS.deadline < 1) OPTIONS.deadline = 1;
+			break;
+
+		case 'S':
+			OPTIONS.statements = atoi(optarg);
+			if (OPTIONS.statements < 0) OPTIONS.statements = 0;
+			break;
+
+		case 'b':
+			if (streq(optarg, "time"))
+				OPTIONS.by = BY_TIME;
+			else if (streq(optarg, "calls"))
+				OPTIONS.by = BY_CALLS;
+			else if (streq(optarg, "rows"))
+				OPTIONS.by = BY_ROWS;
+			else {
+				fprintf(stderr, "Invalid --by value '%s' (must be one of time, calls or rows)\n", optarg);
+				return 1;
+			}
+			break;
 		}
 	}
 
-	if (!argv[optind]) {
+	if (OPTIONS.statements && (!OPTIONS.interval || targets)) {
+		fprintf(stderr, "--statements needs --interval (to have something to diff against),\n"
+		                "and doesn't work with --targets\n");
+		return 1;
+	}
+
+	/* a single run waits as long as its queries take, like it
+	   always has; only the long-running modes get a default */
+	if (OPTIONS.timeout < 0)
+		OPTIONS.timeout = (OPTIONS.interval || targets) ? 5000 : 0;
+
+	if (!argv[optind] && !OPTIONS.statements) {
 		fprintf(stderr, "USAGE: %s [options] /path/to/queries.sql\n", argv[0]);
 		return 1;
 	}
@@ -167,29 +1036,74 @@ int main(int argc, char **argv)
 	if (creds && read_creds(creds, &user, &pass) != 0)
 		exit(1);
 
-	char *dsn;
-	if (user && pass)
-		dsn = string("host=%s port=%s dbname=%s user=%s password=%s",
-			host, port, database, user, pass);
-	else
-		dsn = string("host=%s port=%s dbname=%s",
-			host, port, database);
+	char *dsn = s_dsn(host, port, database, user, pass);
+	if (targets && read_targets(targets, user, pass) != 0)
+		exit(1);
 
-	PGconn *db = PQconnectdb(dsn);
-	assert(db);
-	if (PQstatus(db) != CONNECTION_OK) {
+	if (argv[optind]) {
+		FILE *io = stdin;
+		if (!streq(argv[optind], "-")) {
+			io = fopen(argv[optind], "r");
+			if (!io) {
+				perror(argv[optind]);
+				return 1;
+			}
+		}
+		read_queries(io);
+		fclose(io);
+	}
+
+	if (targets) {
+		if (!OPTIONS.interval)
+			return run_targets() ? 2 : 0;
+
+		for (;;) {
+			int64_t started = time_ms();
+			run_targets();
+
+			int64_t left = started + OPTIONS.interval * 1000 - time_ms();
+			if (left > 0)
+				usleep(left * 1000);
+		}
+	}
+
+	if (!OPTIONS.interval) {
+		PGconn *db = s_connect(dsn);
+		if (!db)
+			return 1;
+		run_queries(db);
 		PQfinish(db);
-		fprintf(stderr, "connection failed\n");
-		return 1;
+		return 0;
 	}
 
-	FILE *io = stdin;
-	if (!streq(argv[optind], "-")) {
-		io = fopen(argv[optind], "r");
-		if (!io) perror(argv[optind]);
+	/* daemon mode: hang onto the connection, and when we lose it,
+	   wait twice as long (up to 5m) each time it won't come back */
+	PGconn *db = NULL;
+	int failures = 0;
+	for (;;) {
+		int64_t started = time_ms();
+		int64_t wait = OPTIONS.interval * 1000;
+
+		if (!db && (db = s_connect(dsn)) == NULL) {
+			failures++;
+			wait = MIN(wait << MIN(failures, 16), 300 * 1000);
+			wait = MAX(wait, OPTIONS.interval * 1000);
+
+		} else {
+			failures = 0;
+			if (OPTIONS.nqueries)
+				run_queries(db);
+			if (OPTIONS.statements && PQstatus(db) == CONNECTION_OK)
+				run_statements(db);
+			if (PQstatus(db) != CONNECTION_OK) {
+				fprintf(stderr, "connection lost: %s", PQerrorMessage(db));
+				PQfinish(db);
+				db = NULL;
+			}
+		}
+
+		int64_t left = started + wait - time_ms();
+		if (left > 0)
+			usleep(left * 1000);
 	}
-	run_queries(db, io);
-	fclose(io);
-	PQfinish(db);
-	return 0;
 }
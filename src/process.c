@@ -0,0 +1,561 @@
+#include "common.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pcre.h>
+#include <stdarg.h>
+
+#define PROC "/proc"
+
+static struct {
+	char *name;
+	char *match;
+	int   children;
+	int   rollup;
+	int   debug;
+} OPTIONS = { 0 };
+
+#define DEBUG(...) do { if (OPTIONS.debug) fprintf(stderr, __VA_ARGS__); } while (0)
+
+/* what gets reported, under the names the perl collector used.
+   the io_*, *time and iowait metrics are counters (RATE). */
+enum {
+	M_PROCESSES, M_OPENFILES,
+	M_VMPEAK, M_VMSIZE, M_VMRSS, M_VMHWM, M_THREADS,
+	M_IO_READS, M_IO_WRITES, M_IO_ALL_RD, M_IO_ALL_WR, M_IO_DISK_RD, M_IO_DISK_WR,
+	M_MEM_HEAP, M_MEM_ANON, M_MEM_STACK, M_MEM_LIBS, M_MEM_MMAP,
+	M_SWP_HEAP, M_SWP_ANON, M_SWP_STACK, M_SWP_LIBS, M_SWP_MMAP,
+	M_UTIME, M_STIME, M_GUEST_TIME, M_IOWAIT,
+	M_MEM_TOTAL, M_MEM_PSS, M_SWP_TOTAL,
+	NMETRICS
+};
+static struct {
+	const char *name;
+	int         rate;
+} METRICS[NMETRICS] = {
+	{ "processes",  0 }, { "openfiles",  0 },
+	{ "vmpeak",     0 }, { "vmsize",     0 }, { "vmrss",      0 }, { "vmhwm",      0 }, { "threads",    0 },
+	{ "io_reads",   1 }, { "io_writes",  1 }, { "io_all_rd",  1 }, { "io_all_wr",  1 }, { "io_disk_rd", 1 }, { "io_disk_wr", 1 },
+	{ "mem_heap",   0 }, { "mem_anon",   0 }, { "mem_stack",  0 }, { "mem_libs",   0 }, { "mem_mmap",   0 },
+	{ "swp_heap",   0 }, { "swp_anon",   0 }, { "swp_stack",  0 }, { "swp_libs",   0 }, { "swp_mmap",   0 },
+	{ "utime",      1 }, { "stime",      1 }, { "guest_time", 1 }, { "iowait",     1 },
+	{ "mem_total",  0 }, { "mem_pss",    0 }, { "swp_total",  0 },
+};
+
+typedef struct {
+	double   value[NMETRICS];
+	uint64_t set;
+} stats_t;
+
+#define SET(s,m,v) do { (s)->value[(m)] = (v); (s)->set |= (1ULL << (m)); } while (0)
+
+/* smaps mappings are bucketed the same way the perl collector did it */
+enum { CAT_HEAP, CAT_ANON, CAT_STACK, CAT_LIBS, CAT_MMAP, CAT_OTHER, NCATS };
+enum { F_PRIVATE, F_SHARED, F_SWAP, F_PSS, NFIELDS };
+
+typedef struct {
+	pid_t *pids;
+	int    n, cap;
+} pids_t;
+
+static char buf[8192];
+static char SMAPS[65536];
+
+static void s_push(pids_t *l, pid_t pid)
+{
+	if (l->n == l->cap) {
+		l->cap = l->cap ? l->cap * 2 : 64;
+		l->pids = realloc(l->pids, l->cap * sizeof(pid_t));
+		if (!l->pids) {
+			fprintf(stderr, "unable to allocate memory: %s (errno %d)\n", strerror(errno), errno);
+			exit(1);
+		}
+	}
+	l->pids[l->n++] = pid;
+}
+
+/* read all of a (small) /proc file into b, with as few syscalls
+   as we can get away with; returns the length, or -1 */
+static ssize_t s_slurp(const char *path, char *b, size_t size)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	ssize_t n = 0, len = 0;
+	while ((size_t)len < size - 1 && (n = pread(fd, b + len, size - 1 - len, len)) > 0)
+		len += n;
+	close(fd);
+
+	b[len] = '\0';
+	return n < 0 ? -1 : len;
+}
+
+/* the fields of /proc/PID/stat that come after "(comm)", with
+   f[0] being field 3 (state); returns how many were found */
+static int s_stat(pid_t pid, unsigned long long *f, int max, char *comm, size_t clen)
+{
+	char path[64];
+	snprintf(path, sizeof(path), PROC "/%i/stat", pid);
+	if (s_slurp(path, buf, sizeof(buf)) <= 0)
+		return 0;
+
+	/* comm can have spaces and parens in it; the last ')' is ours */
+	char *a = strchr(buf, '('), *b = strrchr(buf, ')');
+	if (!a || !b)
+		return 0;
+	if (comm) {
+		size_t len = MIN((size_t)(b - a - 1), clen - 1);
+		memcpy(comm, a + 1, len);
+		comm[len] = '\0';
+	}
+
+	int n;
+	for (n = 0, b++; n < max && *b; n++) {
+		while (*b == ' ') b++;
+		f[n] = isdigit(*b) ? strtoull(b, &b, 10) : 0;
+		while (*b && *b != ' ') b++;
+	}
+	return n;
+}
+
+/* direct children of pid, from /proc/PID/task/TID/children (one
+   per thread); -1 if the kernel was built without them */
+static int s_kids(pid_t pid, pids_t *kids)
+{
+	char path[64];
+	snprintf(path, sizeof(path), PROC "/%i/task", pid);
+	DIR *d = opendir(path);
+	if (!d)
+		return 0;
+
+	int found = 0;
+	struct dirent *dir;
+	while ((dir = readdir(d)) != NULL) {
+		if (!isdigit(dir->d_name[0]))
+			continue;
+
+		snprintf(path, sizeof(path), PROC "/%i/task/%i/children", pid, atoi(dir->d_name));
+		if (s_slurp(path, buf, sizeof(buf)) < 0) {
+			if (errno == ENOENT && !found) {
+				closedir(d);
+				return -1;
+			}
+			continue;
+		}
+		found = 1;
+
+		char *a = buf;
+		while (*a) {
+			pid_t kid = strtol(a, &a, 10);
+			if (kid > 0) s_push(kids, kid);
+			while (*a == ' ' || *a == '\n') a++;
+		}
+	}
+	closedir(d);
+	return 0;
+}
+
+/* for kernels without task/TID/children: one pass over every
+   /proc/PID/stat, remembering each parent, done at most once */
+static pids_t PIDS, PPIDS;
+static void s_scan(void)
+{
+	if (PIDS.n)
+		return;
+
+	struct dirent *dir;
+	DIR *d = opendir(PROC);
+	if (!d)
+		return;
+
+	unsigned long long f[2];
+	while ((dir = readdir(d)) != NULL) {
+		pid_t pid;
+		if (!isdigit(dir->d_name[0])
+		 || (pid = atoi(dir->d_name)) < 1)
+			continue;
+		if (s_stat(pid, f, 2, NULL, 0) < 2)
+			continue;
+		s_push(&PIDS,  pid);
+		s_push(&PPIDS, f[1]);
+	}
+	closedir(d);
+}
+
+static void s_children(pid_t pid, pids_t *kids)
+{
+	if (s_kids(pid, kids) == 0)
+		return;
+
+	int i;
+	s_scan();
+	for (i = 0; i < PIDS.n; i++)
+		if (PPIDS.pids[i] == pid)
+			s_push(kids, PIDS.pids[i]);
+}
+
+/* the full command line, NULs turned into spaces (like pgrep -f),
+   or the process name if it hasn't got one (kernel threads) */
+static const char* s_cmdline(pid_t pid)
+{
+	char path[64];
+	snprintf(path, sizeof(path), PROC "/%i/cmdline", pid);
+	ssize_t i, n = s_slurp(path, buf, sizeof(buf));
+	if (n > 0) {
+		while (n > 0 && buf[n - 1] == '\0') n--;
+		for (i = 0; i < n; i++)
+			if (buf[i] == '\0') buf[i] = ' ';
+		buf[n] = '\0';
+		return buf;
+	}
+
+	static char comm[64];
+	unsigned long long f[1];
+	return s_stat(pid, f, 1, comm, sizeof(comm)) ? comm : "";
+}
+
+static int s_category(const char *path)
+{
+	if (!*path)                           return CAT_ANON;
+	if (strstr(path, "/lib/")
+	 || strstr(path, ".so"))              return CAT_LIBS;
+	if (strncmp(path, "[stack", 6) == 0)  return CAT_STACK;
+	if (*path == '/')                     return CAT_MMAP;
+	if (streq(path, "[heap]"))            return CAT_HEAP;
+	return CAT_OTHER;
+}
+
+static int s_field(const char *name, size_t len)
+{
+	if (len == 3  && memcmp(name, "Pss",  3) == 0) return F_PSS;
+	if (len == 4  && memcmp(name, "Swap", 4) == 0) return F_SWAP;
+	if (len == 12 && (memcmp(name, "Shared_Clean",  12) == 0
+	               || memcmp(name, "Shared_Dirty",  12) == 0)) return F_SHARED;
+	if (len == 13 && (memcmp(name, "Private_Clean", 13) == 0
+	               || memcmp(name, "Private_Dirty", 13) == 0)) return F_PRIVATE;
+	return -1;
+}
+
+/* sum up a smaps (or smaps_rollup, which is the same format with
+   only one "mapping") by category, in bytes.  Read in big chunks,
+   and parsed in place -- there can be tens of thousands of these. */
+static int s_smaps(const char *path, unsigned long long sum[NCATS][NFIELDS])
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	int cat = CAT_OTHER;
+	off_t off = 0;
+	size_t have = 0;
+	ssize_t n;
+	while ((n = pread(fd, SMAPS + have, sizeof(SMAPS) - 1 - have, off)) > 0) {
+		off  += n;
+		have += n;
+		SMAPS[have] = '\0';
+
+		char *line = SMAPS, *nl;
+		while ((nl = strchr(line, '\n')) != NULL) {
+			*nl = '\0';
+			if (isdigit(*line) || (*line >= 'a' && *line <= 'f')) {
+				/* 00400000-0040b000 r-xp 00000000 08:01 1234    /path */
+				int i;
+				char *a = line;
+				for (i = 0; i < 5; i++) {
+					while (*a && *a != ' ') a++;
+					while (*a == ' ') a++;
+				}
+				cat = s_category(a);
+
+			} else {
+				/* Private_Dirty:        12 kB */
+				char *colon = strchr(line, ':');
+				int f = colon ? s_field(line, colon - line) : -1;
+				if (f >= 0)
+					sum[cat][f] += strtoull(colon + 1, NULL, 10) * 1024;
+			}
+			line = nl + 1;
+		}
+
+		/* keep the partial line for the next read */
+		have = SMAPS + have - line;
+		if (have == sizeof(SMAPS) - 1)
+			have = 0; /* not a line we care about */
+		memmove(SMAPS, line, have);
+	}
+	close(fd);
+	return 0;
+}
+
+static void s_memory(pid_t pid, int child, stats_t *s)
+{
+	char path[64];
+	unsigned long long sum[NCATS][NFIELDS] = {{ 0 }};
+	int c;
+
+	if (OPTIONS.rollup) {
+		/* the kernel does the adding up for us (4.14+) */
+		snprintf(path, sizeof(path), PROC "/%i/smaps_rollup", pid);
+		if (s_smaps(path, sum) != 0 && errno == ENOENT) {
+			snprintf(path, sizeof(path), PROC "/%i/smaps", pid);
+			s_smaps(path, sum);
+		}
+
+		unsigned long long mem = 0, pss = 0, swp = 0;
+		for (c = 0; c < NCATS; c++) {
+			mem += sum[c][F_PRIVATE] + (child ? 0 : sum[c][F_SHARED]);
+			pss += sum[c][F_PSS];
+			swp += sum[c][F_SWAP];
+		}
+		SET(s, M_MEM_TOTAL, mem);
+		SET(s, M_MEM_PSS,   pss);
+		SET(s, M_SWP_TOTAL, swp);
+		return;
+	}
+
+	snprintf(path, sizeof(path), PROC "/%i/smaps", pid);
+	s_smaps(path, sum);
+	for (c = CAT_HEAP; c <= CAT_MMAP; c++) {
+		SET(s, M_MEM_HEAP + c, sum[c][F_PRIVATE] + (child ? 0 : sum[c][F_SHARED]));
+		SET(s, M_SWP_HEAP + c, sum[c][F_SWAP]);
+	}
+}
+
+static void s_pidstats(pid_t pid, int child, stats_t *s)
+{
+	char path[64];
+	char *a, *b;
+
+	SET(s, M_PROCESSES, 1);
+
+	snprintf(path, sizeof(path), PROC "/%i/fd", pid);
+	DIR *d = opendir(path);
+	if (d) {
+		int n = 0;
+		struct dirent *dir;
+		while ((dir = readdir(d)) != NULL)
+			if (dir->d_name[0] != '.') n++;
+		closedir(d);
+		SET(s, M_OPENFILES, n);
+	}
+
+	snprintf(path, sizeof(path), PROC "/%i/status", pid);
+	if (s_slurp(path, buf, sizeof(buf)) > 0) {
+		for (a = buf; a && *a; a = (b = strchr(a, '\n')) ? b + 1 : NULL) {
+			     if (strncmp(a, "VmPeak:",  7) == 0) SET(s, M_VMPEAK,  strtoull(a + 7, NULL, 10) * 1024);
+			else if (strncmp(a, "VmSize:",  7) == 0) SET(s, M_VMSIZE,  strtoull(a + 7, NULL, 10) * 1024);
+			else if (strncmp(a, "VmRSS:",   6) == 0) SET(s, M_VMRSS,   strtoull(a + 6, NULL, 10) * 1024);
+			else if (strncmp(a, "VmHWM:",   6) == 0) SET(s, M_VMHWM,   strtoull(a + 6, NULL, 10) * 1024);
+			else if (strncmp(a, "Threads:", 8) == 0) SET(s, M_THREADS, strtoull(a + 8, NULL, 10));
+		}
+	}
+
+	/* only readable by root (or the owner) */
+	snprintf(path, sizeof(path), PROC "/%i/io", pid);
+	if (s_slurp(path, buf, sizeof(buf)) > 0) {
+		unsigned long long rchar = 0, wchar = 0, syscr = 0, syscw = 0,
+		                   rbytes = 0, wbytes = 0, cancelled = 0;
+		for (a = buf; a && *a; a = (b = strchr(a, '\n')) ? b + 1 : NULL) {
+			     if (strncmp(a, "rchar:",  6) == 0) rchar = strtoull(a + 6, NULL, 10);
+			else if (strncmp(a, "wchar:",  6) == 0) wchar = strtoull(a + 6, NULL, 10);
+			else if (strncmp(a, "syscr:",  6) == 0) syscr = strtoull(a + 6, NULL, 10);
+			else if (strncmp(a, "syscw:",  6) == 0) syscw = strtoull(a + 6, NULL, 10);
+			else if (strncmp(a, "read_bytes:",  11) == 0) rbytes = strtoull(a + 11, NULL, 10);
+			else if (strncmp(a, "write_bytes:", 12) == 0) wbytes = strtoull(a + 12, NULL, 10);
+			else if (strncmp(a, "cancelled_write_bytes:", 22) == 0) cancelled = strtoull(a + 22, NULL, 10);
+		}
+		SET(s, M_IO_READS,   syscr);
+		SET(s, M_IO_WRITES,  syscw);
+		SET(s, M_IO_ALL_RD,  rchar);
+		SET(s, M_IO_ALL_WR,  wchar);
+		SET(s, M_IO_DISK_RD, rbytes);
+		SET(s, M_IO_DISK_WR, (double)wbytes - (double)cancelled);
+	}
+
+	s_memory(pid, child, s);
+
+	/* fields 14 (utime), 15 (stime), 42 (iowait) and 43 (guest_time),
+	   in clock ticks.  These get scaled by CLOCKS_PER_SEC / 1000, not
+	   the tick rate; that's what the perl collector always reported,
+	   and the graphs are all built on it. */
+	unsigned long long f[41] = { 0 };
+	s_stat(pid, f, 41, NULL, 0);
+	SET(s, M_UTIME,      f[14 - 3] / (double)CLOCKS_PER_SEC * 1000);
+	SET(s, M_STIME,      f[15 - 3] / (double)CLOCKS_PER_SEC * 1000);
+	SET(s, M_GUEST_TIME, f[43 - 3] / (double)CLOCKS_PER_SEC * 1000);
+	SET(s, M_IOWAIT,     f[42 - 3] / (double)CLOCKS_PER_SEC * 1000);
+}
+
+static void s_state(const char *status, const char *fmt, ...)
+{
+	va_list ap;
+	printf("STATE %i %s:process:%s %s ", time_s(), PREFIX, OPTIONS.name, status);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+}
+
+int parse_options(int argc, char **argv);
+
+int main(int argc, char **argv)
+{
+	if (parse_options(argc, argv) != 0) {
+		fprintf(stderr, "USAGE: %s [options] -n NAME [-m PATTERN]\n", argv[0]);
+		exit(1);
+	}
+
+	const char *re_err;
+	int re_off;
+	pcre *re = pcre_compile(OPTIONS.match, 0, &re_err, &re_off, NULL);
+	if (!re) {
+		fprintf(stderr, "Bad regex '%s' (error %s) for --match flag\n", OPTIONS.match, re_err);
+		exit(1);
+	}
+	pcre_extra *extra = pcre_study(re, 0, &re_err);
+
+	/* candidates are (only) the children of init, just like pgrep -P 1 */
+	int i, found = 0;
+	pid_t self = getpid(), ppid = 0;
+	pids_t kids = { 0 };
+	s_children(1, &kids);
+	for (i = 0; i < kids.n; i++) {
+		if (kids.pids[i] == self)
+			continue;
+
+		const char *cmd = s_cmdline(kids.pids[i]);
+		if (pcre_exec(re, extra, cmd, strlen(cmd), 0, 0, NULL, 0) < 0)
+			continue;
+
+		DEBUG("pid %i (%s) matches `%s'\n", kids.pids[i], cmd, OPTIONS.match);
+		if (!ppid || kids.pids[i] < ppid)
+			ppid = kids.pids[i];
+		found++;
+	}
+
+	if (found > 1)
+		s_state("WARNING", "Multiple parent processes found matching `%s'", OPTIONS.match);
+	if (found == 1)
+		s_state("OK", "Found process matching `%s'", OPTIONS.match);
+	if (!ppid) {
+		s_state("WARNING", "process %s (matching `%s') not found", OPTIONS.name, OPTIONS.match);
+		exit(0);
+	}
+
+	stats_t stats = { { 0 } };
+	s_pidstats(ppid, 0, &stats);
+
+	if (OPTIONS.children) {
+		/* every descendant, breadth-first; kids grows as we go */
+		kids.n = 0;
+		s_children(ppid, &kids);
+		for (i = 0; i < kids.n; i++) {
+			stats_t s = { { 0 } };
+			s_pidstats(kids.pids[i], 1, &s);
+
+			int m;
+			for (m = 0; m < NMETRICS; m++)
+				stats.value[m] += s.value[m];
+			stats.set |= s.set;
+
+			s_children(kids.pids[i], &kids);
+		}
+	}
+
+	ts = time_s();
+	for (i = 0; i < NMETRICS; i++) {
+		if (!(stats.set & (1ULL << i)))
+			continue;
+
+		double v = stats.value[i];
+		printf(v == (double)(long long)v ? "%s %i %s:proc:%s:%s %.0f\n"
+		                                 : "%s %i %s:proc:%s:%s %.15g\n",
+		       METRICS[i].rate ? "RATE" : "SAMPLE", ts, PREFIX, OPTIONS.name, METRICS[i].name, v);
+	}
+	return 0;
+}
+
+int parse_options(int argc, char **argv)
+{
+	const char *short_opts = "h?p:n:m:rD";
+	struct option long_opts[] = {
+		{ "help",        no_argument, 0, 'h' },
+		{ "prefix", required_argument, 0, 'p' },
+		{ "name",   required_argument, 0, 'n' },
+		{ "match",  required_argument, 0, 'm' },
+		{ "children",    no_argument, 0, 'c' },
+		{ "rollup",      no_argument, 0, 'r' },
+		{ "debug",       no_argument, 0, 'D' },
+		{ 0, 0, 0, 0 },
+	};
+	int opt, idx;
+	while ((opt = getopt_long(argc, argv, short_opts, long_opts, &idx)) >= 0) {
+		switch (opt) {
+		case 'h':
+		case '?':
+			fprintf(stdout, "process (a Bolo collector)\n"
+			                "USAGE: process [options]\n"
+			                "\n"
+			                "options:\n"
+			                "   -h, --help               Show this help screen\n"
+			                "   -p, --prefix PREFIX      Use the given metric prefix\n"
+			                "                            (FQDN is used by default)\n"
+			                "   -n, --name NAME          Name of the process to look for\n"
+			                "   -m, --match PATTERN      A PCRE regex for matching processes\n"
+			                "   --children               Aggregate data from child processes\n"
+			                "   -r, --rollup             Report memory as mem_total, mem_pss and\n"
+			                "                            swp_total, from smaps_rollup, instead of\n"
+			                "                            the per-mapping mem_* / swp_* breakdown\n"
+			                "                            (much cheaper for huge processes)\n"
+			                "\n"
+			                "note: this collector does not support systemd, and will only find\n"
+			                "      processes that are children of init (PID 1).\n"
+			                "      You will probably need to be root to run this collector.\n"
+			                "\n");
+			exit(0);
+
+		case 'p':
+			free(PREFIX);
+			PREFIX = strdup(optarg);
+			break;
+
+		case 'n':
+			free(OPTIONS.name);
+			OPTIONS.name = strdup(optarg);
+			break;
+
+		case 'm':
+			free(OPTIONS.match);
+			OPTIONS.match = strdup(optarg);
+			break;
+
+		case 'c':
+			OPTIONS.children = 1;
+			break;
+
+		case 'r':
+			OPTIONS.rollup = 1;
+			break;
+
+		case 'D':
+			OPTIONS.debug = 1;
+			break;
+		}
+	}
+
+	if (!OPTIONS.name) {
+		fprintf(stderr, "Missing required --name flag\n");
+		return 1;
+	}
+	if (!OPTIONS.match)
+		OPTIONS.match = strdup(OPTIONS.name);
+
+	char *a;
+	for (a = OPTIONS.name; *a; a++)
+		if (*a == '/') *a = '_';
+
+	INIT_PREFIX();
+	return 0;
+}
@@ -0,0 +1,541 @@
+#include "common.h"
+#include <math.h>
+#include <pcre.h>
+#include <curl/curl.h>
+
+#define UA PACKAGE_NAME " (prometheus)/" PACKAGE_VERSION
+
+/* longest line (and longest series name) we'll handle; anything
+   longer is skipped, and counted as such */
+#define LINE_MAX_LEN 8192
+
+#define T_UNTYPED   0
+#define T_COUNTER   1
+#define T_GAUGE     2
+#define T_HISTOGRAM 3
+#define T_SUMMARY   4
+
+typedef struct __matcher {
+	char       *pattern; /* raw pattern source string.                    */
+	pcre       *regex;   /* compiled pattern to match against.            */
+	pcre_extra *extra;   /* additional stuff from pcre_study (perf tweak) */
+
+	struct __matcher *next;
+} matcher_t;
+static matcher_t *EXCLUDE = NULL;
+static matcher_t *INCLUDE = NULL;
+
+static struct {
+	char *url;
+	char *name;     /* optional; goes between PREFIX and the series */
+	size_t namelen;
+	char *socket;
+	int   timeout;
+	int   interval;
+} OPTIONS = {
+	.timeout  = 10,
+	.interval = 0,
+};
+
+typedef struct {
+	/* a line that straddles two chunks of the response */
+	char     line[LINE_MAX_LEN];
+	size_t   len;
+	int      overlong;
+
+	/* the metric family from the last # TYPE line */
+	char     family[256];
+	size_t   flen;
+	int      type;
+
+	unsigned long series, filtered, bad;
+} parser_t;
+
+int parse_options(int argc, char **argv);
+int matches(const char *name, size_t len);
+int append_matcher(matcher_t **root, const char *flag, const char *value);
+
+#define is_name0(c) (isalpha(c) || (c) == '_' || (c) == ':')
+#define is_name(c)  (isalnum(c) || (c) == '_' || (c) == ':')
+
+#define suffixed(s,n,lit) ((n) == sizeof(lit) - 1 && memcmp((s), (lit), (n)) == 0)
+
+/* RATE or SAMPLE, based on what the last # TYPE said about the
+   family this sample belongs to.  Untyped samples are SAMPLEs. */
+static const char* s_kind(parser_t *p, const char *name, size_t len)
+{
+	if (len < p->flen || memcmp(name, p->family, p->flen) != 0)
+		return "SAMPLE";
+
+	const char *sfx = name + p->flen;
+	size_t n = len - p->flen;
+
+	switch (p->type) {
+	case T_COUNTER:
+		if (n == 0 || suffixed(sfx, n, "_total"))
+			return "RATE";
+		break;
+
+	case T_HISTOGRAM:
+		if (suffixed(sfx, n, "_bucket") || suffixed(sfx, n, "_sum") || suffixed(sfx, n, "_count"))
+			return "RATE";
+		break;
+
+	case T_SUMMARY:
+		if (suffixed(sfx, n, "_sum") || suffixed(sfx, n, "_count"))
+			return "RATE";
+		break;
+	}
+	return "SAMPLE";
+}
+
+/* # TYPE name counter|gauge|histogram|summary|untyped */
+static void s_type(parser_t *p, const char *a, const char *b)
+{
+	while (a < b && isspace(*a)) a++;
+	const char *name = a;
+	while (a < b && is_name(*a)) a++;
+	size_t len = a - name;
+	while (a < b && isspace(*a)) a++;
+
+	p->flen = 0;
+	p->type = T_UNTYPED;
+	if (len == 0 || len >= sizeof(p->family))
+		return;
+
+	memcpy(p->family, name, len);
+	p->flen = len;
+
+	size_t n = b - a;
+	while (n > 0 && isspace(a[n - 1])) n--;
+	if      (suffixed(a, n, "counter"))   p->type = T_COUNTER;
+	else if (suffixed(a, n, "gauge"))     p->type = T_GAUGE;
+	else if (suffixed(a, n, "histogram")) p->type = T_HISTOGRAM;
+	else if (suffixed(a, n, "summary"))   p->type = T_SUMMARY;
+}
+
+/* Parse one line of the exposition format, in place.  The series is
+   rendered as name:label=value,label=value (in the order the labels
+   were given), which is what --include / --exclude see. */
+static void s_line(parser_t *p, const char *a, const char *b)
+{
+	while (a < b && isspace(*a)) a++;
+	if (a == b)
+		return;
+
+	if (*a == '#') {
+		a++;
+		while (a < b && isspace(*a)) a++;
+		if (b - a > 5 && memcmp(a, "TYPE", 4) == 0 && isspace(a[4]))
+			s_type(p, a + 5, b);
+		return;
+	}
+
+	char series[LINE_MAX_LEN + 256];
+	size_t n = 0;
+
+	if ((size_t)(b - a) > LINE_MAX_LEN)
+		goto bad;
+	if (OPTIONS.name) {
+		n = OPTIONS.namelen;
+		memcpy(series, OPTIONS.name, n);
+		series[n++] = ':';
+	}
+
+	const char *name = a;
+	if (!is_name0(*a))
+		goto bad;
+	while (a < b && is_name(*a)) a++;
+	size_t nlen = a - name;
+	memcpy(series + n, name, nlen);
+	n += nlen;
+
+	if (a < b && *a == '{') {
+		int first = 1;
+		a++;
+		for (;;) {
+			while (a < b && (isspace(*a) || *a == ',')) a++;
+			if (a == b)
+				goto bad;
+			if (*a == '}') {
+				a++;
+				break;
+			}
+
+			/* name="value"; this can't overflow series[], since
+			   nothing we write is longer than what we read */
+			series[n++] = first ? ':' : ',';
+			first = 0;
+			while (a < b && is_name(*a))
+				series[n++] = *a++;
+			while (a < b && isspace(*a)) a++;
+			if (a == b || *a++ != '=')
+				goto bad;
+			while (a < b && isspace(*a)) a++;
+			if (a == b || *a++ != '"')
+				goto bad;
+			series[n++] = '=';
+
+			while (a < b && *a != '"') {
+				char c = *a++;
+				if (c == '\\' && a < b) {
+					c = *a++;
+					if (c == 'n') c = '_';
+				}
+				series[n++] = isspace(c) ? '_' : c;
+			}
+			if (a == b)
+				goto bad;
+			a++; /* closing quote */
+		}
+	}
+
+	while (a < b && isspace(*a)) a++;
+	const char *value = a;
+	while (a < b && !isspace(*a)) a++;
+	size_t vlen = a - value;
+	if (vlen == 0 || vlen >= 64)
+		goto bad;
+
+	/* strtod() wants a NUL; values are short, so copy just that */
+	char num[64], *end;
+	memcpy(num, value, vlen);
+	num[vlen] = '\0';
+	double v = strtod(num, &end);
+	if (*end)
+		goto bad;
+	if (!isfinite(v))
+		return; /* NaN / +Inf / -Inf; nothing bolo can do with them */
+
+	if (!matches(series, n)) {
+		p->filtered++;
+		return;
+	}
+
+	p->series++;
+	printf("%s %i %s:%.*s %s\n", s_kind(p, name, nlen), ts, PREFIX, (int)n, series, num);
+	return;
+
+bad:
+	p->bad++;
+}
+
+/* Feed one chunk of the scrape through the line parser.  Complete
+   lines are parsed right where they sit in libcurl's buffer; only a
+   line split across two chunks is copied, so nothing is allocated
+   per sample no matter how many series there are. */
+static size_t s_writer(void *buf, size_t each, size_t n, void *user)
+{
+	parser_t *p = (parser_t *)user;
+	const char *a   = buf;
+	const char *end = a + each * n;
+
+	while (a < end) {
+		const char *nl  = memchr(a, '\n', end - a);
+		const char *eol = nl ? nl : end;
+
+		if (p->len == 0 && !p->overlong && nl) {
+			s_line(p, a, eol);
+
+		} else {
+			size_t len = eol - a;
+			if (p->overlong || len > sizeof(p->line) - p->len) {
+				p->overlong = 1;
+			} else {
+				memcpy(p->line + p->len, a, len);
+				p->len += len;
+			}
+
+			if (nl) {
+				if (p->overlong)
+					p->bad++;
+				else
+					s_line(p, p->line, p->line + p->len);
+				p->len = 0;
+				p->overlong = 0;
+			}
+		}
+
+		a = nl ? nl + 1 : end;
+	}
+	return each * n;
+}
+
+static int s_scrape(CURL *c)
+{
+	static parser_t p;
+	char error[CURL_ERROR_SIZE];
+
+	memset(&p, 0, sizeof(p));
+	error[0] = '\0';
+	curl_easy_setopt(c, CURLOPT_WRITEDATA,   &p);
+	curl_easy_setopt(c, CURLOPT_ERRORBUFFER, error);
+
+	ts = time_s();
+	CURLcode rc = curl_easy_perform(c);
+	if (rc != CURLE_OK) {
+		fprintf(stderr, "%s: %s\n", OPTIONS.url, error[0] ? error : curl_easy_strerror(rc));
+		return 2;
+	}
+
+	/* the last line may not have had a newline */
+	if (p.len && !p.overlong)
+		s_line(&p, p.line, p.line + p.len);
+
+	if (p.bad)
+		fprintf(stderr, "%s: skipped %lu unparseable line(s)\n", OPTIONS.url, p.bad);
+	fflush(stdout);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (parse_options(argc, argv) != 0) {
+		fprintf(stderr, "USAGE: %s [options] URL\n", argv[0]);
+		exit(1);
+	}
+
+	static char out[65536];
+	setvbuf(stdout, out, _IOFBF, sizeof(out));
+
+	curl_global_init(CURL_GLOBAL_ALL);
+	CURL *c = curl_easy_init();
+	if (!c)
+		return 1;
+
+	curl_easy_setopt(c, CURLOPT_NOSIGNAL,        1L);
+	curl_easy_setopt(c, CURLOPT_WRITEFUNCTION,   s_writer);
+	curl_easy_setopt(c, CURLOPT_USERAGENT,       UA);
+	curl_easy_setopt(c, CURLOPT_URL,             OPTIONS.url);
+	curl_easy_setopt(c, CURLOPT_TIMEOUT,         (long)OPTIONS.timeout);
+	curl_easy_setopt(c, CURLOPT_FAILONERROR,     1L);
+	curl_easy_setopt(c, CURLOPT_ACCEPT_ENCODING, "");
+	if (OPTIONS.socket)
+		curl_easy_setopt(c, CURLOPT_UNIX_SOCKET_PATH, OPTIONS.socket);
+
+	struct curl_slist *headers = curl_slist_append(NULL, "Accept: text/plain;version=0.0.4");
+	curl_easy_setopt(c, CURLOPT_HTTPHEADER, headers);
+
+	int rc;
+	for (;;) {
+		int64_t started = time_ms();
+		rc = s_scrape(c);
+
+		if (!OPTIONS.interval)
+			break;
+
+		int64_t left = started + OPTIONS.interval * 1000 - time_ms();
+		if (left > 0)
+			usleep(left * 1000);
+	}
+
+	curl_slist_free_all(headers);
+	curl_easy_cleanup(c);
+	curl_global_cleanup();
+	return rc;
+}
+
+int parse_options(int argc, char **argv)
+{
+	int errors = 0;
+
+	int i;
+	for (i = 1; i < argc; i++) {
+		if (streq(argv[i], "-p") || streq(argv[i], "--prefix")) {
+			if (++i >= argc) {
+				fprintf(stderr, "Missing required value for -p\n");
+				return 1;
+			}
+			PREFIX = strdup(argv[i]);
+			continue;
+		}
+
+		if (streq(argv[i], "-n") || streq(argv[i], "--name")) {
+			if (++i >= argc) {
+				fprintf(stderr, "Missing required value for -n\n");
+				return 1;
+			}
+			OPTIONS.name = strdup(argv[i]);
+			OPTIONS.namelen = strlen(OPTIONS.name);
+			if (OPTIONS.namelen > 128) {
+				fprintf(stderr, "--name '%s' is too long\n", OPTIONS.name);
+				return 1;
+			}
+			continue;
+		}
+
+		if (streq(argv[i], "-I") || streq(argv[i], "--include")) {
+			if (++i >= argc) {
+				fprintf(stderr, "Missing required value for --include flag\n");
+				return 1;
+			}
+			if (append_matcher(&INCLUDE, "--include", argv[i]) != 0)
+				return 1;
+			continue;
+		}
+
+		if (streq(argv[i], "-x") || streq(argv[i], "--exclude")) {
+			if (++i >= argc) {
+				fprintf(stderr, "Missing required value for --exclude flag\n");
+				return 1;
+			}
+			if (append_matcher(&EXCLUDE, "--exclude", argv[i]) != 0)
+				return 1;
+			continue;
+		}
+
+		if (streq(argv[i], "-U") || streq(argv[i], "--unix-socket")) {
+			if (++i >= argc) {
+				fprintf(stderr, "Missing required value for -U\n");
+				return 1;
+			}
+			OPTIONS.socket = strdup(argv[i]);
+			continue;
+		}
+
+		if (streq(argv[i], "-T") || streq(argv[i], "--timeout")) {
+			if (++i >= argc) {
+				fprintf(stderr, "Missing required value for -T\n");
+				return 1;
+			}
+			OPTIONS.timeout = atoi(argv[i]);
+			if (OPTIONS.timeout < 1) OPTIONS.timeout = 1;
+			continue;
+		}
+
+		if (streq(argv[i], "-i") || streq(argv[i], "--interval")) {
+			if (++i >= argc) {
+				fprintf(stderr, "Missing required value for -i\n");
+				return 1;
+			}
+			OPTIONS.interval = atoi(argv[i]);
+			if (OPTIONS.interval < 0) OPTIONS.interval = 0;
+			continue;
+		}
+
+		if (streq(argv[i], "-h") || streq(argv[i], "-?") || streq(argv[i], "--help")) {
+			fprintf(stdout, "prometheus (a Bolo collector)\n"
+			                "USAGE: prometheus [options] URL\n"
+			                "\n"
+			                "options:\n"
+			                "   -h, --help               Show this help screen\n"
+			                "   -p, --prefix PREFIX      Use the given metric prefix\n"
+			                "                            (FQDN is used by default)\n"
+			                "   -n, --name NAME          Put NAME between the prefix and each series,\n"
+			                "                            i.e. PREFIX:NAME:series\n"
+			                "\n"
+			                "   -I, --include regex      Only report series that match /^regex$/,\n"
+			                "                            using PCRE.  By default, all series are\n"
+			                "                            included.\n"
+			                "\n"
+			                "   -x, --exclude regex      Don't report series that match /^regex$/,\n"
+			                "                            using PCRE.  By default, nothing is excluded.\n"
+			                "\n"
+			                "                            Series are matched as name:label=value,...\n"
+			                "                            (without the --name).\n"
+			                "\n"
+			                "   -U, --unix-socket PATH   Connect to PATH instead of the URL's host\n"
+			                "   -T, --timeout SECONDS    Give up on the scrape after SECONDS (default 10)\n"
+			                "   -i, --interval SECONDS   Keep running, scraping every SECONDS,\n"
+			                "                            and reuse the connection between scrapes\n"
+			                "\n"
+			                "Counters (and histogram / summary _sum, _count and _bucket series)\n"
+			                "are reported as RATEs; everything else is a SAMPLE.\n"
+			                "\n");
+			exit(0);
+		}
+
+		if (!OPTIONS.url && argv[i][0] != '-') {
+			OPTIONS.url = strdup(argv[i]);
+
+		} else {
+			fprintf(stderr, "Unrecognized argument '%s'\n", argv[i]);
+			errors++;
+		}
+	}
+
+	if (!OPTIONS.url) {
+		fprintf(stderr, "Missing required URL argument\n");
+		errors++;
+	}
+
+	INIT_PREFIX();
+
+	return errors;
+}
+
+int matches(const char *name, size_t len)
+{
+	matcher_t *m;
+
+	/* --name isn't part of what we match against */
+	if (OPTIONS.name) {
+		name += OPTIONS.namelen + 1;
+		len  -= OPTIONS.namelen + 1;
+	}
+
+	if ((m = INCLUDE) != NULL) {
+		while (m) {
+			if (pcre_exec(m->regex, m->extra, name, len, 0, 0, NULL, 0) == 0)
+				goto excludes;
+			m = m->next;
+		}
+		return 0; /* not included */
+	}
+
+excludes:
+	m = EXCLUDE;
+	while (m) {
+		if (pcre_exec(m->regex, m->extra, name, len, 0, 0, NULL, 0) == 0)
+			return 0; /* excluded */
+		m = m->next;
+	}
+
+	return 1;
+}
+
+int append_matcher(matcher_t **root, const char *flag, const char *value)
+{
+	matcher_t *m;
+	const char *re_err;
+	int re_off;
+
+	if (!*value) {
+		fprintf(stderr, "Missing regex for %s flag\n", flag);
+		return 1;
+	}
+
+	m = calloc(1, sizeof(matcher_t));
+	if (!m) {
+		fprintf(stderr, "unable to allocate memory: %s (errno %d)\n", strerror(errno), errno);
+		exit(1);
+	}
+
+	m->pattern = calloc(1 + strlen(value) + 1 + 1, sizeof(char));
+	if (!m->pattern) {
+		fprintf(stderr, "unable to allocate memory: %s (errno %d)\n", strerror(errno), errno);
+		exit(1);
+	}
+	m->pattern[0] = '^';
+	memcpy(m->pattern+1, value, strlen(value));
+	m->pattern[1+strlen(value)] = '$';
+
+	m->regex = pcre_compile(m->pattern, PCRE_ANCHORED, &re_err, &re_off, NULL);
+	if (!m->regex) {
+		fprintf(stderr, "Bad regex '%s' (error %s) for %s flag\n", m->pattern, re_err, flag);
+		free(m->pattern);
+		free(m);
+		return 1;
+	}
+	m->extra = pcre_study(m->regex, 0, &re_err);
+
+	if (!*root) {
+		*root = m;
+	} else {
+		while (root && (*root)->next) {
+			root = &(*root)->next;
+		}
+		(*root)->next = m;
+	}
+	return 0;
+}
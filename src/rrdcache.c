@@ -1,12 +1,355 @@
 #include "common.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
-#define HAVE_STDINT_H
-#include <rrd.h>
-#include <rrd_client.h>
+/* rrdcached speaks a line-based protocol; we talk it directly (rather
+   than through librrd's rrdc_* calls) because librrd only ever holds
+   one connection, and we want to query every shard at once. */
+
+#define DEFAULT_PORT "42217"
+#define MAX_STATS    32
+#define BUF_SIZE     8192
+
+#define S_IDLE       0
+#define S_CONNECTING 1
+#define S_SENDING    2
+#define S_READING    3
+#define S_DONE       4
+#define S_FAILED     5
+
+typedef struct {
+	char     name[64];
+	int      gauge;
+	uint64_t counter;
+	double   value;
+} stat_t;
+
+typedef struct {
+	char   *label;
+	char   *address;
+
+	int     fd;
+	int     state;
+	int     reused;  /* is fd left over from a previous interval? */
+	size_t  sent;
+	size_t  used;
+	char    buf[BUF_SIZE];
+
+	int     nstats;
+	stat_t  stats[MAX_STATS];
+} shard_t;
+
+static struct {
+	int      timeout;
+	int      interval;
+	int      nshards;
+	shard_t *shards;
+} OPTIONS = {
+	.timeout  = 2,
+	.interval = 0,
+};
 
-static char *ADDRESS = NULL;
 int parse_options(int argc, char **argv);
 
+/* in the same vein as librrd, which only calls these three gauges */
+static int s_is_gauge(const char *name)
+{
+	return streq(name, "QueueLength")
+	    || streq(name, "TreeDepth")
+	    || streq(name, "TreeNodesNumber");
+}
+
+static void s_fail(shard_t *s, const char *why)
+{
+	if (!s->reused || s->used > 0) /* stale connections get a retry */
+		fprintf(stderr, "rrdcached %s (%s): %s\n", s->label, s->address, why);
+	if (s->fd >= 0)
+		close(s->fd);
+	s->fd = -1;
+	s->state = S_FAILED;
+}
+
+static int s_connect(shard_t *s)
+{
+	int rc;
+	const char *addr = s->address;
+
+	if (strncmp(addr, "unix:", 5) == 0 || *addr == '/') {
+		if (*addr != '/') addr += 5;
+
+		struct sockaddr_un sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sun_family = AF_UNIX;
+		strncpy(sa.sun_path, addr, sizeof(sa.sun_path) - 1);
+
+		s->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (s->fd < 0)
+			return 1;
+		fcntl(s->fd, F_SETFL, O_NONBLOCK);
+		rc = connect(s->fd, (struct sockaddr *)&sa, sizeof(sa));
+
+	} else {
+		char *host = strdup(addr), *port = NULL, *p;
+		if (*host == '[' && (p = strchr(host, ']')) != NULL) {
+			*p++ = '\0';
+			memmove(host, host + 1, strlen(host));
+			if (*p == ':') port = p + 1;
+		} else if ((p = strchr(host, ':')) != NULL && !strchr(p + 1, ':')) {
+			*p++ = '\0';
+			port = p;
+		}
+
+		struct addrinfo hints, *ai;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family   = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		rc = getaddrinfo(host, port && *port ? port : DEFAULT_PORT, &hints, &ai);
+		free(host);
+		if (rc != 0) {
+			errno = EHOSTUNREACH;
+			return 1;
+		}
+
+		s->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (s->fd < 0) {
+			freeaddrinfo(ai);
+			return 1;
+		}
+		fcntl(s->fd, F_SETFL, O_NONBLOCK);
+		rc = connect(s->fd, ai->ai_addr, ai->ai_addrlen);
+		freeaddrinfo(ai);
+	}
+
+	if (rc != 0 && errno != EINPROGRESS) {
+		close(s->fd);
+		s->fd = -1;
+		return 1;
+	}
+	s->state = rc == 0 ? S_SENDING : S_CONNECTING;
+	return 0;
+}
+
+/* Parse as much of the STATS response as we have.  The first line is
+   '<N> Statistics follow', and is followed by N 'Name: value' lines.
+   Returns 0 if we need more data, 1 if the response is complete,
+   and -1 if rrdcached sent us something we don't understand. */
+static int s_parse(shard_t *s)
+{
+	char *line = s->buf, *nl, *end = s->buf + s->used;
+	if (!(nl = memchr(line, '\n', end - line)))
+		return 0;
+
+	int n = atoi(line);
+	if (n < 0)
+		return -1;
+
+	s->nstats = 0;
+	while (n-- > 0) {
+		line = nl + 1;
+		if (line >= end || !(nl = memchr(line, '\n', end - line)))
+			return 0;
+
+		char *v = memchr(line, ':', nl - line);
+		if (!v || s->nstats >= MAX_STATS)
+			continue;
+
+		stat_t *st = &s->stats[s->nstats++];
+		size_t len = MIN((size_t)(v - line), sizeof(st->name) - 1);
+		memcpy(st->name, line, len);
+		st->name[len] = '\0';
+
+		st->gauge   = s_is_gauge(st->name);
+		st->counter = strtoull(v + 1, NULL, 10);
+		st->value   = strtod(v + 1, NULL);
+	}
+	return 1;
+}
+
+static void s_io(shard_t *s, short revents)
+{
+	static const char cmd[] = "STATS\n";
+	ssize_t n;
+
+	if (s->state == S_CONNECTING) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+			s_fail(s, strerror(err ? err : errno));
+			return;
+		}
+		s->state = S_SENDING;
+	}
+
+	if (s->state == S_SENDING && (revents & POLLOUT)) {
+		n = send(s->fd, cmd + s->sent, sizeof(cmd) - 1 - s->sent, MSG_NOSIGNAL);
+		if (n < 0 && errno != EAGAIN) {
+			s_fail(s, strerror(errno));
+			return;
+		}
+		if (n > 0 && (s->sent += n) == sizeof(cmd) - 1)
+			s->state = S_READING;
+		return;
+	}
+
+	if (s->state == S_READING && (revents & (POLLIN|POLLHUP|POLLERR))) {
+		n = read(s->fd, s->buf + s->used, BUF_SIZE - s->used);
+		if (n < 0 && errno == EAGAIN)
+			return;
+		if (n <= 0) {
+			s_fail(s, n == 0 ? "connection closed" : strerror(errno));
+			return;
+		}
+		s->used += n;
+
+		switch (s_parse(s)) {
+		case 1:  s->state = S_DONE; break;
+		case -1: s_fail(s, "bad response to STATS"); break;
+		default:
+			if (s->used == BUF_SIZE)
+				s_fail(s, "response too large");
+		}
+	}
+}
+
+/* Ask every shard for its stats, all at once, giving up on any that
+   haven't answered within the timeout.  Connections that are still
+   open from the last interval are reused; if one of them turns out
+   to have gone away in the meantime, we reconnect it (once). */
+static void s_poll_shards(void)
+{
+	int i, pending = 0;
+	for (i = 0; i < OPTIONS.nshards; i++) {
+		shard_t *s = &OPTIONS.shards[i];
+		s->sent = s->used = 0;
+		s->nstats = 0;
+		s->reused = s->fd >= 0;
+
+		if (s->reused) {
+			s->state = S_SENDING;
+		} else if (s_connect(s) != 0) {
+			s_fail(s, strerror(errno));
+			continue;
+		}
+		pending++;
+	}
+
+	struct pollfd *pfd = calloc(OPTIONS.nshards, sizeof(struct pollfd));
+	int64_t deadline = time_ms() + OPTIONS.timeout * 1000;
+	while (pending > 0) {
+		int64_t left = deadline - time_ms();
+		if (left <= 0)
+			break;
+
+		for (i = 0; i < OPTIONS.nshards; i++) {
+			shard_t *s = &OPTIONS.shards[i];
+			pfd[i].fd = -1;
+			pfd[i].revents = 0;
+			if (s->state == S_DONE || s->state == S_FAILED)
+				continue;
+			pfd[i].fd = s->fd;
+			pfd[i].events = s->state == S_READING ? POLLIN : POLLOUT;
+		}
+
+		if (poll(pfd, OPTIONS.nshards, left) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		for (i = 0; i < OPTIONS.nshards; i++) {
+			shard_t *s = &OPTIONS.shards[i];
+			if (pfd[i].fd < 0 || !pfd[i].revents)
+				continue;
+
+			s_io(s, pfd[i].revents);
+			if (s->state == S_FAILED && s->reused && s->used == 0) {
+				/* stale connection; try once more, from scratch */
+				s->reused = 0;
+				s->sent = 0;
+				if (s_connect(s) == 0)
+					continue;
+				s_fail(s, strerror(errno));
+			}
+			if (s->state == S_DONE || s->state == S_FAILED)
+				pending--;
+		}
+	}
+	free(pfd);
+
+	for (i = 0; i < OPTIONS.nshards; i++) {
+		shard_t *s = &OPTIONS.shards[i];
+		if (s->state != S_DONE && s->state != S_FAILED) {
+			s->reused = 0;
+			s_fail(s, "timed out");
+		}
+		if (s->state == S_DONE && !OPTIONS.interval) {
+			close(s->fd);
+			s->fd = -1;
+		}
+	}
+}
+
+static void s_report(void)
+{
+	stat_t sum[MAX_STATS];
+	int nsum = 0, ok = 0;
+	int i, j, k;
+
+	memset(sum, 0, sizeof(sum));
+	ts = time_s();
+	for (i = 0; i < OPTIONS.nshards; i++) {
+		shard_t *s = &OPTIONS.shards[i];
+		if (s->state != S_DONE)
+			continue;
+		ok++;
+
+		for (j = 0; j < s->nstats; j++) {
+			stat_t *st = &s->stats[j];
+			if (OPTIONS.nshards > 1) {
+				if (st->gauge)
+					printf("SAMPLE %i %s:rrdcache:%s:%s %0.3f\n", ts, PREFIX, s->label, st->name, st->value);
+				else
+					printf("RATE %i %s:rrdcache:%s:%s %lu\n", ts, PREFIX, s->label, st->name, st->counter);
+			}
+
+			for (k = 0; k < nsum; k++)
+				if (streq(sum[k].name, st->name))
+					break;
+			if (k == nsum) {
+				if (nsum >= MAX_STATS)
+					continue;
+				memcpy(sum[k].name, st->name, sizeof(st->name));
+				sum[k].gauge = st->gauge;
+				nsum++;
+			}
+			sum[k].counter += st->counter;
+			sum[k].value   += st->value;
+		}
+	}
+
+	if (ok > 0) {
+		for (k = 0; k < nsum; k++) {
+			if (sum[k].gauge)
+				printf("SAMPLE %i %s:rrdcache:%s %0.3f\n", ts, PREFIX, sum[k].name, sum[k].value);
+			/* a sum missing a shard drops, and then jumps back up when
+			   the shard returns; to a RATE, that looks like a reset */
+			else if (ok == OPTIONS.nshards)
+				printf("RATE %i %s:rrdcache:%s %lu\n", ts, PREFIX, sum[k].name, sum[k].counter);
+		}
+	}
+	if (OPTIONS.nshards > 1) {
+		printf("SAMPLE %i %s:rrdcache:shards.ok %i\n",     ts, PREFIX, ok);
+		printf("SAMPLE %i %s:rrdcache:shards.failed %i\n", ts, PREFIX, OPTIONS.nshards - ok);
+	}
+	fflush(stdout);
+}
+
 int main(int argc, char **argv)
 {
 	if (parse_options(argc, argv) != 0) {
@@ -14,20 +357,65 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	rrdc_stats_t *head = NULL, *p;
+	signal(SIGPIPE, SIG_IGN);
+	for (;;) {
+		int64_t started = time_ms();
+		s_poll_shards();
+		s_report();
 
-	int rc = rrdc_connect(ADDRESS);
-	if (rc != 0) exit(1);
+		if (!OPTIONS.interval)
+			break;
 
-	ts = time_s();
-	rc = rrdc_stats_get(&head);
-	assert(rc == 0);
-	for (p = head; p; p = p->next) {
-		printf("%s %i %s:rrdcache:%s %0.3f\n",
-			p->type == RRDC_STATS_TYPE_GAUGE ? "SAMPLE" : "RATE",
-			ts, PREFIX, p->name,
-			p->type == RRDC_STATS_TYPE_GAUGE ? p->value.gauge : p->value.counter);
+		int64_t left = started + OPTIONS.interval * 1000 - time_ms();
+		if (left > 0)
+			usleep(left * 1000);
+	}
+
+	int i, rc = 0;
+	for (i = 0; i < OPTIONS.nshards; i++)
+		if (OPTIONS.shards[i].state != S_DONE)
+			rc = 1;
+	return rc;
+}
+
+static int s_add_shard(const char *spec)
+{
+	shard_t *s;
+
+	s = realloc(OPTIONS.shards, (OPTIONS.nshards + 1) * sizeof(shard_t));
+	if (!s) {
+		fprintf(stderr, "unable to allocate memory: %s (errno %d)\n", strerror(errno), errno);
+		exit(1);
+	}
+	OPTIONS.shards = s;
+	s = &OPTIONS.shards[OPTIONS.nshards++];
+	memset(s, 0, sizeof(shard_t));
+	s->fd = -1;
+
+	/* NAME=ADDRESS gives the shard a name; otherwise we
+	   make one up from the address itself */
+	const char *eq = strchr(spec, '=');
+	if (eq) {
+		s->label   = strndup(spec, eq - spec);
+		s->address = strdup(eq + 1);
+	} else {
+		s->address = strdup(spec);
+		s->label   = strdup(strncmp(spec, "unix:", 5) == 0 ? spec + 5 : spec);
+		char *p, *q;
+		for (p = q = s->label; *p; p++) {
+			if (isalnum(*p) || *p == '.' || *p == '-' || *p == '_')
+				*q++ = *p;
+			else if (q != s->label && q[-1] != '_')
+				*q++ = '_';
+		}
+		*q = '\0';
+	}
+
+	if (!*s->label || !*s->address) {
+		fprintf(stderr, "Invalid address '%s'\n", spec);
+		return 1;
 	}
+	return 0;
 }
 
 int parse_options(int argc, char **argv)
@@ -53,9 +441,22 @@ int parse_options(int argc, char **argv)
 			                "   -h, --help               Show this help screen\n"
 			                "   -p, --prefix PREFIX      Use the given metric prefix\n"
 			                "                            (FQDN is used by default)\n"
-			                "   -S, --address SOCKET     Socket to connect to\n"
+			                "   -S, --address SOCKET     Socket to connect to, either as\n"
+			                "                            unix:/path/to/socket or host[:port]\n"
+			                "                            Can be given more than once, to query\n"
+			                "                            several rrdcached instances at once;\n"
+			                "                            use NAME=SOCKET to name each one.\n"
 			                "                            Falls back to using the $RRDCACHED_ADDRESS\n"
 			                "                            env var, or unix:/tmp/rrdcached.sock\n"
+			                "   -t, --timeout SECONDS    How long to wait for each rrdcached\n"
+			                "                            to answer (defaults to 2)\n"
+			                "   -i, --interval SECONDS   Keep running, collecting every SECONDS,\n"
+			                "                            and keep connections open in between.\n"
+			                "\n"
+			                "With more than one address, metrics are reported per instance\n"
+			                "(as rrdcache:NAME:metric) and summed across all instances that\n"
+			                "answered (as rrdcache:metric).  Summed counters are skipped\n"
+			                "for any run where an instance failed to answer.\n"
 			                "\n");
 			exit(0);
 		}
@@ -65,7 +466,28 @@ int parse_options(int argc, char **argv)
 				fprintf(stderr, "Missing required value for -S\n");
 				return 1;
 			}
-			ADDRESS = strdup(argv[i]);
+			if (s_add_shard(argv[i]) != 0)
+				errors++;
+			continue;
+		}
+
+		if (streq(argv[i], "-t") || streq(argv[i], "--timeout")) {
+			if (++i >= argc) {
+				fprintf(stderr, "Missing required value for -t\n");
+				return 1;
+			}
+			OPTIONS.timeout = atoi(argv[i]);
+			if (OPTIONS.timeout <= 0) OPTIONS.timeout = 2;
+			continue;
+		}
+
+		if (streq(argv[i], "-i") || streq(argv[i], "--interval")) {
+			if (++i >= argc) {
+				fprintf(stderr, "Missing required value for -i\n");
+				return 1;
+			}
+			OPTIONS.interval = atoi(argv[i]);
+			if (OPTIONS.interval < 0) OPTIONS.interval = 0;
 			continue;
 		}
 
@@ -75,7 +497,9 @@ int parse_options(int argc, char **argv)
 
 	INIT_PREFIX();
 
-	if (!ADDRESS) ADDRESS = getenv("RRDCACHED_ADDRESS");
-	if (!ADDRESS) ADDRESS = "unix:/tmp/rrdcached.sock";
+	if (!OPTIONS.nshards) {
+		char *addr = getenv("RRDCACHED_ADDRESS");
+		errors += s_add_shard(addr && *addr ? addr : "unix:/tmp/rrdcached.sock");
+	}
 	return errors;
 }
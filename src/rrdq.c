@@ -7,10 +7,20 @@
 #include <unistd.h>
 #include <math.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #define HAVE_STDINT_H
 #include <rrd.h>
-//#include <rrd_client.h>
+#include <rrd_client.h>
+#include <rrd_format.h>
 
 
 typedef struct {
@@ -20,11 +30,40 @@ typedef struct {
 } cf_arg_t;
 typedef double (*cf_fn)(size_t, double*, cf_arg_t*);
 
+/* A window of consolidated rows from a single RRA.
+
+   The rows are stored in (at most) two runs; the second run is
+   only used when a window read out of a memory-mapped RRD wraps
+   around the end of the RRA's ring buffer.  Either way, every row
+   is `stride` values wide, and the DS we care about is the first
+   value in each run. */
+typedef struct {
+	rrd_value_t   *run[2];
+	size_t         len[2];
+	size_t         missing;   /* slots in the window not covered by the RRA */
+	size_t         lead;      /* (how many of those come before the rows) */
+	time_t         first;     /* timestamp of the first slot in the window */
+	unsigned long  stride;
+	unsigned long  step;
+
+	rrd_value_t   *raw;       /* from rrd_fetch / rrdc_fetch, or NULL */
+	void          *map;       /* from mmap(2), or NULL */
+	size_t         maplen;
+} series_t;
+
 struct {
 	int   DEBUG;
 	char *root;
 	char *hash;
 
+	char *daemon;
+	int   flush;
+	int   mmap;
+
+	char   *serve;
+	int     serving;
+	size_t  cache;
+
 	char *metric;
 	char *ds;
 	char *rrdfile;
@@ -32,9 +71,15 @@ struct {
 	time_t start;
 	time_t end;
 
+	unsigned long resolution;
+	double        error;
+
+	unsigned long every;
+	unsigned long window;
+
 	cf_fn    cf;
 	cf_arg_t cf_arg;
-} OPTIONS = { 0 };
+} OPTIONS = { 0 }, SERVER; /* SERVER: the --serve'd OPTIONS, as of startup */
 
 double cf_min      (size_t, double*, cf_arg_t*);
 double cf_max      (size_t, double*, cf_arg_t*);
@@ -44,8 +89,15 @@ double cf_median   (size_t, double*, cf_arg_t*);
 double cf_stddev   (size_t, double*, cf_arg_t*);
 double cf_variance (size_t, double*, cf_arg_t*);
 double cf_nth      (size_t, double*, cf_arg_t*);
+static int cmpd(const void *a, const void *b);
 
 int parse_options(int argc, char **argv);
+int fetch_series(series_t *s);
+int map_series(series_t *s);
+size_t gather(series_t *s, double *set);
+void release(series_t *s);
+int rolling(series_t *s);
+int serve(const char *address);
 
 int main(int argc, char **argv)
 {
@@ -69,9 +121,16 @@ int main(int argc, char **argv)
 		fprintf(stderr, "  file = %s\n", OPTIONS.rrdfile);
 		fprintf(stderr, "  root = %s\n", OPTIONS.root);
 		fprintf(stderr, "  hash = %s\n", OPTIONS.hash);
+		fprintf(stderr, "daemon = %s%s\n", OPTIONS.daemon ? OPTIONS.daemon : "(none)",
+			OPTIONS.daemon && (OPTIONS.flush || OPTIONS.mmap) ? " (flush only)" : "");
+		fprintf(stderr, "  read = %s\n", OPTIONS.mmap ? "mmap" : "rrd_fetch");
 		fprintf(stderr, " start = %lu\n", OPTIONS.start);
 		fprintf(stderr, "   end = %lu\n", OPTIONS.end);
 		fprintf(stderr, "    cf = %p\n", OPTIONS.cf);
+		if (OPTIONS.resolution)
+			fprintf(stderr, "   res = %lus\n", OPTIONS.resolution);
+		if (OPTIONS.error > 0.0)
+			fprintf(stderr, " error = %f%%\n", OPTIONS.error);
 		if (OPTIONS.cf == cf_nth)
 			fprintf(stderr, "     p = %f\n", OPTIONS.cf_arg.percentile);
 		if (OPTIONS.cf_arg.skip_unknown)
@@ -81,68 +140,91 @@ int main(int argc, char **argv)
 		fprintf(stderr, "\n\n");
 	}
 
-	char          **ds_names;
-	unsigned long   ds_count;
-	unsigned long   step = 1;
-	rrd_value_t *raw;
-	int rc;
-
-	rc = rrd_fetch_r(OPTIONS.rrdfile, "AVERAGE", &OPTIONS.start, &OPTIONS.end, &step,
-			&ds_count, &ds_names, &raw);
-	if (rc != 0) {
-		fprintf(stderr, "fetch failed!\n");
-		if (rrd_test_error()) {
-			fprintf(stderr, "rrd said: %s\n", rrd_get_error());
+	if (OPTIONS.daemon) {
+		if (rrdc_connect(OPTIONS.daemon) != 0) {
+			fprintf(stderr, "failed to connect to rrdcached at %s\n", OPTIONS.daemon);
+			if (rrd_test_error())
+				fprintf(stderr, "rrd said: %s\n", rrd_get_error());
+			exit(2);
+		}
+		if (!OPTIONS.serve && (OPTIONS.flush || OPTIONS.mmap) && rrdc_flush(OPTIONS.rrdfile) != 0) {
+			fprintf(stderr, "failed to flush %s through rrdcached\n", OPTIONS.rrdfile);
+			if (rrd_test_error())
+				fprintf(stderr, "rrd said: %s\n", rrd_get_error());
+			exit(2);
 		}
-		exit(2);
 	}
 
-	int ds;
-	for (ds = 0; ds < ds_count; ds++)
-		if (strcmp(OPTIONS.ds, ds_names[ds]) == 0)
-			break;
-	if (ds >= ds_count) {
-		fprintf(stderr, "DS '%s' not found in RRD file\n", OPTIONS.ds);
+	if (OPTIONS.serve)
+		return serve(OPTIONS.serve);
+
+	series_t s;
+	int rc = OPTIONS.mmap ? map_series(&s)
+	                      : fetch_series(&s);
+	if (rc != 0)
 		exit(2);
+
+	if (OPTIONS.every) {
+		rc = rolling(&s);
+	} else {
+		double *set = calloc(s.len[0] + s.len[1] + s.missing, sizeof(double));
+		if (!set) {
+			perror("calloc");
+			exit(9);
+		}
+		size_t n = gather(&s, set);
+		printf("%e\n", (*OPTIONS.cf)(n, set, &OPTIONS.cf_arg));
+		free(set);
 	}
 
-	size_t n = (OPTIONS.end - OPTIONS.start) / step;
-	double *set = calloc(n, sizeof(double));
-	rrd_value_t *d = raw + ds;
-	int i, j;
-	for (i = 0, j = 0; i < n; i++) {
-		double v = (double)*d;
-		if (isnan(v)) {
-			if (OPTIONS.cf_arg.skip_unknown) {
-				if (OPTIONS.DEBUG)
-					fprintf(stderr, "skipping sample #%i (--unknown=ignore)\n", i+1);
-				continue;
-			}
+	release(&s);
+	if (OPTIONS.daemon)
+		rrdc_disconnect();
+	return rc;
+}
 
-			if (OPTIONS.DEBUG)
-				fprintf(stderr, "sample #%i is UNKNOWN (substituting %e)\n", i+1, OPTIONS.cf_arg.unknown);
-			v = OPTIONS.cf_arg.unknown;
-		}
+/* parse a duration like 300, 300s, 5m, 1h or 2d into seconds */
+static int s_duration(const char *s, unsigned long *secs)
+{
+	char unit = 's', extra;
+	int n = sscanf(s, "%lu%c%c", secs, &unit, &extra);
+	if (n < 1 || n > 2)
+		return 1;
 
-		set[j] = v;
-		if (OPTIONS.DEBUG)
-			fprintf(stderr, "[%i] %e (%lf)\n", j+1, set[j], set[j]);
-		d += ds_count;
-		j++;
+	switch (unit) {
+	case 'd': *secs *= 24;
+	case 'h': *secs *= 60;
+	case 'm': *secs *= 60;
+	case 's': return 0;
+	default:  return 1;
 	}
-	printf("%e\n", (*OPTIONS.cf)(j, set, &OPTIONS.cf_arg));
-
-	return 0;
 }
 
 int parse_options(int argc, char **argv)
 {
-	OPTIONS.root = strdup("/var/lib/bolo/rrd");
-	OPTIONS.cf_arg.skip_unknown = 1;
+	if (!OPTIONS.serving) {
+		OPTIONS.root = strdup("/var/lib/bolo/rrd");
+		OPTIONS.cf_arg.skip_unknown = 1;
+	}
 
-	int i;
+	/* flags that only make sense to (and are owned by) the server */
+	static const char *server_only[] = {
+		"-D", "--debug", "--hash", "--root", "-d", "--daemon", "--flush",
+		"--mmap", "--serve", "--cache", "--every", "--window", NULL,
+	};
+
+	int i, j;
 	for (i = 1; i < argc; i++) {
+		for (j = 0; OPTIONS.serving && server_only[j]; j++) {
+			if (strcmp(argv[i], server_only[j]) == 0) {
+				fprintf(stderr, "%s is not allowed in queries\n", argv[i]);
+				return 1;
+			}
+		}
+
 		if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "-?") == 0 || strcmp(argv[i], "--help") == 0) {
+			if (OPTIONS.serving)
+				return 1;
 			fprintf(stderr, "rrdq (a Bolo utility)\n"
 			                "USAGE: rrdq -t start:end <cf> <metric:name:with:ds>\n"
 			                "\n"
@@ -159,6 +241,34 @@ int parse_options(int argc, char **argv)
 			                "                             probably don't need it)\n"
 			                "   --root /path/to/rrds     Root directory where RRD files are stored.\n"
 			                "                            (defaults to /var/lib/bolo/rrd)\n"
+			                "   -d, --daemon ADDRESS     Fetch through the rrdcached daemon\n"
+			                "                            listening on ADDRESS, so that pending\n"
+			                "                            updates are taken into account.\n"
+			                "   --flush                  With --daemon, only ask rrdcached to\n"
+			                "                            flush the RRD, and then read it locally.\n"
+			                "                            (always, if librrd has no rrdc_fetch)\n"
+			                "  -r, --resolution <time>   Use the coarsest RRA whose step is no\n"
+			                "                            larger than <time> (i.e. 300, 5m, 1h)\n"
+			                "                            that still covers the whole window.\n"
+			                "                            By default, the finest RRA is used.\n"
+			                "  -e, --error <percent>     Like --resolution, but in terms of how\n"
+			                "                            much of the window (as a percentage)\n"
+			                "                            one step of the RRA may cover.\n"
+			                "   --mmap                   Read the RRD directly, by mapping it\n"
+			                "                            into memory, instead of rrd_fetch().\n"
+			                "                            Implies --flush when used with --daemon.\n"
+			                "   --every <time>           Instead of a single value, print a time\n"
+			                "   --window <time>          series: one '<timestamp> <value>' line\n"
+			                "                            every <time>, consolidating the <time>\n"
+			                "                            --window that ends at that timestamp.\n"
+			                "                            The whole -t range is read only once.\n"
+			                "   --serve unix:/path       Run as a long-lived query server, reading\n"
+			                "                            queries (one per line, in the same form as\n"
+			                "                            rrdq's arguments) from a UNIX socket, and\n"
+			                "                            replying with one result line per query.\n"
+			                "                            The query 'stats' returns server counters.\n"
+			                "   --cache N                How many RRDs the server should keep open\n"
+			                "                            (defaults to 256).\n"
 			                "  -u, --unknown <value>     Treat unknown (U) samples as if they were\n"
 			                "                            this value instead.  The special value\n"
 			                "                            'ignore' (the default) will cause such\n"
@@ -180,6 +290,9 @@ int parse_options(int argc, char **argv)
 			                "                and the other containing 100-N%% (the remainder).\n"
 			                "                <N> can be specified as a whole number (50, 75, etc.)\n"
 			                "                or a decimal value (99.999, 0.001, etc.)\n"
+			                "\n"
+			                "min and max are calculated from the RRD's MIN and MAX RRAs, if it\n"
+			                "has them; all other functions work from the AVERAGE RRAs.\n"
 			                "\n");
 			exit(0);
 		}
@@ -273,6 +386,92 @@ int parse_options(int argc, char **argv)
 			continue;
 		}
 
+		if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--daemon") == 0) {
+			if (++i >= argc) {
+				fprintf(stderr, "Missing required value for --daemon\n");
+				return 1;
+			}
+
+			free(OPTIONS.daemon);
+			OPTIONS.daemon = strdup(argv[i]);
+			continue;
+		}
+
+		if (strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--resolution") == 0) {
+			if (++i >= argc) {
+				fprintf(stderr, "Missing required value for --resolution\n");
+				return 1;
+			}
+
+			if (s_duration(argv[i], &OPTIONS.resolution) != 0 || OPTIONS.resolution == 0) {
+				fprintf(stderr, "Bad value '%s' for --resolution\n", argv[i]);
+				return 1;
+			}
+			continue;
+		}
+
+		if (strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--error") == 0) {
+			if (++i >= argc) {
+				fprintf(stderr, "Missing required value for --error\n");
+				return 1;
+			}
+
+			if (sscanf(argv[i], "%lf", &OPTIONS.error) != 1
+			 || OPTIONS.error <= 0.0 || OPTIONS.error > 100.0) {
+				fprintf(stderr, "Bad value '%s' for --error\n", argv[i]);
+				return 1;
+			}
+			continue;
+		}
+
+		if (strcmp(argv[i], "--every") == 0 || strcmp(argv[i], "--window") == 0) {
+			if (++i >= argc) {
+				fprintf(stderr, "Missing required value for %s\n", argv[i-1]);
+				return 1;
+			}
+
+			unsigned long *x = strcmp(argv[i-1], "--every") == 0 ? &OPTIONS.every : &OPTIONS.window;
+			if (s_duration(argv[i], x) != 0 || *x == 0) {
+				fprintf(stderr, "Bad value '%s' for %s\n", argv[i], argv[i-1]);
+				return 1;
+			}
+			continue;
+		}
+
+		if (strcmp(argv[i], "--serve") == 0) {
+			if (++i >= argc) {
+				fprintf(stderr, "Missing required value for --serve\n");
+				return 1;
+			}
+
+			free(OPTIONS.serve);
+			OPTIONS.serve = strdup(argv[i]);
+			continue;
+		}
+
+		if (strcmp(argv[i], "--cache") == 0) {
+			if (++i >= argc) {
+				fprintf(stderr, "Missing required value for --cache\n");
+				return 1;
+			}
+
+			if (sscanf(argv[i], "%zu", &OPTIONS.cache) != 1 || OPTIONS.cache < 1) {
+				fprintf(stderr, "Bad value '%s' for --cache\n", argv[i]);
+				return 1;
+			}
+			continue;
+		}
+
+		if (strcmp(argv[i], "--flush") == 0) {
+			OPTIONS.flush = 1;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--mmap") == 0) {
+			OPTIONS.mmap = 1;
+			continue;
+		}
+
 		if (strcmp(argv[i], "-u") == 0 || strcmp(argv[i], "--unknown") == 0) {
 			if (++i >= argc) {
 				fprintf(stderr, "Missing required value for --unknown\n");
@@ -351,6 +550,26 @@ int parse_options(int argc, char **argv)
 		return 1;
 	}
 
+	if (OPTIONS.flush && !OPTIONS.daemon) {
+		fprintf(stderr, "--flush requires --daemon\n");
+		return 1;
+	}
+#ifndef HAVE_RRDC_FETCH
+	/* without rrdc_fetch(), flushing is all the daemon can do for us */
+	if (OPTIONS.daemon)
+		OPTIONS.flush = 1;
+#endif
+	if (!OPTIONS.every != !OPTIONS.window) {
+		fprintf(stderr, "--every and --window must be used together\n");
+		return 1;
+	}
+	if (OPTIONS.every && (OPTIONS.serve || OPTIONS.serving)) {
+		fprintf(stderr, "--every / --window cannot be used with --serve\n");
+		return 1;
+	}
+	if (OPTIONS.serve && !OPTIONS.serving)
+		return 0; /* queries will come in over the socket */
+
 	if (!OPTIONS.metric || !OPTIONS.ds) {
 		fprintf(stderr, "Missing metric:ds argument!\n");
 		return 1;
@@ -359,6 +578,8 @@ int parse_options(int argc, char **argv)
 		fprintf(stderr, "No consolidation function provided\n");
 		return 1;
 	}
+	if (OPTIONS.serving)
+		return 0; /* the server keeps its own map of metric -> RRD */
 
 	if (OPTIONS.hash) {
 		FILE *io = fopen(OPTIONS.hash, "r");
@@ -372,6 +593,7 @@ int parse_options(int argc, char **argv)
 			char *m = strchr(buf, ' ');
 			if (!m) continue;
 			*m++ = '\0';
+			m[strcspn(m, "\n")] = '\0';
 
 			if (strcmp(m, OPTIONS.metric) == 0) {
 				if (asprintf(&OPTIONS.rrdfile, "%s/%s.rrd", OPTIONS.root, buf) <= 0) {
@@ -383,6 +605,10 @@ int parse_options(int argc, char **argv)
 		}
 
 		fclose(io);
+		if (!OPTIONS.rrdfile) {
+			fprintf(stderr, "metric '%s' not found in %s\n", OPTIONS.metric, OPTIONS.hash);
+			return 1;
+		}
 
 	} else {
 		if (asprintf(&OPTIONS.rrdfile, "%s/%s", OPTIONS.root, OPTIONS.metric) <= 0) {
@@ -394,6 +620,978 @@ int parse_options(int argc, char **argv)
 	return 0;
 }
 
+/* An RRD file, mapped into memory.  The pointers all point into the
+   mapping itself, so they track updates made by rrdtool / rrdcached
+   for as long as the file stays mapped. */
+typedef struct {
+	void         *map;
+	size_t        len;
+
+	stat_head_t  *stat;
+	ds_def_t     *ds;
+	rra_def_t    *rra;
+	time_t       *last_up;
+	rra_ptr_t    *ptr;
+	rrd_value_t  *data;
+} rrd_t;
+
+int map_rrd(rrd_t *rrd, const char *file)
+{
+	memset(rrd, 0, sizeof(rrd_t));
+
+	int fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return 1;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return 1;
+	}
+
+	rrd->len = st.st_size;
+	rrd->map = mmap(NULL, rrd->len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (rrd->map == MAP_FAILED) {
+		rrd->map = NULL;
+		return 1;
+	}
+	/* we only ever touch the header and the rows in our window;
+	   don't let the kernel read ahead through the rest of the file */
+	madvise(rrd->map, rrd->len, MADV_RANDOM);
+
+	char *p = rrd->map;
+	size_t need = sizeof(stat_head_t);
+	if (rrd->len < need)
+		goto bad;
+
+	rrd->stat = (stat_head_t *)p;
+	if (memcmp(rrd->stat->cookie, RRD_COOKIE, 4) != 0
+	 || rrd->stat->float_cookie != FLOAT_COOKIE)
+		goto bad;
+
+	need += rrd->stat->ds_cnt  * sizeof(ds_def_t)
+	      + rrd->stat->rra_cnt * sizeof(rra_def_t);
+	if (rrd->len < need + sizeof(live_head_t))
+		goto bad;
+	rrd->ds  = (ds_def_t  *)(p + sizeof(stat_head_t));
+	rrd->rra = (rra_def_t *)(rrd->ds + rrd->stat->ds_cnt);
+
+	/* versions before 0003 only stored whole-second update times */
+	rrd->last_up = (time_t *)(p + need);
+	need += atoi(rrd->stat->version) >= 3 ? sizeof(live_head_t) : sizeof(time_t);
+
+	need += rrd->stat->ds_cnt * sizeof(pdp_prep_t)
+	      + rrd->stat->ds_cnt * rrd->stat->rra_cnt * sizeof(cdp_prep_t);
+	rrd->ptr = (rra_ptr_t *)(p + need);
+	need += rrd->stat->rra_cnt * sizeof(rra_ptr_t);
+	rrd->data = (rrd_value_t *)(p + need);
+
+	unsigned long i;
+	for (i = 0; i < rrd->stat->rra_cnt; i++)
+		need += rrd->rra[i].row_cnt * rrd->stat->ds_cnt * sizeof(rrd_value_t);
+	if (rrd->len < need)
+		goto bad;
+
+	return 0;
+
+bad:
+	munmap(rrd->map, rrd->len);
+	memset(rrd, 0, sizeof(rrd_t));
+	errno = EINVAL;
+	return 1;
+}
+
+void unmap_rrd(rrd_t *rrd)
+{
+	if (rrd->map)
+		munmap(rrd->map, rrd->len);
+	memset(rrd, 0, sizeof(rrd_t));
+}
+
+/* The RRA consolidation function that natively answers the
+   query; min and max are only accurate if they come from the
+   MIN / MAX RRAs, everything else works off of the averages. */
+static const char* s_native_cf(void)
+{
+	if (OPTIONS.cf == cf_min) return "MIN";
+	if (OPTIONS.cf == cf_max) return "MAX";
+	return "AVERAGE";
+}
+
+/* The coarsest step (in seconds) that the caller is willing to
+   accept, or 0 if we should use the finest RRA available. */
+static unsigned long s_step_bound(void)
+{
+	unsigned long bound = OPTIONS.resolution;
+	if (OPTIONS.error > 0.0) {
+		unsigned long e = (OPTIONS.end - OPTIONS.start) * OPTIONS.error / 100.0;
+		if (e < 1) e = 1;
+		if (!bound || e < bound) bound = e;
+	}
+	return bound;
+}
+
+/* Pick the RRA to answer the query from, preferring (in order):
+
+     1. the coarsest RRA that covers the whole window, without
+        exceeding the step bound (see s_step_bound()).
+     2. the finest RRA that covers the whole window.
+     3. the RRA that reaches furthest back into the window.
+
+   Only RRAs of the native CF are considered, unless the RRD has
+   none, in which case AVERAGE RRAs are used instead.
+
+   Returns the RRA index (or -1 if there is no suitable RRA), and
+   fills in the CF, step and oldest covered timestamp for it. */
+int pick_rra(rrd_t *rrd, const char **cf, unsigned long *step, time_t *oldest)
+{
+	unsigned long bound = s_step_bound();
+	int pass;
+	for (pass = 0; pass < 2; pass++) {
+		*cf = pass == 0 ? s_native_cf() : "AVERAGE";
+		if (pass > 0 && strcmp(*cf, s_native_cf()) == 0)
+			break;
+
+		int best = -1, rank = 0;
+		unsigned long i;
+		for (i = 0; i < rrd->stat->rra_cnt; i++) {
+			if (strncmp(rrd->rra[i].cf_nam, *cf, CF_NAM_SIZE) != 0)
+				continue;
+
+			unsigned long st = rrd->stat->pdp_step * rrd->rra[i].pdp_cnt;
+			time_t reach = *rrd->last_up - *rrd->last_up % st - rrd->rra[i].row_cnt * st;
+			int r = reach > OPTIONS.start ? 1
+			      : bound && st <= bound  ? 3 : 2;
+
+			if (best >= 0) {
+				if (r < rank) continue;
+				if (r == rank) {
+					if (r == 1 && reach >= *oldest) continue;
+					if (r == 2 && st    >= *step)   continue;
+					if (r == 3 && st    <= *step)   continue;
+				}
+			}
+			best = i; rank = r; *step = st; *oldest = reach;
+		}
+
+		if (best >= 0) {
+			if (OPTIONS.DEBUG)
+				fprintf(stderr, "using RRA #%i (%s, %lus step)\n", best, *cf, *step);
+			return best;
+		}
+		if (OPTIONS.DEBUG)
+			fprintf(stderr, "no %s RRA found in RRD file\n", *cf);
+	}
+	return -1;
+}
+
+int fetch_series(series_t *s)
+{
+	char          **ds_names;
+	unsigned long   ds_count;
+	const char     *cf = "AVERAGE";
+	int rc;
+
+	memset(s, 0, sizeof(series_t));
+	s->step = 1;
+
+	/* if we can see the RRD, use its header to pick the RRA;
+	   rrd_fetch() will choose that one if we ask for its step */
+	rrd_t rrd;
+	if (map_rrd(&rrd, OPTIONS.rrdfile) == 0) {
+		time_t oldest;
+		if (pick_rra(&rrd, &cf, &s->step, &oldest) < 0)
+			cf = "AVERAGE";
+		unmap_rrd(&rrd);
+	}
+
+#ifdef HAVE_RRDC_FETCH
+	if (OPTIONS.daemon && !OPTIONS.flush)
+		rc = rrdc_fetch(OPTIONS.rrdfile, cf, &OPTIONS.start, &OPTIONS.end, &s->step,
+				&ds_count, &ds_names, &s->raw);
+	else
+#endif
+	rc = rrd_fetch_r(OPTIONS.rrdfile, cf, &OPTIONS.start, &OPTIONS.end, &s->step,
+			&ds_count, &ds_names, &s->raw);
+	if (rc != 0) {
+		fprintf(stderr, "fetch failed!\n");
+		if (rrd_test_error()) {
+			fprintf(stderr, "rrd said: %s\n", rrd_get_error());
+		}
+		return 1;
+	}
+
+	unsigned long ds;
+	for (ds = 0; ds < ds_count; ds++)
+		if (strcmp(OPTIONS.ds, ds_names[ds]) == 0)
+			break;
+	if (ds >= ds_count) {
+		fprintf(stderr, "DS '%s' not found in RRD file\n", OPTIONS.ds);
+		return 1;
+	}
+
+	s->stride = ds_count;
+	s->run[0] = s->raw + ds;
+	s->len[0] = (OPTIONS.end - OPTIONS.start) / s->step;
+	s->first  = OPTIONS.start + s->step;
+	return 0;
+}
+
+int window_series(series_t *s, rrd_t *rrd)
+{
+	memset(s, 0, sizeof(series_t));
+
+	unsigned long ds;
+	for (ds = 0; ds < rrd->stat->ds_cnt; ds++)
+		if (strncmp(OPTIONS.ds, rrd->ds[ds].ds_nam, DS_NAM_SIZE) == 0)
+			break;
+	if (ds >= rrd->stat->ds_cnt) {
+		fprintf(stderr, "DS '%s' not found in RRD file\n", OPTIONS.ds);
+		return 1;
+	}
+
+	const char *cf;
+	time_t oldest;
+	int rra = pick_rra(rrd, &cf, &s->step, &oldest);
+	if (rra < 0) {
+		fprintf(stderr, "no suitable RRA found in RRD file\n");
+		return 1;
+	}
+
+	unsigned long i;
+	rrd_value_t *base = rrd->data;
+	for (i = 0; i < rra; i++)
+		base += rrd->rra[i].row_cnt * rrd->stat->ds_cnt;
+
+	/* rows are stamped with the end of the interval they cover;
+	   cur_row holds the most recent one, and the ring runs
+	   backwards (modulo row_cnt) from there. */
+	unsigned long rows = rrd->rra[rra].row_cnt;
+	time_t newest = *rrd->last_up - *rrd->last_up % s->step;
+	time_t first  = OPTIONS.start - OPTIONS.start % s->step + s->step;
+	time_t last   = OPTIONS.end   - OPTIONS.end   % s->step;
+	size_t slots  = last >= first ? (last - first) / s->step + 1 : 0;
+
+	s->first = first;
+	if (first <= oldest) first = oldest + s->step;
+	if (last  >  newest) last  = newest;
+	size_t n = last >= first ? (last - first) / s->step + 1 : 0;
+	s->missing = slots > n ? slots - n : 0;
+	s->lead    = n ? (first - s->first) / s->step : s->missing;
+	s->stride  = rrd->stat->ds_cnt;
+	if (n == 0)
+		return 0;
+
+	unsigned long at = (rrd->ptr[rra].cur_row + rows - (newest - first) / s->step) % rows;
+	s->run[0] = base + at * s->stride + ds;
+	s->len[0] = n;
+	if (at + n > rows) {
+		s->len[0] = rows - at;
+		s->run[1] = base + ds;
+		s->len[1] = n - s->len[0];
+	}
+	return 0;
+}
+
+int map_series(series_t *s)
+{
+	memset(s, 0, sizeof(series_t));
+
+	rrd_t rrd;
+	if (map_rrd(&rrd, OPTIONS.rrdfile) != 0) {
+		if (errno == EINVAL)
+			fprintf(stderr, "%s: not a valid RRD file (or not native to this platform)\n", OPTIONS.rrdfile);
+		else
+			fprintf(stderr, "%s: %s\n", OPTIONS.rrdfile, strerror(errno));
+		return 1;
+	}
+
+	if (window_series(s, &rrd) != 0) {
+		unmap_rrd(&rrd);
+		return 1;
+	}
+	s->map    = rrd.map;
+	s->maplen = rrd.len;
+	return 0;
+}
+
+size_t gather(series_t *s, double *set)
+{
+	size_t i, j = 0;
+	int r;
+	for (r = 0; r < 2; r++) {
+		rrd_value_t *d = s->run[r];
+		for (i = 0; i < s->len[r]; i++, d += s->stride) {
+			double v = (double)*d;
+			if (isnan(v)) {
+				if (OPTIONS.cf_arg.skip_unknown) {
+					if (OPTIONS.DEBUG)
+						fprintf(stderr, "skipping sample (--unknown=ignore)\n");
+					continue;
+				}
+
+				if (OPTIONS.DEBUG)
+					fprintf(stderr, "sample is UNKNOWN (substituting %e)\n", OPTIONS.cf_arg.unknown);
+				v = OPTIONS.cf_arg.unknown;
+			}
+
+			set[j] = v;
+			if (OPTIONS.DEBUG)
+				fprintf(stderr, "[%zu] %e (%lf)\n", j+1, set[j], set[j]);
+			j++;
+		}
+	}
+
+	/* slots that the RRA doesn't cover are as good as unknown */
+	if (!OPTIONS.cf_arg.skip_unknown)
+		for (i = 0; i < s->missing; i++)
+			set[j++] = OPTIONS.cf_arg.unknown;
+	return j;
+}
+
+void release(series_t *s)
+{
+	if (s->map)
+		munmap(s->map, s->maplen);
+	free(s->raw);
+	memset(s, 0, sizeof(series_t));
+}
+
+/* State for --every / --window: running moments (Welford) for the
+   sum / mean / variance family, and a Fenwick tree of counts over the
+   ranks of every distinct value in the range, for order statistics.
+   Both support removing values, so each slot enters and leaves the
+   window exactly once. */
+typedef struct {
+	size_t  n;
+	double  sum, mean, m2;
+
+	double *vals;     /* distinct values in the range, sorted */
+	size_t *tree;     /* 1-based Fenwick tree of counts, by rank */
+	size_t  m;        /* number of distinct values */
+	size_t  top;      /* highest power of two <= m */
+} roll_t;
+
+static void s_roll_update(roll_t *r, double v, size_t rank, int dir)
+{
+	if (dir > 0) {
+		r->n++;
+		r->sum += v;
+		double d = v - r->mean;
+		r->mean += d / r->n;
+		r->m2   += d * (v - r->mean);
+
+	} else if (r->n <= 1) {
+		r->n = 0;
+		r->sum = r->mean = r->m2 = 0.0;
+
+	} else {
+		r->n--;
+		r->sum -= v;
+		double d = v - r->mean;
+		r->mean -= d / r->n;
+		r->m2   -= d * (v - r->mean);
+	}
+
+	for (; rank <= r->m; rank += rank & -rank)
+		r->tree[rank] += dir;
+}
+
+/* the k-th smallest value (1-based) currently in the window */
+static double s_roll_kth(roll_t *r, size_t k)
+{
+	size_t pos = 0, bit;
+	for (bit = r->top; bit; bit >>= 1) {
+		if (pos + bit <= r->m && r->tree[pos + bit] < k) {
+			pos += bit;
+			k -= r->tree[pos];
+		}
+	}
+	return r->vals[pos]; /* rank pos+1, 0-based index pos */
+}
+
+/* same answers as the cf_* functions, from the running state */
+static double s_roll_value(roll_t *r)
+{
+	if (OPTIONS.cf == cf_sum)  return r->sum;
+	if (OPTIONS.cf == cf_mean) return r->n ? r->mean : 0.0;
+	if (r->n == 0)             return NAN;
+
+	if (OPTIONS.cf == cf_min)      return s_roll_kth(r, 1);
+	if (OPTIONS.cf == cf_max)      return s_roll_kth(r, r->n);
+	if (OPTIONS.cf == cf_variance) return r->m2 > 0.0 ? r->m2 / r->n : 0.0;
+	if (OPTIONS.cf == cf_stddev)   return r->m2 > 0.0 ? sqrt(r->m2 / r->n) : 0.0;
+
+	/* median / nth, following cf_nth() */
+	double p = OPTIONS.cf == cf_median ? 0.5 : OPTIONS.cf_arg.percentile;
+	double mid = r->n * p;
+	size_t at = (size_t)mid;
+	if (at >= r->n) at = r->n - 1;
+	if (fabs(floor(mid) - mid) < 0.001)
+		return (s_roll_kth(r, at + 1) + s_roll_kth(r, at + 2 > r->n ? r->n : at + 2)) / 2;
+	return s_roll_kth(r, at + 1);
+}
+
+int rolling(series_t *s)
+{
+	size_t slots = s->len[0] + s->len[1] + s->missing;
+	double *v    = calloc(slots, sizeof(double));
+	size_t *rank = calloc(slots, sizeof(size_t));
+	roll_t r;
+	memset(&r, 0, sizeof(r));
+	r.vals = calloc(slots + 1, sizeof(double));
+	r.tree = calloc(slots + 1, sizeof(size_t));
+	if (!v || !rank || !r.vals || !r.tree) {
+		perror("calloc");
+		exit(9);
+	}
+
+	/* lay every slot out in time order, substituting for
+	   unknowns, unless we are supposed to skip them entirely. */
+	size_t i, j = 0, k;
+	for (i = 0; i < s->lead; i++)
+		v[j++] = NAN;
+	for (k = 0; k < 2; k++) {
+		rrd_value_t *d = s->run[k];
+		for (i = 0; i < s->len[k]; i++, d += s->stride)
+			v[j++] = (double)*d;
+	}
+	while (j < slots)
+		v[j++] = NAN;
+	for (i = 0; i < slots; i++)
+		if (isnan(v[i]) && !OPTIONS.cf_arg.skip_unknown)
+			v[i] = OPTIONS.cf_arg.unknown;
+
+	for (i = 0; i < slots; i++)
+		if (!isnan(v[i]))
+			r.vals[r.m++] = v[i];
+	qsort(r.vals, r.m, sizeof(double), cmpd);
+	for (i = 1, j = r.m ? 1 : 0; i < r.m; i++)
+		if (r.vals[i] != r.vals[j - 1])
+			r.vals[j++] = r.vals[i];
+	r.m = j;
+	for (r.top = 1; r.top * 2 <= r.m; r.top *= 2)
+		;
+	for (i = 0; i < slots; i++)
+		if (!isnan(v[i]))
+			rank[i] = (double *)bsearch(&v[i], r.vals, r.m, sizeof(double), cmpd) - r.vals + 1;
+
+	/* slot i covers the step ending at s->first + i * s->step;
+	   the window ending at t holds the slots in (t - window, t] */
+	size_t head = 0, tail = 0;
+	time_t t;
+	for (t = OPTIONS.start + OPTIONS.window; t <= OPTIONS.end; t += OPTIONS.every) {
+		for (; head < slots && s->first + (time_t)(head * s->step) <= t; head++)
+			if (!isnan(v[head]))
+				s_roll_update(&r, v[head], rank[head], 1);
+		for (; tail < head && s->first + (time_t)(tail * s->step) <= t - (time_t)OPTIONS.window; tail++)
+			if (!isnan(v[tail]))
+				s_roll_update(&r, v[tail], rank[tail], -1);
+
+		if (OPTIONS.DEBUG)
+			fprintf(stderr, "window (%lu, %lu] has %zu samples\n",
+				t - OPTIONS.window, t, r.n);
+		printf("%lu %e\n", t, s_roll_value(&r));
+	}
+
+	free(v);
+	free(rank);
+	free(r.vals);
+	free(r.tree);
+	return 0;
+}
+
+/* In --serve mode, rrdq stays resident and answers queries sent
+   over a UNIX domain socket, one per line.  It keeps an LRU of
+   mapped RRDs, the metric -> RRD map from --hash, and a memo of
+   recent results, keyed on exactly which rows (and which version
+   of them) went into the consolidation. */
+
+#define SERVE_MAX_CLIENTS  256
+#define SERVE_MAX_ARGS      64
+#define SERVE_LINE_MAX    8192
+#define SERVE_MEMO_SLOTS  4096
+
+static uint32_t s_fnv1a(const void *buf, size_t len, uint32_t h)
+{
+	const unsigned char *p = buf;
+	while (len--) {
+		h ^= *p++;
+		h *= 16777619;
+	}
+	return h;
+}
+#define FNV_SEED 2166136261U
+
+typedef struct file {
+	struct file *chain;            /* next in hash bucket */
+	struct file *newer, *older;    /* LRU list           */
+
+	char     *path;
+	dev_t     dev;
+	ino_t     ino;
+	off_t     size;
+	uint64_t  gen;                 /* bumped on every (re-)map */
+	rrd_t     rrd;
+} file_t;
+
+typedef struct metric {
+	struct metric *chain;
+	char          *name;
+	char          *path;
+} metric_t;
+
+typedef struct {
+	uint64_t      gen;
+	rrd_value_t  *run;
+	size_t        len[2];
+	size_t        missing;
+	time_t        last_up;
+	cf_fn         cf;
+	cf_arg_t      arg;
+
+	double        value;
+} memo_t;
+
+static struct {
+	file_t   **buckets;
+	size_t     nbuckets;
+	file_t    *newest, *oldest;
+	size_t     n;
+	uint64_t   gen;
+} FILES;
+
+static struct {
+	metric_t **buckets;
+	size_t     nbuckets;
+	time_t     mtime;
+	time_t     checked;
+} METRICS;
+
+static memo_t MEMO[SERVE_MEMO_SLOTS];
+
+static struct {
+	uint64_t queries;
+	uint64_t errors;
+	uint64_t memo_hits;
+	uint64_t memo_misses;
+	uint64_t file_hits;
+	uint64_t file_misses;
+	uint64_t file_evictions;
+	uint64_t ns_total;
+	uint64_t ns_max;
+} STATS;
+
+static void s_unlink_file(file_t *f)
+{
+	if (f->newer) f->newer->older = f->older; else FILES.newest = f->older;
+	if (f->older) f->older->newer = f->newer; else FILES.oldest = f->newer;
+	f->newer = f->older = NULL;
+}
+
+static void s_touch_file(file_t *f)
+{
+	f->older = FILES.newest;
+	f->newer = NULL;
+	if (FILES.newest) FILES.newest->newer = f;
+	FILES.newest = f;
+	if (!FILES.oldest) FILES.oldest = f;
+}
+
+static void s_evict_file(file_t *f)
+{
+	file_t **fp = &FILES.buckets[s_fnv1a(f->path, strlen(f->path), FNV_SEED) % FILES.nbuckets];
+	while (*fp != f)
+		fp = &(*fp)->chain;
+	*fp = f->chain;
+
+	s_unlink_file(f);
+	unmap_rrd(&f->rrd);
+	free(f->path);
+	free(f);
+	FILES.n--;
+	STATS.file_evictions++;
+}
+
+/* Look up (mapping if necessary) an RRD by path.  A cached mapping
+   is only reused if the file on disk is still the same file, at the
+   same size; rrdtool updates RRDs in place, but tune / resize /
+   restore replace them wholesale. */
+static file_t* s_file(const char *path)
+{
+	struct stat st;
+	if (stat(path, &st) != 0)
+		return NULL;
+
+	uint32_t h = s_fnv1a(path, strlen(path), FNV_SEED) % FILES.nbuckets;
+	file_t *f;
+	for (f = FILES.buckets[h]; f; f = f->chain)
+		if (strcmp(f->path, path) == 0)
+			break;
+
+	if (f && f->dev == st.st_dev && f->ino == st.st_ino && f->size == st.st_size) {
+		STATS.file_hits++;
+		s_unlink_file(f);
+		s_touch_file(f);
+		return f;
+	}
+
+	STATS.file_misses++;
+	if (f)
+		s_evict_file(f);
+	while (FILES.n >= OPTIONS.cache && FILES.oldest)
+		s_evict_file(FILES.oldest);
+
+	f = calloc(1, sizeof(file_t));
+	if (!f)
+		return NULL;
+	if (map_rrd(&f->rrd, path) != 0) {
+		free(f);
+		return NULL;
+	}
+	f->path = strdup(path);
+	f->dev  = st.st_dev;
+	f->ino  = st.st_ino;
+	f->size = st.st_size;
+	f->gen  = ++FILES.gen;
+
+	f->chain = FILES.buckets[h];
+	FILES.buckets[h] = f;
+	s_touch_file(f);
+	FILES.n++;
+	return f;
+}
+
+static void s_free_metrics(void)
+{
+	size_t i;
+	for (i = 0; i < METRICS.nbuckets; i++) {
+		metric_t *m, *next;
+		for (m = METRICS.buckets[i]; m; m = next) {
+			next = m->chain;
+			free(m->name);
+			free(m->path);
+			free(m);
+		}
+		METRICS.buckets[i] = NULL;
+	}
+}
+
+/* (re-)load the --hash map, if it has changed since we last read it;
+   we check at most once a second, since bolo2rrd rarely rewrites it. */
+static int s_load_metrics(void)
+{
+	time_t now = time(NULL);
+	if (METRICS.checked == now)
+		return 0;
+	METRICS.checked = now;
+
+	struct stat st;
+	if (stat(OPTIONS.hash, &st) != 0)
+		return 1;
+	if (st.st_mtime == METRICS.mtime)
+		return 0;
+
+	FILE *io = fopen(OPTIONS.hash, "r");
+	if (!io)
+		return 1;
+
+	s_free_metrics();
+	char buf[8192];
+	while (fgets(buf, 8192, io)) {
+		char *m = strchr(buf, ' ');
+		if (!m) continue;
+		*m++ = '\0';
+		m[strcspn(m, "\n")] = '\0';
+
+		metric_t *metric = calloc(1, sizeof(metric_t));
+		if (!metric)
+			break;
+		metric->name = strdup(m);
+		if (asprintf(&metric->path, "%s/%s.rrd", OPTIONS.root, buf) <= 0) {
+			free(metric->name);
+			free(metric);
+			break;
+		}
+
+		uint32_t h = s_fnv1a(m, strlen(m), FNV_SEED) % METRICS.nbuckets;
+		metric->chain = METRICS.buckets[h];
+		METRICS.buckets[h] = metric;
+	}
+	fclose(io);
+
+	METRICS.mtime = st.st_mtime;
+	return 0;
+}
+
+static const char* s_metric_path(const char *metric)
+{
+	static char *path = NULL;
+
+	if (!OPTIONS.hash) {
+		free(path);
+		if (asprintf(&path, "%s/%s", OPTIONS.root, metric) <= 0)
+			path = NULL;
+		return path;
+	}
+
+	if (s_load_metrics() != 0)
+		return NULL;
+
+	metric_t *m;
+	uint32_t h = s_fnv1a(metric, strlen(metric), FNV_SEED) % METRICS.nbuckets;
+	for (m = METRICS.buckets[h]; m; m = m->chain)
+		if (strcmp(m->name, metric) == 0)
+			return m->path;
+	return NULL;
+}
+
+static uint64_t s_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/* Answer one query line, writing the response line into out. */
+static void s_query(char *line, char *out, size_t len)
+{
+	static double *set    = NULL;
+	static size_t  setlen = 0;
+
+	if (strcmp(line, "stats") == 0) {
+		uint64_t lookups = STATS.memo_hits + STATS.memo_misses;
+		snprintf(out, len, "queries=%lu errors=%lu"
+		                   " memo.hits=%lu memo.misses=%lu"
+		                   " files.open=%zu files.hits=%lu files.misses=%lu files.evictions=%lu"
+		                   " memo.ratio=%0.4f latency.avg.us=%0.3f latency.max.us=%0.3f\n",
+		                   STATS.queries, STATS.errors,
+		                   STATS.memo_hits, STATS.memo_misses,
+		                   FILES.n, STATS.file_hits, STATS.file_misses, STATS.file_evictions,
+		                   lookups ? (double)STATS.memo_hits / lookups : 0.0,
+		                   STATS.queries ? STATS.ns_total / 1000.0 / STATS.queries : 0.0,
+		                   STATS.ns_max / 1000.0);
+		return;
+	}
+
+	uint64_t began = s_ns();
+	STATS.queries++;
+
+	int argc = 1;
+	char *argv[SERVE_MAX_ARGS + 1] = { "rrdq" };
+	char *tok, *ctx = NULL;
+	for (tok = strtok_r(line, " \t\r", &ctx); tok && argc < SERVE_MAX_ARGS; tok = strtok_r(NULL, " \t\r", &ctx))
+		argv[argc++] = tok;
+	argv[argc] = NULL;
+
+	/* each query starts from the server's own options; nothing
+	   carries over from the last one (the server-only flags can't
+	   be changed by a query, so the strings in SERVER are safe) */
+	free(OPTIONS.metric);
+	free(OPTIONS.ds);
+	OPTIONS = SERVER;
+
+	const char *path;
+	file_t *f;
+	series_t s;
+	if (parse_options(argc, argv) != 0 || OPTIONS.end <= OPTIONS.start) {
+		snprintf(out, len, "ERROR bad query\n");
+		goto fail;
+	}
+	if (!(path = s_metric_path(OPTIONS.metric))) {
+		snprintf(out, len, "ERROR metric '%s' not found\n", OPTIONS.metric);
+		goto fail;
+	}
+	if (OPTIONS.daemon && rrdc_flush(path) != 0) {
+		snprintf(out, len, "ERROR failed to flush %s through rrdcached\n", path);
+		goto fail;
+	}
+	if (!(f = s_file(path))) {
+		snprintf(out, len, "ERROR %s: %s\n", path, errno == EINVAL ? "not a valid RRD file" : strerror(errno));
+		goto fail;
+	}
+	if (window_series(&s, &f->rrd) != 0) {
+		snprintf(out, len, "ERROR no data for %s:%s\n", OPTIONS.metric, OPTIONS.ds);
+		goto fail;
+	}
+
+	memo_t key;
+	memset(&key, 0, sizeof(key));
+	key.gen     = f->gen;
+	key.run     = s.run[0];
+	key.len[0]  = s.len[0];
+	key.len[1]  = s.len[1];
+	key.missing = s.missing;
+	key.last_up = *f->rrd.last_up;
+	key.cf      = OPTIONS.cf;
+	key.arg     = OPTIONS.cf_arg;
+
+	memo_t *memo = &MEMO[s_fnv1a(&key, offsetof(memo_t, value), FNV_SEED) % SERVE_MEMO_SLOTS];
+	if (memcmp(memo, &key, offsetof(memo_t, value)) == 0) {
+		STATS.memo_hits++;
+		key.value = memo->value;
+
+	} else {
+		STATS.memo_misses++;
+		size_t need = s.len[0] + s.len[1] + s.missing;
+		if (need > setlen) {
+			double *re = realloc(set, need * sizeof(double));
+			if (!re) {
+				snprintf(out, len, "ERROR out of memory\n");
+				goto fail;
+			}
+			set = re; setlen = need;
+		}
+		key.value = (*OPTIONS.cf)(gather(&s, set), set, &OPTIONS.cf_arg);
+		memcpy(memo, &key, sizeof(memo_t));
+	}
+
+	snprintf(out, len, "%e\n", key.value);
+	goto done;
+
+fail:
+	STATS.errors++;
+done:
+	began = s_ns() - began;
+	STATS.ns_total += began;
+	if (began > STATS.ns_max)
+		STATS.ns_max = began;
+}
+
+typedef struct {
+	int    fd;
+	size_t used;
+	char   buf[SERVE_LINE_MAX];
+} client_t;
+
+/* Consume whatever complete lines the client has sent us, and
+   send back all of the answers in one go. */
+static int s_client(client_t *c)
+{
+	ssize_t n = read(c->fd, c->buf + c->used, SERVE_LINE_MAX - c->used);
+	if (n <= 0)
+		return 1;
+	c->used += n;
+
+	char out[SERVE_LINE_MAX * 2];
+	size_t olen = 0;
+	char *line = c->buf, *nl;
+	while ((nl = memchr(line, '\n', c->used - (line - c->buf))) != NULL) {
+		*nl = '\0';
+		s_query(line, out + olen, sizeof(out) - olen);
+		olen += strlen(out + olen);
+		line = nl + 1;
+
+		if (sizeof(out) - olen < 512) {
+			if (send(c->fd, out, olen, MSG_NOSIGNAL) != olen)
+				return 1;
+			olen = 0;
+		}
+	}
+	if (olen && send(c->fd, out, olen, MSG_NOSIGNAL) != olen)
+		return 1;
+
+	c->used -= line - c->buf;
+	memmove(c->buf, line, c->used);
+	if (c->used == SERVE_LINE_MAX)
+		return 1; /* line too long; drop the client */
+	return 0;
+}
+
+int serve(const char *address)
+{
+	if (strncmp(address, "unix:", 5) == 0)
+		address += 5;
+
+	struct sockaddr_un sa;
+	if (strlen(address) >= sizeof(sa.sun_path)) {
+		fprintf(stderr, "socket path %s is too long\n", address);
+		return 1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path, address, sizeof(sa.sun_path) - 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return 1;
+	}
+	unlink(address);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(fd, 64) != 0) {
+		fprintf(stderr, "%s: %s\n", address, strerror(errno));
+		close(fd);
+		return 1;
+	}
+
+	if (!OPTIONS.cache)
+		OPTIONS.cache = 256;
+	FILES.nbuckets = OPTIONS.cache * 2 + 1;
+	FILES.buckets  = calloc(FILES.nbuckets, sizeof(file_t *));
+	METRICS.nbuckets = 16381;
+	METRICS.buckets  = calloc(METRICS.nbuckets, sizeof(metric_t *));
+	if (!FILES.buckets || !METRICS.buckets) {
+		perror("calloc");
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	OPTIONS.serving = 1;
+
+	/* queries don't get a default metric, cf or time range */
+	SERVER = OPTIONS;
+	SERVER.metric = SERVER.ds = NULL;
+	SERVER.cf     = NULL;
+	SERVER.start  = SERVER.end = 0;
+	SERVER.cf_arg.skip_unknown = 1;
+	SERVER.cf_arg.unknown      = 0.0;
+	SERVER.cf_arg.percentile   = 0.0;
+
+	struct pollfd pfd[SERVE_MAX_CLIENTS + 1];
+	client_t *clients[SERVE_MAX_CLIENTS + 1] = { NULL };
+	nfds_t i, nfds = 1;
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+
+	for (;;) {
+		if (poll(pfd, nfds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return 1;
+		}
+
+		for (i = 1; i < nfds; i++) {
+			if (!pfd[i].revents)
+				continue;
+			if (s_client(clients[i]) != 0) {
+				close(pfd[i].fd);
+				free(clients[i]);
+				nfds--;
+				pfd[i] = pfd[nfds];
+				clients[i] = clients[nfds];
+				i--;
+			}
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			int cfd = accept(fd, NULL, NULL);
+			if (cfd < 0)
+				continue;
+			if (nfds > SERVE_MAX_CLIENTS || !(clients[nfds] = calloc(1, sizeof(client_t)))) {
+				close(cfd);
+				continue;
+			}
+			clients[nfds]->fd = cfd;
+			pfd[nfds].fd = cfd;
+			pfd[nfds].events = POLLIN;
+			pfd[nfds].revents = 0;
+			nfds++;
+		}
+	}
+}
+
 double cf_min(size_t n, double *set, cf_arg_t *arg)
 {
 	if (n == 0) return NAN;
@@ -436,7 +1634,8 @@ double cf_mean(size_t n, double *set, cf_arg_t *arg)
 
 static int cmpd(const void *a, const void *b)
 {
-	return *(double * const)a - *(double * const)b;
+	double x = *(double * const)a, y = *(double * const)b;
+	return x < y ? -1 : x > y ? 1 : 0;
 }
 double cf_median(size_t n, double *set, cf_arg_t *arg)
 {
@@ -0,0 +1,856 @@
+#include "common.h"
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/* SNMPv2c, just enough of it to GETBULK our way down the
+   interface tables of a lot of devices at once */
+
+#define T_INTEGER        0x02
+#define T_STRING         0x04
+#define T_NULL           0x05
+#define T_OID            0x06
+#define T_SEQUENCE       0x30
+#define T_COUNTER32      0x41
+#define T_GAUGE32        0x42
+#define T_TIMETICKS      0x43
+#define T_COUNTER64      0x46
+#define T_ENDOFMIBVIEW   0x82
+#define T_RESPONSE       0xa2
+#define T_GETBULK        0xa5
+
+#define E_TOOBIG 1
+
+#define OID_MAX    32
+#define TEXT_MAX   128
+#define PACKET_MAX 65536
+#define TARGET_MAX (1 << 20)  /* the low 20 bits of the request id */
+
+static const uint32_t SYS_NAME[]  = { 1,3,6,1,2,1,1,5 };       /* .0 */
+static const uint32_t IF_ENTRY[]  = { 1,3,6,1,2,1,2,2,1 };
+static const uint32_t IFX_ENTRY[] = { 1,3,6,1,2,1,31,1,1,1 };
+
+enum {
+	C_DESCR,
+	C_SPEED,
+	C_ADMIN,
+	C_OPER,
+	C_IN_DISCARDS,
+	C_IN_ERRORS,
+	C_OUT_DISCARDS,
+	C_OUT_ERRORS,
+	C_NAME,
+	C_HC_IN_OCTETS,
+	C_HC_OUT_OCTETS,
+	C_CONNECTOR,
+	C_ALIAS,
+	NCOLUMNS
+};
+
+static const struct {
+	int      x;     /* in ifXEntry, rather than ifEntry */
+	uint32_t n;     /* column number */
+	int      text;  /* 1-based slot in row_t.text, or 0 for numbers */
+} COLUMNS[NCOLUMNS] = {
+	[C_DESCR]         = { 0,  2, 1 },
+	[C_SPEED]         = { 0,  5, 0 },
+	[C_ADMIN]         = { 0,  7, 0 },
+	[C_OPER]          = { 0,  8, 0 },
+	[C_IN_DISCARDS]   = { 0, 13, 0 },
+	[C_IN_ERRORS]     = { 0, 14, 0 },
+	[C_OUT_DISCARDS]  = { 0, 19, 0 },
+	[C_OUT_ERRORS]    = { 0, 20, 0 },
+	[C_NAME]          = { 1,  1, 2 },
+	[C_HC_IN_OCTETS]  = { 1,  6, 0 },
+	[C_HC_OUT_OCTETS] = { 1, 10, 0 },
+	[C_CONNECTOR]     = { 1, 17, 0 },
+	[C_ALIAS]         = { 1, 18, 3 },
+};
+
+#define BIT(c) (1u << (c))
+
+/* what snmp_ifaces walks, and what snmp_cisco_ifaces gets */
+#define IFACES_COLUMNS (BIT(C_ADMIN) | BIT(C_OPER) | BIT(C_NAME) \
+                      | BIT(C_IN_DISCARDS)  | BIT(C_IN_ERRORS) \
+                      | BIT(C_OUT_DISCARDS) | BIT(C_OUT_ERRORS) \
+                      | BIT(C_HC_IN_OCTETS) | BIT(C_HC_OUT_OCTETS))
+#define CISCO_COLUMNS ((1u << NCOLUMNS) - 1)
+
+typedef struct {
+	uint32_t index;
+	uint32_t have;  /* bitmask of COLUMNS we've got a value for */
+	uint64_t v[NCOLUMNS];
+	char     text[3][TEXT_MAX];
+} row_t;
+
+#define S_PENDING 0
+#define S_ACTIVE  1
+#define S_DONE    2
+
+typedef struct {
+	char     *host;
+	char     *community;
+	char     *desc;      /* snmp_cisco_ifaces-style, or NULL */
+	uint32_t *only;      /* cisco: just these ifIndexes (if any) */
+	int       nonly;
+
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+
+	int       state;
+	int32_t   reqid;
+	int       seq;
+	int       tries;
+	int64_t   deadline;
+	int       reps;
+
+	int       sysname;   /* still need to ask for it? */
+	char      name[TEXT_MAX];
+
+	uint32_t  walking;   /* bitmask of columns not yet walked off the end of */
+	uint32_t  cursor[NCOLUMNS];
+	int       asked[NCOLUMNS];
+	int       nasked;
+
+	row_t    *rows;
+	int       nrows, cap;
+} target_t;
+
+static struct {
+	int       window;
+	int       reps;
+	int       timeout;
+	int       retries;
+
+	target_t *targets;
+	int       ntargets;
+} OPTIONS = {
+	.window  = 64,
+	.reps    = 10,
+	.timeout = 2000,
+	.retries = 2,
+};
+
+/*********************************************************************/
+
+/* requests are built back to front, so that every length is
+   known by the time we need to write it down */
+typedef struct {
+	uint8_t *p, *end;
+} ber_t;
+
+static void b_len(ber_t *b, size_t len)
+{
+	if (len < 0x80) {
+		*--b->p = len;
+		return;
+	}
+	int n = 0;
+	while (len) {
+		*--b->p = len & 0xff;
+		len >>= 8;
+		n++;
+	}
+	*--b->p = 0x80 | n;
+}
+
+static void b_hdr(ber_t *b, uint8_t tag, const uint8_t *from)
+{
+	b_len(b, from - b->p);
+	*--b->p = tag;
+}
+
+static void b_int(ber_t *b, uint32_t v)
+{
+	const uint8_t *from = b->p;
+	do {
+		*--b->p = v & 0xff;
+		v >>= 8;
+	} while (v);
+	if (*b->p & 0x80)
+		*--b->p = 0;
+	b_hdr(b, T_INTEGER, from);
+}
+
+static void b_subid(ber_t *b, uint32_t v)
+{
+	*--b->p = v & 0x7f;
+	for (v >>= 7; v; v >>= 7)
+		*--b->p = 0x80 | (v & 0x7f);
+}
+
+/* a varbind of base.n[.index], with a NULL value */
+static void b_varbind(ber_t *b, const uint32_t *base, int len, uint32_t n, uint32_t index)
+{
+	const uint8_t *vb = b->p, *oid;
+	*--b->p = 0;
+	*--b->p = T_NULL;
+
+	oid = b->p;
+	if (index)
+		b_subid(b, index);
+	if (n)
+		b_subid(b, n);
+	int i;
+	for (i = len - 1; i >= 2; i--)
+		b_subid(b, base[i]);
+	b_subid(b, base[0] * 40 + base[1]);
+	b_hdr(b, T_OID, oid);
+
+	b_hdr(b, T_SEQUENCE, vb);
+}
+
+/*********************************************************************/
+
+/* the next TLV in [*p, end); 0 on success */
+static int s_tlv(const uint8_t **p, const uint8_t *end, uint8_t *tag, const uint8_t **v, size_t *len)
+{
+	const uint8_t *q = *p;
+	if (end - q < 2)
+		return 1;
+
+	*tag = *q++;
+	*len = *q++;
+	if (*len & 0x80) {
+		int n = *len & 0x7f;
+		if (n < 1 || n > 4 || end - q < n)
+			return 1;
+		for (*len = 0; n; n--)
+			*len = (*len << 8) | *q++;
+	}
+	if ((size_t)(end - q) < *len)
+		return 1;
+
+	*v = q;
+	*p = q + *len;
+	return 0;
+}
+
+static uint64_t s_uint(const uint8_t *v, size_t len)
+{
+	uint64_t x = 0;
+	while (len--)
+		x = (x << 8) | *v++;
+	return x;
+}
+
+static int32_t s_int(const uint8_t *v, size_t len)
+{
+	int32_t x = len && (*v & 0x80) ? -1 : 0;
+	while (len--)
+		x = (int32_t)((uint32_t)x << 8) | *v++;
+	return x;
+}
+
+/* decode an OID into oid[]; the number of subids, or -1 */
+static int s_oid(const uint8_t *v, size_t len, uint32_t *oid)
+{
+	int n = 0;
+	uint32_t x = 0;
+	while (len--) {
+		x = (x << 7) | (*v & 0x7f);
+		if (*v++ & 0x80)
+			continue;
+
+		if (n == 0) {
+			oid[n++] = x < 80 ? x / 40 : 2;
+			oid[n++] = x - oid[0] * 40;
+		} else {
+			if (n == OID_MAX)
+				return -1;
+			oid[n++] = x;
+		}
+		x = 0;
+	}
+	return n;
+}
+
+static int s_under(const uint32_t *oid, int n, const uint32_t *base, int len)
+{
+	return n > len && memcmp(oid, base, len * sizeof(uint32_t)) == 0;
+}
+
+/*********************************************************************/
+
+static row_t* s_row(target_t *t, uint32_t index)
+{
+	/* binary search; rows mostly show up in order, though, so
+	   check the end first */
+	int lo = 0, hi = t->nrows;
+	if (hi && t->rows[hi - 1].index < index) {
+		lo = hi;
+	} else {
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (t->rows[mid].index < index) lo = mid + 1;
+			else                            hi = mid;
+		}
+		if (lo < t->nrows && t->rows[lo].index == index)
+			return &t->rows[lo];
+	}
+
+	if (t->nrows == t->cap) {
+		t->cap = t->cap ? t->cap * 2 : 64;
+		t->rows = realloc(t->rows, t->cap * sizeof(row_t));
+	}
+	memmove(&t->rows[lo + 1], &t->rows[lo], (t->nrows - lo) * sizeof(row_t));
+	t->nrows++;
+
+	row_t *r = &t->rows[lo];
+	r->index = index;
+	r->have  = 0;
+	r->text[0][0] = r->text[1][0] = r->text[2][0] = '\0';
+	return r;
+}
+
+static void s_send(int fd, target_t *t)
+{
+	static uint8_t buf[PACKET_MAX];
+	ber_t b = { .p = buf + sizeof(buf), .end = buf + sizeof(buf) };
+	int i;
+
+	/* sysName (as a non-repeater) the first time, and then
+	   every column we're still walking */
+	t->nasked = 0;
+	for (i = 0; i < NCOLUMNS; i++)
+		if (t->walking & BIT(i))
+			t->asked[t->nasked++] = i;
+
+	for (i = t->nasked - 1; i >= 0; i--) {
+		int c = t->asked[i];
+		if (COLUMNS[c].x) b_varbind(&b, IFX_ENTRY, sizeof(IFX_ENTRY) / sizeof(uint32_t), COLUMNS[c].n, t->cursor[c]);
+		else              b_varbind(&b, IF_ENTRY,  sizeof(IF_ENTRY)  / sizeof(uint32_t), COLUMNS[c].n, t->cursor[c]);
+	}
+	if (t->sysname)
+		b_varbind(&b, SYS_NAME, sizeof(SYS_NAME) / sizeof(uint32_t), 0, 0);
+	b_hdr(&b, T_SEQUENCE, b.end);
+
+	/* a new request id for every attempt, so that late answers
+	   to the last one don't get counted twice */
+	t->seq = (t->seq + 1) & 0x7ff;
+	t->reqid = (t->seq << 20) | (int32_t)(t - OPTIONS.targets);
+
+	b_int(&b, t->reps);
+	b_int(&b, t->sysname ? 1 : 0);
+	b_int(&b, t->reqid);
+	b_hdr(&b, T_GETBULK, b.end);
+
+	const uint8_t *from = b.p;
+	size_t n = strlen(t->community);
+	b.p -= n;
+	memcpy(b.p, t->community, n);
+	b_hdr(&b, T_STRING, from);
+	b_int(&b, 1); /* v2c */
+	b_hdr(&b, T_SEQUENCE, b.end);
+
+	t->deadline = time_ms() + OPTIONS.timeout;
+	if (sendto(fd, b.p, b.end - b.p, 0, (struct sockaddr *)&t->addr, t->addrlen) < 0) {
+		/* the retry will take care of it */
+		fprintf(stderr, "%s: sendto failed: %s\n", t->host, strerror(errno));
+	}
+}
+
+/*********************************************************************/
+
+static void s_print(const row_t *r, int c)
+{
+	if (r->have & BIT(c))
+		printf("%lu", r->v[c]);
+}
+
+static void s_rate(const char *prefix, const char *metric, const char *ifname, const row_t *r, int c)
+{
+	/* RATE doesn't report values it wasn't given */
+	if (r->have & BIT(c))
+		printf("RATE %i %s:%s:%s %lu\n", time_s(), prefix, metric, ifname, r->v[c]);
+}
+
+static void s_status(const char *prefix, const char *ns, const char *ifname, const row_t *r)
+{
+	uint64_t oper  = r->v[C_OPER];
+	uint64_t admin = r->v[C_ADMIN];
+
+	printf("STATE %i %s:%s:%s ", time_s(), prefix, ns, ifname);
+	if (!(r->have & BIT(C_OPER)) || !(r->have & BIT(C_ADMIN))) {
+		printf("UNKNOWN %s is oper(", ifname);
+		s_print(r, C_OPER);
+		printf(") / admin(");
+		s_print(r, C_ADMIN);
+		printf(")\n");
+
+	} else if (admin == 3) {
+		printf("OK %s is configured for TEST mode\n", ifname);
+
+	} else if (oper == 3) {
+		printf("WARNING %s is in TEST mode\n", ifname);
+
+	} else if (oper == admin) {
+		printf("OK No operational / administrative issues with %s interface status\n", ifname);
+
+	} else if (oper == 2 && admin == 1) {
+		printf("CRITICAL %s is DOWN, but is configured to be up\n", ifname);
+
+	} else if (oper == 1 && admin == 2) {
+		printf("WARNING %s is UP, but is configured to be down\n", ifname);
+
+	} else {
+		printf("UNKNOWN %s is oper(%lu) / admin(%lu)\n", ifname, oper, admin);
+	}
+}
+
+static void s_keys(const char *prefix, const char *ns, const char *ifname, const row_t *r)
+{
+	printf("KEY %i %s:%s.status.oper:%s=", time_s(), prefix, ns, ifname);
+	s_print(r, C_OPER);
+	printf("\n");
+	printf("KEY %i %s:%s.status.admin:%s=", time_s(), prefix, ns, ifname);
+	s_print(r, C_ADMIN);
+	printf("\n");
+}
+
+/* the same metrics snmp_ifaces reports */
+static void s_report_ifaces(target_t *t)
+{
+	if (t->sysname || !t->name[0]) {
+		fprintf(stderr, "%s: no sysName\n", t->host);
+		return;
+	}
+	printf("KEY %i %s:snmp.sysName=%s\n", time_s(), t->host, t->name);
+
+	int i;
+	for (i = 0; i < t->nrows; i++) {
+		row_t *r = &t->rows[i];
+		if (!(r->have & BIT(C_NAME)))
+			continue; /* no ifXEntry for it */
+
+		const char *ifname = r->text[COLUMNS[C_NAME].text - 1];
+		s_keys(t->name, "snmp.iface", ifname, r);
+		s_rate(t->name, "snmp.iface:octets.in",    ifname, r, C_HC_IN_OCTETS);
+		s_rate(t->name, "snmp.iface:octets.out",   ifname, r, C_HC_OUT_OCTETS);
+		s_rate(t->name, "snmp.iface:errors.in",    ifname, r, C_IN_ERRORS);
+		s_rate(t->name, "snmp.iface:errors.out",   ifname, r, C_OUT_ERRORS);
+		s_rate(t->name, "snmp.iface:discards.in",  ifname, r, C_IN_DISCARDS);
+		s_rate(t->name, "snmp.iface:discards.out", ifname, r, C_OUT_DISCARDS);
+		s_status(t->name, "snmp.iface", ifname, r);
+	}
+}
+
+/* ... and the ones snmp_cisco_ifaces does */
+static void s_report_cisco(target_t *t)
+{
+	int i, j;
+	for (i = 0; i < t->nrows; i++) {
+		row_t *r = &t->rows[i];
+		if (t->nonly) {
+			for (j = 0; j < t->nonly && t->only[j] != r->index; j++)
+				;
+			if (j == t->nonly)
+				continue;
+		}
+		if (!(r->have & BIT(C_NAME)))
+			continue;
+
+		/* ifName-ifAlias, with the alias made safe for metric names */
+		char ifname[2 * TEXT_MAX + 2], *p;
+		const char *a = r->text[COLUMNS[C_ALIAS].text - 1];
+		p = ifname + snprintf(ifname, TEXT_MAX + 1, "%s-", r->text[COLUMNS[C_NAME].text - 1]);
+		while (*a) {
+			if (strchr(" \t#^\n@&$%", *a)) {
+				while (*a && strchr(" \t#^\n@&$%", *a)) a++;
+				*p++ = '_';
+			} else {
+				*p++ = *a++;
+			}
+		}
+		*p = '\0';
+
+		s_keys(t->desc, "snmp.cisco.iface", ifname, r);
+		s_rate(t->desc, "snmp.cisco.iface:octets.in",  ifname, r, C_HC_IN_OCTETS);
+		s_rate(t->desc, "snmp.cisco.iface:octets.out", ifname, r, C_HC_OUT_OCTETS);
+		if (r->v[C_SPEED]) {
+			printf("RATE %i %s:snmp.cisco.iface:util.in:%s %lu\n",  time_s(), t->desc, ifname,
+				(uint64_t)(r->v[C_HC_IN_OCTETS]  * 8.0 / r->v[C_SPEED]));
+			printf("RATE %i %s:snmp.cisco.iface:util.out:%s %lu\n", time_s(), t->desc, ifname,
+				(uint64_t)(r->v[C_HC_OUT_OCTETS] * 8.0 / r->v[C_SPEED]));
+		}
+		s_rate(t->desc, "snmp.cisco.iface:errors.in",    ifname, r, C_IN_ERRORS);
+		s_rate(t->desc, "snmp.cisco.iface:errors.out",   ifname, r, C_OUT_ERRORS);
+		s_rate(t->desc, "snmp.cisco.iface:discards.in",  ifname, r, C_IN_DISCARDS);
+		s_rate(t->desc, "snmp.cisco.iface:discards.out", ifname, r, C_OUT_DISCARDS);
+
+		const char *descr = r->text[COLUMNS[C_DESCR].text - 1];
+		if ((!(r->have & BIT(C_CONNECTOR)) || r->v[C_CONNECTOR] != 1)
+		 && !strstr(descr, "vlan") && !strstr(descr, "Vlan")) {
+			printf("STATE %i %s:snmp.cisco.iface:%s CRITICAL no connector present for %s\n",
+				time_s(), t->desc, ifname, ifname);
+		} else {
+			s_status(t->desc, "snmp.cisco.iface", ifname, r);
+		}
+	}
+}
+
+static void s_done(target_t *t, const char *error, int *active)
+{
+	if (error) {
+		if (t->desc) printf("STATE %i %s CRITICAL error fetching snmp for %s: %s\n", time_s(), t->desc, t->desc, error);
+		else         fprintf(stderr, "%s: %s\n", t->host, error);
+
+	} else if (t->desc) {
+		s_report_cisco(t);
+	} else {
+		s_report_ifaces(t);
+	}
+
+	free(t->rows);
+	t->rows  = NULL;
+	t->nrows = t->cap = 0;
+	t->state = S_DONE;
+	(*active)--;
+}
+
+/* one response; everything points into the packet, and only the
+   values we want get copied out of it (into the target's rows) */
+static void s_response(int fd, const uint8_t *buf, size_t len, const struct sockaddr_storage *from, socklen_t fromlen, int *active)
+{
+	const uint8_t *p = buf, *end = buf + len, *v, *msg, *pdu, *vbs;
+	uint8_t tag;
+	size_t n;
+
+	if (s_tlv(&p, end, &tag, &msg, &n) || tag != T_SEQUENCE) return;
+	end = msg + n; p = msg;
+	if (s_tlv(&p, end, &tag, &v, &n) || tag != T_INTEGER) return; /* version */
+	if (s_tlv(&p, end, &tag, &v, &n) || tag != T_STRING)  return; /* community */
+	if (s_tlv(&p, end, &tag, &pdu, &n) || tag != T_RESPONSE) return;
+	end = pdu + n; p = pdu;
+
+	if (s_tlv(&p, end, &tag, &v, &n) || tag != T_INTEGER) return;
+	int32_t reqid = s_int(v, n);
+	int idx = reqid & (TARGET_MAX - 1);
+	if (reqid < 0 || idx >= OPTIONS.ntargets)
+		return;
+	target_t *t = &OPTIONS.targets[idx];
+	if (t->state != S_ACTIVE || t->reqid != reqid
+	 || t->addrlen != fromlen || memcmp(&t->addr, from, fromlen) != 0)
+		return; /* not for us, or too late */
+
+	if (s_tlv(&p, end, &tag, &v, &n) || tag != T_INTEGER) return;
+	int32_t error = s_int(v, n);
+	if (s_tlv(&p, end, &tag, &v, &n) || tag != T_INTEGER) return;
+	if (error == E_TOOBIG && t->reps > 1) {
+		t->reps /= 2;
+		t->tries = 0;
+		s_send(fd, t);
+		return;
+	}
+	if (error) {
+		char *s = string("error-status %i", error);
+		s_done(t, s, active);
+		free(s);
+		return;
+	}
+
+	if (s_tlv(&p, end, &tag, &vbs, &n) || tag != T_SEQUENCE) return;
+	end = vbs + n; p = vbs;
+
+	uint32_t oid[OID_MAX], done = 0;
+	int i, nonrep = t->sysname ? 1 : 0;
+	for (i = 0; p < end; i++) {
+		const uint8_t *vb, *q;
+		if (s_tlv(&p, end, &tag, &vb, &n) || tag != T_SEQUENCE) return;
+		const uint8_t *vbend = vb + n;
+		q = vb;
+		if (s_tlv(&q, vbend, &tag, &v, &n) || tag != T_OID) return;
+		int len = s_oid(v, n, oid);
+		if (s_tlv(&q, vbend, &tag, &v, &n)) return;
+
+		if (i < nonrep) {
+			if (tag == T_STRING && s_under(oid, len, SYS_NAME, sizeof(SYS_NAME) / sizeof(uint32_t))) {
+				size_t k, m = MIN(n, TEXT_MAX - 1);
+				for (k = 0; k < m; k++)
+					t->name[k] = tolower(v[k]);
+				t->name[m] = '\0';
+			}
+			t->sysname = 0;
+			continue;
+		}
+		if (!t->nasked)
+			break;
+
+		int c = t->asked[(i - nonrep) % t->nasked];
+		if (done & BIT(c))
+			continue;
+
+		/* off the end of this column (into the next one, or of the
+		   whole MIB), or something we can't make sense of */
+		const uint32_t *base = COLUMNS[c].x ? IFX_ENTRY : IF_ENTRY;
+		int blen = COLUMNS[c].x ? sizeof(IFX_ENTRY) / sizeof(uint32_t) : sizeof(IF_ENTRY) / sizeof(uint32_t);
+		if (tag == T_ENDOFMIBVIEW || len != blen + 2
+		 || !s_under(oid, len, base, blen) || oid[blen] != COLUMNS[c].n
+		 || oid[blen + 1] <= t->cursor[c]) {
+			done |= BIT(c);
+			continue;
+		}
+
+		t->cursor[c] = oid[blen + 1];
+		row_t *r = s_row(t, t->cursor[c]);
+		if (COLUMNS[c].text) {
+			if (tag != T_STRING)
+				continue;
+			size_t m = MIN(n, TEXT_MAX - 1);
+			memcpy(r->text[COLUMNS[c].text - 1], v, m);
+			r->text[COLUMNS[c].text - 1][m] = '\0';
+
+		} else {
+			if (tag != T_INTEGER && tag != T_COUNTER32 && tag != T_GAUGE32
+			 && tag != T_TIMETICKS && tag != T_COUNTER64)
+				continue;
+			r->v[c] = tag == T_INTEGER ? (uint64_t)s_int(v, n) : s_uint(v, n);
+		}
+		r->have |= BIT(c);
+	}
+	t->walking &= ~done;
+
+	/* an answer with nothing new in it (for the columns we asked
+	   about) means there isn't anything more to get */
+	if (i == nonrep)
+		t->walking = 0;
+
+	if (t->walking) {
+		t->tries = 0;
+		s_send(fd, t);
+		return;
+	}
+	s_done(t, NULL, active);
+}
+
+/*********************************************************************/
+
+/* HOST[:PORT] COMMUNITY [cisco DESC [IFINDEX ...]] */
+static int read_targets(const char *file, int family)
+{
+	FILE *io = fopen(file, "r");
+	if (!io) {
+		perror(file);
+		return 1;
+	}
+
+	char buf[8192];
+	int lineno = 0, errors = 0;
+	while (fgets(buf, sizeof(buf), io) != NULL) {
+		lineno++;
+		char *w[64], *s = buf;
+		int n = 0;
+		while (n < 64 && (w[n] = strtok(s, " \t\r\n")) != NULL) {
+			s = NULL;
+			n++;
+		}
+		if (!n || w[0][0] == '#')
+			continue;
+
+		if (n < 2 || (n > 2 && (!streq(w[2], "cisco") || n < 4))) {
+			fprintf(stderr, "%s:%i: expected HOST[:PORT] COMMUNITY [cisco DESC [IFINDEX ...]]\n", file, lineno);
+			errors++;
+			continue;
+		}
+		if (OPTIONS.ntargets == TARGET_MAX) {
+			fprintf(stderr, "%s:%i: too many targets (max %i)\n", file, lineno, TARGET_MAX);
+			errors++;
+			break;
+		}
+
+		/* host, host:port, [v6addr] or [v6addr]:port */
+		char *host = w[0], *port = "161", *c;
+		if (*host == '[' && (c = strchr(host, ']')) != NULL) {
+			*c++ = '\0';
+			host++;
+			if (*c == ':') port = c + 1;
+		} else if ((c = strchr(host, ':')) != NULL && !strchr(c + 1, ':')) {
+			*c = '\0';
+			port = c + 1;
+		}
+
+		struct addrinfo hints, *res;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family   = family;
+		hints.ai_socktype = SOCK_DGRAM;
+		hints.ai_flags    = family == AF_INET6 ? AI_V4MAPPED : 0;
+		int rc = getaddrinfo(host, port, &hints, &res);
+		if (rc != 0) {
+			fprintf(stderr, "%s:%i: %s: %s\n", file, lineno, host, gai_strerror(rc));
+			errors++;
+			continue;
+		}
+
+		OPTIONS.targets = realloc(OPTIONS.targets, (OPTIONS.ntargets + 1) * sizeof(target_t));
+		target_t *t = &OPTIONS.targets[OPTIONS.ntargets++];
+		memset(t, 0, sizeof(target_t));
+		memcpy(&t->addr, res->ai_addr, res->ai_addrlen);
+		t->addrlen   = res->ai_addrlen;
+		t->host      = strdup(host);
+		t->community = strdup(w[1]);
+		freeaddrinfo(res);
+
+		if (n > 2) {
+			t->desc  = strdup(w[3]);
+			t->nonly = n - 4;
+			t->only  = vmalloc((t->nonly + 1) * sizeof(uint32_t));
+			int i;
+			for (i = 4; i < n; i++)
+				t->only[i - 4] = strtoul(w[i], NULL, 10);
+		}
+	}
+	fclose(io);
+	return errors;
+}
+
+int parse_options(int argc, char **argv);
+
+int main(int argc, char **argv)
+{
+	if (parse_options(argc, argv) != 0) {
+		fprintf(stderr, "USAGE: %s [options] /path/to/targets\n", argv[0]);
+		exit(1);
+	}
+
+	/* one socket for everyone; v6, taking v4 too, if we can */
+	int family = AF_INET6, off = 0;
+	int fd = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0 || setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) != 0) {
+		if (fd >= 0) close(fd);
+		family = AF_INET;
+		fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	}
+	if (fd < 0) {
+		fprintf(stderr, "unable to create a udp socket: %s\n", strerror(errno));
+		exit(2);
+	}
+	/* room for a window's worth of answers to pile up */
+	int rcvbuf = 4 * 1024 * 1024;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	if (read_targets(argv[optind], family) != 0)
+		exit(1);
+
+	static uint8_t buf[PACKET_MAX];
+	int next = 0, active = 0, i;
+	for (;;) {
+		while (active < OPTIONS.window && next < OPTIONS.ntargets) {
+			target_t *t = &OPTIONS.targets[next++];
+			t->state   = S_ACTIVE;
+			t->reps    = OPTIONS.reps;
+			t->sysname = t->desc ? 0 : 1;
+			t->walking = t->desc ? CISCO_COLUMNS : IFACES_COLUMNS;
+			s_send(fd, t);
+			active++;
+		}
+		if (!active)
+			break;
+
+		int64_t now = time_ms(), wake = -1;
+		for (i = 0; i < next; i++) {
+			target_t *t = &OPTIONS.targets[i];
+			if (t->state == S_ACTIVE && (wake < 0 || t->deadline < wake))
+				wake = t->deadline;
+		}
+
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		if (poll(&pfd, 1, (int)MAX(wake - now, 0)) < 0 && errno != EINTR) {
+			fprintf(stderr, "poll failed: %s\n", strerror(errno));
+			exit(2);
+		}
+
+		for (;;) {
+			struct sockaddr_storage from;
+			socklen_t fromlen = sizeof(from);
+			ssize_t n = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromlen);
+			if (n < 0)
+				break;
+			s_response(fd, buf, n, &from, fromlen, &active);
+		}
+
+		now = time_ms();
+		for (i = 0; i < next; i++) {
+			target_t *t = &OPTIONS.targets[i];
+			if (t->state != S_ACTIVE || now < t->deadline)
+				continue;
+
+			if (++t->tries > OPTIONS.retries) {
+				char *s = string("no response from %s", t->host);
+				s_done(t, s, &active);
+				free(s);
+				continue;
+			}
+			s_send(fd, t);
+		}
+	}
+	return 0;
+}
+
+int parse_options(int argc, char **argv)
+{
+	const char *short_opts = "h?w:m:t:r:";
+	struct option long_opts[] = {
+		{ "help",                    no_argument, 0, 'h' },
+		{ "window",            required_argument, 0, 'w' },
+		{ "max-repetitions",   required_argument, 0, 'm' },
+		{ "timeout",           required_argument, 0, 't' },
+		{ "retries",           required_argument, 0, 'r' },
+		{ 0, 0, 0, 0 },
+	};
+	int opt, idx;
+	while ((opt = getopt_long(argc, argv, short_opts, long_opts, &idx)) >= 0) {
+		switch (opt) {
+		case 'h':
+		case '?':
+			fprintf(stdout, "snmp_bulk (a Bolo collector)\n"
+			                "USAGE: snmp_bulk [options] /path/to/targets\n"
+			                "\n"
+			                "options:\n"
+			                "   -h, --help                Show this help screen\n"
+			                "   -w, --window N            Poll up to N devices at once (default 64)\n"
+			                "   -m, --max-repetitions N   Rows to ask for per GETBULK (default 10)\n"
+			                "   -t, --timeout MS          How long to wait for each answer, in\n"
+			                "                             milliseconds (default 2000)\n"
+			                "   -r, --retries N           How many times to re-ask (default 2)\n"
+			                "\n"
+			                "Walks the ifEntry / ifXEntry tables of every device in the\n"
+			                "targets file (SNMP v2c), which has one per line:\n"
+			                "\n"
+			                "    # HOST[:PORT]      COMMUNITY  [cisco DESC [IFINDEX ...]]\n"
+			                "    sw1.example.com    public\n"
+			                "    10.0.4.1:1161      s3cret     cisco core-sw-4  1 2 10101\n"
+			                "\n"
+			                "Plain targets are reported just like snmp_ifaces does, under\n"
+			                "their (lowercased) sysName.  Targets marked 'cisco' are reported\n"
+			                "the way snmp_cisco_ifaces does, under DESC, for just the given\n"
+			                "ifIndexes (or all of them, if none are given).\n"
+			                "\n");
+			exit(0);
+
+		case 'w':
+			OPTIONS.window = atoi(optarg);
+			if (OPTIONS.window < 1) OPTIONS.window = 1;
+			break;
+
+		case 'm':
+			OPTIONS.reps = atoi(optarg);
+			if (OPTIONS.reps < 1) OPTIONS.reps = 1;
+			break;
+
+		case 't':
+			OPTIONS.timeout = atoi(optarg);
+			if (OPTIONS.timeout < 1) OPTIONS.timeout = 1;
+			break;
+
+		case 'r':
+			OPTIONS.retries = atoi(optarg);
+			if (OPTIONS.retries < 0) OPTIONS.retries = 0;
+			break;
+		}
+	}
+
+	return argv[optind] ? 0 : 1;
+}